@@ -0,0 +1,155 @@
+// Variant of call_burst that shows how much the calling thread is slowed
+// down by sharing cache lines with the output thread. The calling thread is
+// bound to one CPU and the output thread to another, and the input buffer is
+// made large enough for a whole burst, so that the calling thread never has
+// to wait. What remains is the cost of writing the frame and of any cache
+// lines that the output thread (busy consuming the start of the burst)
+// takes away from the calling thread. Costs are reported as TSC cycles and,
+// if hardware counters are available, as L1 data cache misses per call.
+#include <reckless/basic_log.hpp>
+#include <reckless/template_formatter.hpp>
+#include <reckless/writer.hpp>
+
+#include <iostream>
+#include <cstdint>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <x86intrin.h>  // __rdtsc
+
+namespace {
+
+std::size_t const BURST_SIZE = 10000;
+std::size_t const BURSTS = 100;
+
+class null_writer : public reckless::writer {
+public:
+    Result write(void const*, std::size_t)
+    {
+        return SUCCESS;
+    }
+};
+
+class miss_counter {
+public:
+    miss_counter() :
+        fd_(open_counter())
+    {
+    }
+    ~miss_counter()
+    {
+        if(fd_ != -1)
+            close(fd_);
+    }
+    bool available() const
+    {
+        return fd_ != -1;
+    }
+    void start()
+    {
+        if(fd_ != -1) {
+            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    std::uint64_t stop()
+    {
+        if(fd_ == -1)
+            return 0;
+        ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+        std::uint64_t count = 0;
+        if(sizeof(count) != read(fd_, &count, sizeof(count)))
+            return 0;
+        return count;
+    }
+
+private:
+    static int open_counter()
+    {
+        perf_event_attr attr = perf_event_attr();
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_CACHE_L1D
+            | (PERF_COUNT_HW_CACHE_OP_READ << 8)
+            | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    int fd_;
+};
+
+void bind_cpu(unsigned cpu)
+{
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+struct binding_formatter {
+    static void format(reckless::output_buffer*, unsigned cpu)
+    {
+        bind_cpu(cpu);
+    }
+};
+
+class benchmark_log : public reckless::basic_log {
+public:
+    using basic_log::basic_log;
+
+    void log(char c, int i, float f)
+    {
+        write<reckless::template_formatter>("Hello World! %s %d %f", c, i, f);
+    }
+    void bind_output_thread(unsigned cpu)
+    {
+        write<binding_formatter>(cpu);
+    }
+};
+
+}
+
+int main()
+{
+    long cpu_count = sysconf(_SC_NPROCESSORS_ONLN);
+    if(cpu_count < 2)
+        std::cerr << "warning: only one CPU, the output thread will share it"
+            " with the calling thread" << std::endl;
+    bind_cpu(0);
+
+    null_writer writer;
+    miss_counter counter;
+    std::uint64_t cycles = 0;
+    std::uint64_t misses = 0;
+    {
+        benchmark_log log(&writer, 0, 0, 2*BURST_SIZE*64);
+        log.bind_output_thread(cpu_count < 2? 0 : 1);
+        char c = 'A';
+        float pi = 3.1415f;
+        for(std::size_t burst=0; burst!=BURSTS; ++burst) {
+            counter.start();
+            auto start = __rdtsc();
+            for(std::size_t i=0; i!=BURST_SIZE; ++i)
+                log.log(c, static_cast<int>(i), pi);
+            cycles += __rdtsc() - start;
+            misses += counter.stop();
+            // Let the output thread catch up before the next burst.
+            usleep(20000);
+        }
+    }
+
+    double calls = static_cast<double>(BURST_SIZE*BURSTS);
+    std::cout << static_cast<double>(cycles)/calls << " cycles/call";
+    if(counter.available())
+        std::cout << ", " << static_cast<double>(misses)/calls
+            << " L1D read misses/call";
+    std::cout << std::endl;
+    return 0;
+}
@@ -0,0 +1,209 @@
+// Measures the cost of encoding an input frame on the calling thread and of
+// decoding it on the output thread. The same three values (an
+// int, a double and a pointer) are logged once as plain arguments, which get
+// the packed frame layout, and once wrapped in a type with a destructor, which
+// forces the std::tuple layout. Costs are reported as retired instructions per
+// message if hardware counters are available, otherwise as TSC cycles.
+//
+// Both cases are run once to warm up caches and branch predictors, and then
+// for a number of rounds, taking turns at going first. The median of the
+// rounds is reported.
+#include <reckless/basic_log.hpp>
+#include <reckless/writer.hpp>
+
+#include <algorithm>    // nth_element
+#include <iostream>
+#include <vector>
+#include <cstdint>
+
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include <x86intrin.h>  // __rdtsc
+
+namespace {
+
+std::size_t const MESSAGES = 100000;
+unsigned const ROUNDS = 11;
+
+class null_writer : public reckless::writer {
+public:
+    Result write(void const*, std::size_t)
+    {
+        return SUCCESS;
+    }
+};
+
+class counter {
+public:
+    counter() :
+        fd_(open_counter())
+    {
+    }
+    ~counter()
+    {
+        if(fd_ != -1)
+            close(fd_);
+    }
+    char const* unit() const
+    {
+        return fd_ == -1? "cycles" : "instructions";
+    }
+    void start()
+    {
+        if(fd_ == -1) {
+            start_ = __rdtsc();
+        } else {
+            ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+            ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+    std::uint64_t stop()
+    {
+        if(fd_ == -1)
+            return __rdtsc() - start_;
+        ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+        std::uint64_t count = 0;
+        if(sizeof(count) != read(fd_, &count, sizeof(count)))
+            return 0;
+        return count;
+    }
+
+private:
+    static int open_counter()
+    {
+        perf_event_attr attr = perf_event_attr();
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.size = sizeof(attr);
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        return static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+    }
+
+    int fd_;
+    std::uint64_t start_;
+};
+
+template <class T>
+struct boxed {
+    boxed(T v) : value(v) {}
+    ~boxed() {}
+    T value;
+};
+
+// The formatters copy the raw values to the output buffer instead of
+// converting them to text, so that the frame handling is not drowned out by
+// the cost of formatting.
+void write_values(reckless::output_buffer* pbuffer, int i, double d,
+        void const* p)
+{
+    pbuffer->write(&i, sizeof(i));
+    pbuffer->write(&d, sizeof(d));
+    pbuffer->write(&p, sizeof(p));
+}
+
+struct plain_formatter {
+    static void format(reckless::output_buffer* pbuffer, int i, double d,
+            void const* p)
+    {
+        write_values(pbuffer, i, d, p);
+    }
+};
+
+struct boxed_formatter {
+    static void format(reckless::output_buffer* pbuffer, boxed<int>&& i,
+            boxed<double>&& d, boxed<void const*>&& p)
+    {
+        write_values(pbuffer, i.value, d.value, p.value);
+    }
+};
+
+// Frame size, and cost per message of encoding and decoding for each round.
+struct costs {
+    std::size_t frame_size;
+    std::vector<double> encode;
+    std::vector<double> decode;
+};
+
+template <class Formatter, class... Args>
+void run(counter& c, costs* presult, Args const&... args)
+{
+    using namespace reckless::detail;
+    typedef frame_layout<Args...> layout;
+    std::size_t const frame_size = (layout::frame_size + 7)/8*8;
+    std::vector<std::uint64_t> frames(MESSAGES*frame_size/8);
+    char* pframes = reinterpret_cast<char*>(frames.data());
+
+    c.start();
+    for(std::size_t i=0; i!=MESSAGES; ++i)
+        construct_frame<Formatter>(pframes + i*frame_size, layout::frame_size, args...);
+    std::uint64_t encode = c.stop();
+
+    null_writer writer;
+    reckless::output_buffer output(&writer, 1024*1024);
+    c.start();
+    for(std::size_t i=0; i!=MESSAGES; ++i) {
+        char* pframe = pframes + i*frame_size;
+        auto pdispatch = *reinterpret_cast<formatter_dispatch_function_t**>(pframe);
+        (*pdispatch)(&output, pframe);
+    }
+    std::uint64_t decode = c.stop();
+
+    if(presult) {
+        presult->frame_size = layout::frame_size;
+        presult->encode.push_back(static_cast<double>(encode)/MESSAGES);
+        presult->decode.push_back(static_cast<double>(decode)/MESSAGES);
+    }
+}
+
+double median(std::vector<double> v)
+{
+    std::nth_element(v.begin(), v.begin() + v.size()/2, v.end());
+    return v[v.size()/2];
+}
+
+void report(char const* name, counter const& c, costs const& result)
+{
+    std::cout << name << " (" << result.frame_size << "-byte frames): "
+        << median(result.encode) << " " << c.unit() << "/message encode, "
+        << median(result.decode) << " " << c.unit() << "/message decode"
+        << std::endl;
+}
+
+}
+
+int main()
+{
+    counter c;
+    int i = 42;
+    double d = 3.1415;
+    void const* p = &i;
+    auto run_trivial = [&](costs* presult)
+    {
+        run<plain_formatter>(c, presult, i, d, p);
+    };
+    auto run_non_trivial = [&](costs* presult)
+    {
+        run<boxed_formatter>(c, presult, boxed<int>(i), boxed<double>(d),
+                boxed<void const*>(p));
+    };
+
+    run_trivial(nullptr);
+    run_non_trivial(nullptr);
+    costs trivial, non_trivial;
+    for(unsigned round=0; round!=ROUNDS; ++round) {
+        if(round % 2 == 0) {
+            run_trivial(&trivial);
+            run_non_trivial(&non_trivial);
+        } else {
+            run_non_trivial(&non_trivial);
+            run_trivial(&trivial);
+        }
+    }
+    report("trivial", c, trivial);
+    report("non-trivial", c, non_trivial);
+    return 0;
+}
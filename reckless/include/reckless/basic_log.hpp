@@ -3,26 +3,385 @@
 
 #include "reckless/detail/thread_input_buffer.hpp"
 #include "reckless/detail/spsc_event.hpp"
+#include "reckless/detail/mpsc_queue.hpp"
+#include "reckless/detail/numa.hpp"
+#include "reckless/detail/input_buffer_pool.hpp"
 #include "reckless/detail/branch_hints.hpp" // likely
 #include "reckless/output_buffer.hpp"
-
-#include <boost_1_56_0/lockfree/queue.hpp>
+#include "reckless/memory_provider.hpp"
+#include "reckless/inline_string.hpp"
 
 #include <thread>
+#include <atomic>
+#include <exception>    // exception_ptr
 #include <functional>
+#include <memory>       // unique_ptr
+#include <string>
 #include <tuple>
-
-#include <pthread.h>    // pthread_key_t
+#include <type_traits>
+#include <vector>
+#include <cstdint>       // uint64_t
+#include <cstring>       // memcpy
 
 namespace reckless {
 namespace detail {
     template <class Formatter, typename... Args>
     std::size_t formatter_dispatch(output_buffer* poutput, char* pinput);
+    class formatter_pool;
+
+// Maximum number of basic_log instances that may exist at the same time
+// (each shard of a sharded_log is one). Every thread has a slot for each of
+// them in static TLS (see below), which is a limited resource when the
+// library is loaded with dlopen, so the limit is not much higher.
+std::size_t const max_log_instances = 64;
+
+// Per-thread input buffers, indexed by basic_log instance id. This is a
+// __thread POD array rather than a thread_local, since an extern thread_local
+// is accessed through a wrapper function that checks for dynamic
+// initialization. With the initial-exec model, looking up a buffer is a single
+// load relative to the thread pointer. The buffers are destroyed at thread
+// exit by a pthreads key destructor (see basic_log.cpp).
+extern __thread thread_input_buffer* thread_input_buffers[max_log_instances]
+    __attribute__((tls_model("initial-exec")));
+// The generation of the log instance that each of the thread's input
+// buffers belongs to. An instance id is reused by later logs, and a log
+// destroys all of its buffers when it goes away, including those that are
+// still in the slots of other threads. A buffer is only used if its
+// generation is that of the log with the id.
+extern __thread unsigned thread_input_buffer_generations[max_log_instances]
+    __attribute__((tls_model("initial-exec")));
+
+template <bool... Values>
+struct bool_pack {
+};
+
+// True if every argument can be written to the input frame with memcpy and
+// dropped afterwards without calling a destructor. This is the common case
+// (integers, floating-point values, pointers), and such frames get a packed
+// layout instead of a std::tuple.
+template <typename... Args>
+struct is_trivial_frame : std::is_same<
+    bool_pack<true, (std::is_trivially_copyable<Args>::value &&
+        std::is_trivially_destructible<Args>::value)...>,
+    bool_pack<(std::is_trivially_copyable<Args>::value &&
+        std::is_trivially_destructible<Args>::value)..., true>>
+{
+};
+
+// True if basic_log::strict_write may store the argument, i.e. if it can be
+// copied to the input frame without running code that might allocate memory
+// or make a system call. Captured strings qualify, since strict_write never
+// puts their characters on the heap.
+template <class T>
+struct is_strict_argument : std::integral_constant<bool,
+    std::is_trivially_copyable<T>::value ||
+    std::is_base_of<inline_string, T>::value>
+{
+};
+
+template <typename... Args>
+struct is_strict_frame : std::is_same<
+    bool_pack<true, is_strict_argument<Args>::value...>,
+    bool_pack<is_strict_argument<Args>::value..., true>>
+{
+};
+
+inline constexpr std::size_t align_offset(std::size_t offset, std::size_t alignment)
+{
+    return (offset + alignment-1)/alignment*alignment;
 }
 
+// True if an argument is left out of a packed frame. Empty types
+// (no_indent, compiled formats, static header fields and so on) carry no
+// state, so they take no space at all and are default-constructed on the
+// output thread without reading anything from the frame. They are the
+// constant parts of a call site; the dispatch function pointer at the start
+// of the frame identifies them through its template arguments.
+template <typename T>
+struct is_elided_argument : std::integral_constant<bool,
+    std::is_empty<T>::value && std::is_default_constructible<T>::value>
+{
+};
+
+// Number of bytes that an argument occupies in a packed frame.
+template <typename T>
+struct packed_size : std::integral_constant<std::size_t,
+    is_elided_argument<T>::value? 0 : sizeof(T)>
+{
+};
+
+template <typename T>
+struct packed_align : std::integral_constant<std::size_t,
+    is_elided_argument<T>::value? 1 : alignof(T)>
+{
+};
+
+// Offset of argument number Index in a packed frame where the first argument
+// is placed at Offset or later.
+template <std::size_t Index, std::size_t Offset, typename... Args>
+struct packed_argument_offset;
+
+template <std::size_t Offset, typename T, typename... Args>
+struct packed_argument_offset<0, Offset, T, Args...> :
+    std::integral_constant<std::size_t, align_offset(Offset, packed_align<T>::value)>
+{
+};
+
+template <std::size_t Index, std::size_t Offset, typename T, typename... Args>
+struct packed_argument_offset<Index, Offset, T, Args...> :
+    packed_argument_offset<Index-1,
+        align_offset(Offset, packed_align<T>::value) + packed_size<T>::value, Args...>
+{
+};
+
+template <std::size_t Offset, typename... Args>
+struct packed_arguments_end : std::integral_constant<std::size_t, Offset>
+{
+};
+
+template <std::size_t Offset, typename T, typename... Args>
+struct packed_arguments_end<Offset, T, Args...> :
+    packed_arguments_end<
+        align_offset(Offset, packed_align<T>::value) + packed_size<T>::value, Args...>
+{
+};
+
+// An input frame consists of a pointer to the formatter dispatch function
+// followed by a tuple of the arguments, followed by the characters of any
+// captured strings (see inline_string).
+template <bool Trivial, typename... Args>
+struct frame_layout_base {
+    static bool const trivial = false;
+    typedef std::tuple<Args...> args_t;
+    static std::size_t const args_align = alignof(args_t);
+    static std::size_t const args_offset = (sizeof(formatter_dispatch_function_t*) + args_align-1)/args_align*args_align;
+    static std::size_t const frame_size = args_offset + sizeof(args_t);
+};
+
+// If all arguments are trivial, they are instead stored back to back after
+// the dispatch function pointer, each at its natural alignment. Copying
+// them is as cheap as a memcpy, and the output thread has no tuple to
+// unpack and no destructor to call.
+template <typename... Args>
+struct frame_layout_base<true, Args...> {
+    static bool const trivial = true;
+    static std::size_t const args_offset = sizeof(formatter_dispatch_function_t*);
+    static std::size_t const frame_size = packed_arguments_end<args_offset, Args...>::value;
+    static std::size_t const argument_count = sizeof...(Args);
+
+    template <std::size_t Index>
+    struct argument {
+        typedef typename std::tuple_element<Index, std::tuple<Args...>>::type type;
+        static std::size_t const offset =
+            packed_argument_offset<Index, args_offset, Args...>::value;
+    };
+};
+
+template <typename... Args>
+struct frame_layout :
+    frame_layout_base<is_trivial_frame<Args...>::value, Args...>
+{
+};
+
+// Returns the size of the input frame needed for the given arguments. If
+// captured strings would take up too much of the input buffer, the size
+// excludes them and construct_frame will put them on the heap instead.
+template <typename... Args>
+std::size_t input_frame_size(thread_input_buffer const* pbuffer, Args&&... args)
+{
+    typedef frame_layout<typename frame_argument<Args>::type...> layout;
+    std::size_t captured_size = total_captured_size(args...);
+    if(likely(captured_size == 0))
+        return layout::frame_size;
+    std::size_t frame_size = layout::frame_size + captured_size;
+    if(unlikely(frame_size > pbuffer->capacity()/2))
+        return layout::frame_size;
+    return frame_size;
+}
+
+template <class Layout, typename... Args>
+void construct_frame_arguments(std::false_type, char* pframe,
+        std::size_t frame_size, Args&&... args)
+{
+    char* pinline = frame_size == Layout::frame_size? nullptr :
+        pframe + Layout::frame_size;
+    (void) pinline;     // unused if there are no captured strings
+
+    // FIXME exception safety when copy constructing arguments, both here
+    // and in the output thread.
+    new (pframe + Layout::args_offset) typename Layout::args_t(
+        store_frame_argument(pinline, std::forward<Args>(args))...);
+}
+
+template <class T, typename Arg>
+void store_packed_argument(std::true_type, char*, Arg const&)
+{
+}
+
+template <class T, typename Arg>
+void store_packed_argument(std::false_type, char* p, Arg const& arg)
+{
+    new (p) T(arg);
+}
+
+template <class T, typename Arg>
+void store_packed_argument(char* p, Arg const& arg)
+{
+    store_packed_argument<T>(is_elided_argument<T>(), p, arg);
+}
+
+template <class Layout, std::size_t... Indexes, typename... Args>
+void construct_packed_arguments(char* pframe, index_sequence<Indexes...>,
+        Args const&... args)
+{
+    int dummy[] = {0, (store_packed_argument<
+        typename Layout::template argument<Indexes>::type>(
+            pframe + Layout::template argument<Indexes>::offset, args), 0)...};
+    (void) dummy;
+    (void) pframe;
+}
+
+template <class Layout, typename... Args>
+void construct_frame_arguments(std::true_type, char* pframe,
+        std::size_t, Args&&... args)
+{
+    typename make_index_sequence<sizeof...(Args)>::type indexes;
+    construct_packed_arguments<Layout>(pframe, indexes, args...);
+}
+
+template <class Formatter, typename... Args>
+void construct_frame(char* pframe, std::size_t frame_size, Args&&... args)
+{
+    typedef frame_layout<typename frame_argument<Args>::type...> layout;
+    *reinterpret_cast<formatter_dispatch_function_t**>(pframe) =
+        &formatter_dispatch<Formatter, typename frame_argument<Args>::type...>;
+    construct_frame_arguments<layout>(
+        std::integral_constant<bool, layout::trivial>(), pframe, frame_size,
+        std::forward<Args>(args)...);
+}
+
+// Destroys the arguments of a frame that will never be formatted.
+template <class Layout>
+void destroy_frame_arguments(std::false_type, char* pframe)
+{
+    typedef typename Layout::args_t args_t;
+    reinterpret_cast<args_t*>(pframe + Layout::args_offset)->~args_t();
+}
+
+template <class Layout>
+void destroy_frame_arguments(std::true_type, char*)
+{
+}
+
+template <typename... Args>
+void destroy_frame(char* pframe)
+{
+    typedef frame_layout<typename frame_argument<Args>::type...> layout;
+    destroy_frame_arguments<layout>(
+        std::integral_constant<bool, layout::trivial>(), pframe);
+}
+
+// Formatters may provide
+//     static void format_dropped_messages(output_buffer*, std::size_t count);
+// to write a line about messages that were dropped because of the overflow
+// policy. If they don't, dropped messages are only counted.
+template <class Formatter, class = void>
+struct has_dropped_messages_format : std::false_type {
+};
+
+template <class Formatter>
+struct has_dropped_messages_format<Formatter, decltype(
+    Formatter::format_dropped_messages(std::declval<output_buffer*>(), std::size_t()))> :
+    std::true_type
+{
+};
+
+template <class Formatter>
+struct dropped_messages_formatter {
+    static void format(output_buffer* poutput, std::size_t count)
+    {
+        Formatter::format_dropped_messages(poutput, count);
+    }
+};
+}
+
+// What to do when a thread writes to the log and there is no room in its
+// input buffer, or in the queue shared by all threads. See
+// basic_log::set_overflow_policy.
+enum class overflow_policy : unsigned char {
+    // Wait until the output thread has made room. Nothing is lost, but the
+    // calling thread may be held up by a slow disk.
+    block,
+    // Discard the message.
+    drop,
+    // Discard low-severity messages (e.g. debug and info messages in
+    // severity_log), and wait for room for the others. Low-severity messages
+    // are also discarded once the input buffer is three quarters full, so
+    // that they can't fill up the space needed by the others.
+    drop_low_severity
+};
+
+// How threads hand over committed log entries to the output thread. See
+// basic_log::set_commit_mode.
+enum class commit_mode : unsigned char {
+    // Every commit is pushed on a queue shared by all threads. The output
+    // thread writes the entries of different threads in the order they were
+    // committed.
+    shared_queue,
+    // Each commit is only published in the thread's own input buffer, and
+    // the output thread polls the input buffers of all threads in turn.
+    // Apart from registering its input buffer once, a thread never writes
+    // to memory shared with other threads, and only wakes the output thread
+    // when its input buffer goes from empty to non-empty. Entries from the
+    // same thread are written in order, but entries from different threads
+    // may be interleaved in any order.
+    polled_buffers,
+    // Like polled_buffers, but each entry is stamped with the CPU time stamp
+    // counter when it is written, and the output thread merges the entries
+    // of all threads in stamp order. An entry is held back until it is
+    // older than the merge window (see basic_log::set_merge_window), so that
+    // entries from threads that were slower to commit can still be put
+    // before it. This needs an invariant time stamp counter that is
+    // synchronized between CPUs, as on any recent x86 processor, or the
+    // virtual counter of ARMv8. Other processors use the monotonic clock,
+    // which costs more per entry.
+    merged_buffers
+};
+
+// How the output thread waits for more input when it has nothing to do. See
+// basic_log::set_wakeup_policy.
+enum class wakeup_policy : unsigned char {
+    // Sleep, and check for input again after a timeout. The timeouts grow
+    // longer the longer the thread stays idle, up to the maximum idle wait
+    // (see basic_log::set_max_idle_wait). Threads that run out of room wake
+    // the output thread up right away, so only the time until other entries
+    // are written is affected.
+    timed_wait,
+    // Check for input a number of times (see basic_log::set_spin_budget)
+    // before sleeping as with timed_wait. This saves the time it takes to go
+    // to sleep and wake up again when entries come in short bursts.
+    spin_then_wait,
+    // Never sleep, and check for input continuously. Entries are picked up
+    // as soon as they are committed, but the output thread keeps a CPU busy
+    // all the time, so it should have one of its own.
+    busy_poll
+};
+
+// Input consumed by the output thread (and formatter threads) from input
+// buffers on one NUMA node. See basic_log::numa_statistics.
+struct numa_node_statistics {
+    // Bytes of log entries read from input buffers on the node.
+    std::uint64_t input_bytes;
+    // The part of input_bytes that was read while running on another node.
+    std::uint64_t remote_input_bytes;
+};
+
 // TODO generic_log better name?
 class basic_log {
 public:
+    // At most detail::max_log_instances (64) logs may exist at the same
+    // time, counting each shard of a sharded_log. The constructors throw
+    // std::bad_alloc if there are that many already.
     basic_log();
     // FIXME shared_input_queue_size seems like the least interesting of these
     // and should be moved to the end.
@@ -43,58 +402,585 @@ public:
 
     void panic_flush();
 
+    // Sets how log entries are handed over to the output thread. The
+    // default is commit_mode::shared_queue. This can only be done while the
+    // log is closed.
+    void set_commit_mode(commit_mode mode);
+    // Sets how long the output thread holds back entries with
+    // commit_mode::merged_buffers, waiting for older entries from other
+    // threads. With 0, only entries that are waiting at the same time are
+    // put in order. The default is 1000 microseconds.
+    void set_merge_window(unsigned microseconds);
+    // Sets the number of threads that help the output thread format log
+    // entries with commit_mode::shared_queue. The output is the same as
+    // without them. Entries from the same thread are formatted one after
+    // the other, so this only helps when several threads write to the log.
+    // Formatters must not keep any state of their own on the output thread;
+    // logs whose formatters do (binary_log) throw std::logic_error if count
+    // is not 0. The default is 0. This can only be done while the log is
+    // closed.
+    void set_formatter_threads(unsigned count);
+    // Lets up to max_helpers threads at a time that are blocked waiting for
+    // room in their input buffer or the shared input queue help format
+    // entries instead, with commit_mode::shared_queue. The same restrictions
+    // apply as for set_formatter_threads(). The default is 0. This can only
+    // be done while the log is closed.
+    void set_cooperative_draining(unsigned max_helpers);
+    // Sets how the output thread waits for input when it is idle. The
+    // default is wakeup_policy::timed_wait.
+    void set_wakeup_policy(wakeup_policy policy);
+    // Sets how many times the output thread checks for input before it goes
+    // to sleep with wakeup_policy::spin_then_wait. The default is 10000.
+    void set_spin_budget(unsigned checks);
+    // Sets the longest time that an idle output thread sleeps before it
+    // checks for input again, which bounds the delay before an entry is
+    // written. The default is 1000 milliseconds.
+    void set_max_idle_wait(unsigned milliseconds);
+    // The following settings for the output thread take effect when the log
+    // is opened, and can only be changed while it is closed. Threads that
+    // the output thread starts (see set_formatter_threads) inherit them,
+    // except for the start hook. If one of them can't be applied, open()
+    // throws std::system_error and the log stays closed.
+    //
+    // Sets the CPUs that the output thread may run on. With an empty list
+    // (the default) it may run on any CPU that the thread calling open()
+    // may run on.
+    void set_output_thread_affinity(std::vector<unsigned> const& cpus);
+    // Sets the scheduling policy (e.g. SCHED_OTHER or SCHED_FIFO) and
+    // priority of the output thread, as with pthread_setschedparam. By
+    // default they are inherited from the thread calling open().
+    void set_output_thread_scheduling(int policy, int priority);
+    // Sets the nice value of the output thread. By default it is inherited
+    // from the thread calling open().
+    void set_output_thread_nice(int nice);
+    // Sets the name of the output thread, as shown by ps and debuggers.
+    // Linux only keeps the first 15 characters.
+    void set_output_thread_name(std::string const& name);
+    // Sets a function that the output thread calls when it starts, after
+    // the other settings have been applied and before it handles any log
+    // entries. If it throws, open() throws the same exception.
+    void set_output_thread_start_hook(std::function<void()> hook);
+    // Sets the overflow policy for all threads, except those that have set
+    // their own with set_thread_overflow_policy(). The default is
+    // overflow_policy::block.
+    void set_overflow_policy(overflow_policy policy);
+    // Sets the overflow policy for the calling thread. The policy is kept
+    // with the thread's input buffer, so the buffer is created if the
+    // thread doesn't have one yet, which may throw std::bad_alloc.
+    void set_thread_overflow_policy(overflow_policy policy);
+    // Sets the number of bytes that each thread may add to its input buffer
+    // in extra segments, to absorb a burst of log entries that doesn't fit
+    // in the buffer. The segments are returned once the output thread has
+    // caught up. open() resets this to 8 times the thread input buffer
+    // size. Entries that are larger than the input buffer get a segment of
+    // their own, even if the limit is 0.
+    void set_input_buffer_growth_limit(std::size_t bytes);
+    // Gives the calling thread an input buffer of the given size instead of
+    // thread_input_buffer_size. This is best done before the thread's first
+    // write to the log; otherwise the current buffer is handed over to the
+    // output thread, which frees it once everything in it has been written.
+    // That is put off while the thread has a handle to the log.
+    void set_thread_input_buffer_size(std::size_t size);
+    // Makes input buffers that are created from now on use a ring that is
+    // mapped twice in a row in virtual memory. Log entries can then continue
+    // past the end of the ring, so no space is wasted at the end and entries
+    // can be almost as large as the whole buffer. The buffer size is rounded
+    // up to a multiple of the page size. Ordinary buffers are used if the
+    // system doesn't support this (it needs memfd_create).
+    void set_mirrored_input_buffers(bool enable);
+    // Lets the input buffer of a thread that keeps having to wait for the
+    // output thread grow, by doubling its size each time it has waited a
+    // number of times, up to max_size. 0 (the default) turns this off.
+    void set_input_buffer_auto_sizing(std::size_t max_size);
+    // Makes input buffers that are created from now on allocate their
+    // memory on the NUMA node that the creating thread is running on, so
+    // that writing log entries stays within the node. Only the output
+    // thread reads from another node then, and it can be kept on the same
+    // node as the threads that write most (see set_output_thread_affinity
+    // and sharded_log::set_numa_sharding). Nothing changes on a system with
+    // a single node.
+    void set_numa_local_input_buffers(bool enable);
+    // Keeps up to max_buffers input buffers of exited threads for new
+    // threads to use, instead of freeing them and allocating new ones. A
+    // buffer is only reused for a thread that wants one of the same size
+    // (and kind, see set_mirrored_input_buffers and
+    // set_numa_local_input_buffers). The memory of a buffer that has not
+    // been reused after idle_release_ms milliseconds is given back to the
+    // system, although the buffer stays in the pool. 0 (the default) turns
+    // pooling off.
+    void set_input_buffer_pool(std::size_t max_buffers,
+            unsigned idle_release_ms = 1000);
+    // Limits the total size of all input buffers, pooled or in use, to the
+    // given number of bytes. Pooled buffers are freed to make room for new
+    // ones; if that is not enough, writing from a thread that doesn't have a
+    // buffer yet throws std::bad_alloc. Segments (see
+    // set_input_buffer_growth_limit) are not included. 0 (the default)
+    // means no limit.
+    void set_input_buffer_memory_budget(std::size_t bytes);
+    // Makes the log allocate its buffers from pprovider: the shared input
+    // queue and output buffers when it is opened, and input buffers as
+    // threads start writing (except for the rings of mirrored input
+    // buffers, which are always mapped by the log). The provider must
+    // outlive the log, which frees the input buffers of all threads when it
+    // is destroyed. nullptr (the default) means the heap. Must be called
+    // while the log is closed.
+    void set_memory_provider(memory_provider* pprovider);
+    // Creates the input buffer of the calling thread, if it doesn't have one
+    // yet, and faults in its pages, so that the first entries that the thread
+    // writes don't pay for that. Call it at the start of a latency-sensitive
+    // thread, and before it uses strict_write. Does nothing more if the
+    // thread has unconsumed input.
+    void warm_up();
+    // Returns the number of messages from the calling thread that have been
+    // dropped because of the overflow policy. The output thread writes a
+    // line about dropped messages (if the formatter supports it) along with
+    // the next message that the thread manages to write. If the thread
+    // stops writing or exits before then, the output thread writes the line
+    // on its own once it has caught up with the input, or when the log is
+    // closed. This never allocates memory or throws.
+    std::size_t dropped_messages();
+    // Returns the number of messages that all threads, including those that
+    // have exited, have dropped because of the overflow policy since the
+    // log was created.
+    std::uint64_t total_dropped_messages() const;
+    // Returns how much input has been consumed from input buffers on each
+    // NUMA node since the log was first opened, indexed by node. Only
+    // buffers that were placed on a node with set_numa_local_input_buffers
+    // are counted.
+    std::vector<numa_node_statistics> numa_statistics() const;
+    // Returns how well the input buffer pool is doing, and how much memory
+    // the input buffers take up. See set_input_buffer_pool.
+    input_buffer_pool_statistics input_buffer_statistics();
+
+    // Handle for writing several entries from the calling thread and
+    // publishing them to the output thread with a single commit(). Writing
+    // through basic_log looks up the thread's input buffer and pushes an entry
+    // on the shared queue for every call; a handle does the lookup once when
+    // it is constructed, and only touches the shared queue on commit().
+    //
+    // A handle must only be used by the thread that created it, and must be
+    // destroyed before the thread exits. Entries that have not been committed
+    // are committed by the destructor. If the thread's input buffer fills up
+    // then pending entries are committed automatically, since the output
+    // thread can't make room for new ones until it knows about them.
+    // The overflow policy applies to the input buffer, but commit() always
+    // waits if the shared queue is full.
+    //
+    // Like basic_log, this class provides no public functions for writing to
+    // the log. See policy_log::handle or severity_log::handle.
+    class handle {
+    public:
+        explicit handle(basic_log& log) :
+            plog_(&log),
+            pbuffer_(log.get_input_buffer()),
+            pending_(false)
+        {
+            ++pbuffer_->handle_count;
+        }
+        ~handle()
+        {
+            commit();
+            --pbuffer_->handle_count;
+        }
+
+        handle(handle const&) = delete;
+        handle& operator=(handle const&) = delete;
+
+        void commit()
+        {
+            if(pending_) {
+                plog_->queue_commit_extent({pbuffer_, pbuffer_->input_end()});
+                pending_ = false;
+            }
+        }
+
+    protected:
+        // LowSeverity is passed on to the overflow policy, see
+        // overflow_policy::drop_low_severity.
+        template <class Formatter, bool LowSeverity = false, typename... Args>
+        void write(Args&&... args)
+        {
+            using namespace detail;
+            if(unlikely(pbuffer_->unreported_dropped_messages.load(
+                            std::memory_order_relaxed) != 0))
+            {
+                pending_ |= 0 != plog_->write_dropped_messages<Formatter>(
+                        pbuffer_, false, LowSeverity);
+            }
+            std::size_t frame_size = input_frame_size(pbuffer_, args...);
+            char* pframe = plog_->try_allocate_input_frame(pbuffer_,
+                    frame_size, LowSeverity);
+            if(unlikely(pframe == nullptr)) {
+                commit();
+                pframe = plog_->allocate_input_frame(pbuffer_, frame_size,
+                        LowSeverity);
+                if(pframe == nullptr) {
+                    plog_->count_dropped_message<Formatter>(pbuffer_);
+                    return;
+                }
+            }
+            construct_frame<Formatter>(pframe, frame_size,
+                    std::forward<Args>(args)...);
+            pending_ = true;
+        }
+
+    private:
+        basic_log* plog_;
+        detail::thread_input_buffer* pbuffer_;
+        bool pending_;
+    };
+
 protected:
-    template <class Formatter, typename... Args>
+    // Called from the constructor of a log whose formatter keeps state on
+    // the output thread from one entry to the next, so that every entry has
+    // to be formatted there, in order. set_formatter_threads and
+    // set_cooperative_draining then refuse to hand entries to other
+    // threads.
+    void require_output_thread_formatting()
+    {
+        output_thread_formatting_only_ = true;
+    }
+
+    // LowSeverity is passed on to the overflow policy, see
+    // overflow_policy::drop_low_severity.
+    template <class Formatter, bool LowSeverity = false, typename... Args>
     void write(Args&&... args)
     {
         using namespace detail;
-        typedef std::tuple<typename std::decay<Args>::type...> args_t;
-        std::size_t const args_align = alignof(args_t);
-        std::size_t const args_offset = (sizeof(formatter_dispatch_function_t*) + args_align-1)/args_align*args_align;
-        std::size_t const frame_size = args_offset + sizeof(args_t);
-
         auto pbuffer = get_input_buffer();
-        char* pframe = pbuffer->allocate_input_frame(frame_size);
-        *reinterpret_cast<formatter_dispatch_function_t**>(pframe) =
-            &detail::formatter_dispatch<Formatter, typename std::decay<Args>::type...>;
+        if(unlikely(pbuffer->unreported_dropped_messages.load(
+                        std::memory_order_relaxed) != 0))
+        {
+            report_dropped_messages<Formatter>(pbuffer, LowSeverity);
+        }
+        auto previous_end = pbuffer->mark_input_end();
+        std::size_t frame_size = input_frame_size(pbuffer, args...);
+        char* pframe = try_allocate_input_frame(pbuffer, frame_size,
+                LowSeverity);
+        if(unlikely(pframe == nullptr)) {
+            pframe = allocate_input_frame(pbuffer, frame_size, LowSeverity);
+            if(pframe == nullptr) {
+                count_dropped_message<Formatter>(pbuffer);
+                return;
+            }
+        }
+        construct_frame<Formatter>(pframe, frame_size,
+                std::forward<Args>(args)...);
 
-        // FIXME exception safety when copy constructing arguments, both here
-        // and in the output thread.
-        new (pframe + args_offset) args_t(std::forward<Args>(args)...);
+        // Use a handle if you want to write several entries and commit them
+        // together.
+        if(unlikely(not try_queue_commit_extent({pbuffer, pbuffer->input_end()},
+                        LowSeverity)))
+        {
+            destroy_frame<Args...>(pframe);
+            pbuffer->rewind_input_end(previous_end);
+            count_dropped_message<Formatter>(pbuffer);
+        }
+    }
 
-        // TODO ideally queue_commit_extent would be called in a separate
-        // commit() or flush() function, but then we have to call
-        // get_input_buffer() twice which bloats the code at the call site. But
-        // if we make get_input_buffer() protected (i.e. move
-        // thread_input_buffer from the detail namespace) then we can delegate
-        // the call to get_input_buffer to the derived class, which could then
-        // call write multiple times followed by commit() if it wants to
-        // without having to fetch the TLS variable every time.
-        queue_commit_extent({pbuffer, pbuffer->input_end()});
+    // Same as write, but never makes a system call, allocates memory or
+    // waits, so that it can be called from real-time threads:
+    // * Only arguments that are trivially copyable (or strings, which are
+    //   copied to the input buffer) are accepted; others are rejected at
+    //   compile time, since their copy constructors might allocate memory.
+    // * The thread must already have an input buffer (see warm_up). If it
+    //   doesn't, the message is discarded. The buffer is never resized.
+    // * The message is discarded if there is no room for it in the input
+    //   buffer (no segments are allocated) or in the shared queue, whatever
+    //   the overflow policy. It is also discarded if its strings would
+    //   take up more than half of the input buffer. drop_low_severity still
+    //   keeps room for messages that are not low-severity.
+    // * The output thread is never woken up. It picks up the message when
+    //   it next looks for input on its own (see set_wakeup_policy).
+    // * In panic mode (see install_crash_handler), the message is discarded
+    //   instead of suspending the thread.
+    template <class Formatter, bool LowSeverity = false, typename... Args>
+    void strict_write(Args&&... args)
+    {
+        using namespace detail;
+        typedef frame_layout<typename frame_argument<Args>::type...> layout;
+        static_assert(is_strict_frame<
+                typename frame_argument<Args>::type...>::value,
+                "strict_write only accepts arguments that are strings or "
+                "trivially copyable");
+        auto pbuffer = current_input_buffer();
+        if(unlikely(pbuffer == nullptr))
+            return;
+        if(unlikely(pbuffer->unreported_dropped_messages.load(
+                        std::memory_order_relaxed) != 0))
+        {
+            report_dropped_messages<Formatter>(pbuffer, LowSeverity, true);
+        }
+        auto previous_end = pbuffer->mark_input_end();
+        // Strings that input_frame_size leaves out of the frame would go on
+        // the heap.
+        std::size_t frame_size = input_frame_size(pbuffer, args...);
+        char* pframe = nullptr;
+        if(likely(frame_size == layout::frame_size
+                    + total_captured_size(args...)))
+        {
+            pframe = try_allocate_input_frame(pbuffer, frame_size,
+                    LowSeverity);
+        }
+        if(unlikely(pframe == nullptr)) {
+            count_dropped_message<Formatter>(pbuffer);
+            return;
+        }
+        construct_frame<Formatter>(pframe, frame_size,
+                std::forward<Args>(args)...);
+        if(unlikely(not strict_queue_commit_extent(
+                        {pbuffer, pbuffer->input_end()})))
+        {
+            destroy_frame<Args...>(pframe);
+            pbuffer->rewind_input_end(previous_end);
+            count_dropped_message<Formatter>(pbuffer);
+        }
     }
 
 private:
+    friend class basic_log_suite;
+
+    // See set_output_thread_affinity and the following functions.
+    struct output_thread_settings {
+        output_thread_settings() :
+            set_scheduling(false),
+            scheduling_policy(0),
+            scheduling_priority(0),
+            set_nice(false),
+            nice(0)
+        {
+        }
+
+        std::vector<unsigned> cpus;
+        bool set_scheduling;
+        int scheduling_policy;
+        int scheduling_priority;
+        bool set_nice;
+        int nice;
+        std::string name;
+        std::function<void()> start_hook;
+    };
+
+    // Throws std::system_error if a setting can't be applied.
+    void apply_output_thread_settings();
+    // Runs on the output thread: applies the output thread settings, sets
+    // up the formatter pool if there should be one, and then runs worker.
+    // Whether that went well is reported through *pstartup_error and
+    // output_thread_started_event_.
+    void run_output_thread(void (basic_log::*worker)(),
+            std::size_t output_buffer_max_capacity,
+            std::exception_ptr* pstartup_error);
     void output_worker();
+    void parallel_output_worker();
+    void poll_worker();
     void queue_commit_extent(detail::commit_extent const& ce);
-    char* allocate_input_frame(std::size_t frame_size);
-    void reset_shared_input_queue(std::size_t node_count);
+    void push_commit_extent(detail::commit_extent const& ce);
+    void publish_commit_extent(detail::commit_extent const& ce);
+    // Same as queue_commit_extent, but returns false instead of waiting if
+    // the queue is full and the overflow policy says that the commit should
+    // be dropped.
+    bool try_queue_commit_extent(detail::commit_extent const& ce,
+            bool low_severity);
+    // Same as try_queue_commit_extent, but returns false instead of waiting
+    // or waking up the output thread, whatever the overflow policy. See
+    // strict_write.
+    bool strict_queue_commit_extent(detail::commit_extent const& ce);
+    detail::thread_input_buffer* init_input_buffer();
+
+    overflow_policy effective_overflow_policy(
+            detail::thread_input_buffer const* pbuffer) const
+    {
+        if(pbuffer->has_overflow_policy)
+            return pbuffer->thread_overflow_policy;
+        return overflow_policy_.load(std::memory_order_relaxed);
+    }
+    bool should_drop(detail::thread_input_buffer const* pbuffer,
+            bool low_severity) const
+    {
+        overflow_policy policy = effective_overflow_policy(pbuffer);
+        return policy == overflow_policy::drop or
+            (low_severity and policy == overflow_policy::drop_low_severity);
+    }
+
+    char* try_allocate_input_frame(detail::thread_input_buffer* pbuffer,
+            std::size_t frame_size, bool low_severity)
+    {
+        std::size_t reserve = 0;
+        if(low_severity and effective_overflow_policy(pbuffer)
+                == overflow_policy::drop_low_severity)
+        {
+            reserve = pbuffer->capacity()/4;
+        }
+        return stamp_frame(pbuffer->try_allocate_input_frame(
+                    frame_size + stamp_size(), reserve));
+    }
+    // Waits for room for the frame, or returns nullptr if the overflow
+    // policy says that the message should be dropped. Segments are chained
+    // to the input buffer before either of those happen.
+    char* allocate_input_frame(detail::thread_input_buffer* pbuffer,
+            std::size_t frame_size, bool low_severity);
+    bool polls_input_buffers() const
+    {
+        return commit_mode_ != commit_mode::shared_queue;
+    }
+    // With commit_mode::merged_buffers, every frame is preceded by the time
+    // stamp of the call that wrote it. The allocation functions add room for
+    // it, and return a pointer past it.
+    std::size_t stamp_size() const
+    {
+        return commit_mode_ == commit_mode::merged_buffers?
+            sizeof(std::uint64_t) : 0;
+    }
+    char* stamp_frame(char* pframe) const
+    {
+        if(detail::likely(stamp_size() == 0 or pframe == nullptr))
+            return pframe;
+        return stamp_frame(pframe, detail::read_frame_stamp_counter());
+    }
+    char* stamp_frame(char* pframe, std::uint64_t stamp) const
+    {
+        if(stamp_size() == 0 or pframe == nullptr)
+            return pframe;
+        std::memcpy(pframe, &stamp, sizeof(stamp));
+        return pframe + sizeof(stamp);
+    }
+    template <class Formatter>
+    void count_dropped_message(detail::thread_input_buffer* pbuffer)
+    {
+        // The output thread needs the formatter before it can see the count.
+        remember_dropped_messages_format<Formatter>(
+                detail::has_dropped_messages_format<Formatter>());
+        pbuffer->unreported_dropped_messages.fetch_add(1,
+                std::memory_order_release);
+        ++pbuffer->dropped_messages;
+        total_dropped_messages_.fetch_add(1, std::memory_order_relaxed);
+    }
+    // Lets the output thread write "messages dropped" notices of its own,
+    // see write_orphaned_drop_notice.
+    template <class Formatter>
+    void remember_dropped_messages_format(std::true_type)
+    {
+        auto pformat = &detail::dropped_messages_formatter<Formatter>::format;
+        if(pformat_dropped_messages_.load(std::memory_order_relaxed)
+                != pformat)
+        {
+            pformat_dropped_messages_.store(pformat,
+                    std::memory_order_relaxed);
+        }
+    }
+    template <class Formatter>
+    void remember_dropped_messages_format(std::false_type)
+    {
+    }
+
+    // Writes a frame with the number of dropped messages. Returns that
+    // number, or 0 if no frame was written. If there is no room for it,
+    // then it is subject to the overflow policy like any other message if
+    // may_wait is true, or it is left for later if may_wait is false.
+    template <class Formatter>
+    std::size_t write_dropped_messages(detail::thread_input_buffer* pbuffer,
+            bool may_wait, bool low_severity)
+    {
+        return write_dropped_messages<Formatter>(pbuffer, may_wait,
+            low_severity, detail::has_dropped_messages_format<Formatter>());
+    }
+    template <class Formatter>
+    std::size_t write_dropped_messages(detail::thread_input_buffer* pbuffer,
+            bool may_wait, bool low_severity, std::true_type)
+    {
+        using namespace detail;
+        // The output thread may have taken the count over.
+        std::size_t count = pbuffer->unreported_dropped_messages.exchange(0,
+                std::memory_order_relaxed);
+        if(count == 0)
+            return 0;
+        std::size_t frame_size = input_frame_size(pbuffer, count);
+        char* pframe = try_allocate_input_frame(pbuffer, frame_size, false);
+        if(pframe == nullptr and may_wait)
+            pframe = allocate_input_frame(pbuffer, frame_size, low_severity);
+        if(pframe == nullptr) {
+            pbuffer->unreported_dropped_messages.fetch_add(count,
+                    std::memory_order_relaxed);
+            return 0;
+        }
+        construct_frame<dropped_messages_formatter<Formatter>>(pframe,
+                frame_size, count);
+        return count;
+    }
+    template <class Formatter>
+    std::size_t write_dropped_messages(detail::thread_input_buffer* pbuffer,
+            bool, bool, std::false_type)
+    {
+        pbuffer->unreported_dropped_messages.store(0,
+                std::memory_order_relaxed);
+        return 0;
+    }
+    // Same as write_dropped_messages, but also commits the frame so that
+    // nothing is left uncommitted if the next message has to wait for the
+    // output thread. If strict is true, it neither waits nor wakes up the
+    // output thread (see strict_write).
+    template <class Formatter>
+    void report_dropped_messages(detail::thread_input_buffer* pbuffer,
+            bool low_severity, bool strict = false)
+    {
+        auto previous_end = pbuffer->mark_input_end();
+        std::size_t count = write_dropped_messages<Formatter>(pbuffer,
+                not strict, low_severity);
+        if(count == 0)
+            return;
+        detail::commit_extent ce = {pbuffer, pbuffer->input_end()};
+        if(not (strict? strict_queue_commit_extent(ce)
+                    : try_queue_commit_extent(ce, low_severity)))
+        {
+            pbuffer->rewind_input_end(previous_end);
+            pbuffer->unreported_dropped_messages.fetch_add(count,
+                    std::memory_order_relaxed);
+        }
+    }
+
+    // Returns the calling thread's input buffer for this log, or nullptr if
+    // it has none.
+    detail::thread_input_buffer* current_input_buffer()
+    {
+        if(detail::unlikely(detail::thread_input_buffer_generations[
+                    instance_id_] != instance_generation_))
+        {
+            return nullptr;
+        }
+        return detail::thread_input_buffers[instance_id_];
+    }
     detail::thread_input_buffer* get_input_buffer()
     {
-        detail::thread_input_buffer* p = static_cast<detail::thread_input_buffer*>(pthread_getspecific(thread_input_buffer_key_));
-        if(detail::likely(p != nullptr)) {
+        detail::thread_input_buffer* p = current_input_buffer();
+        if(detail::likely(p != nullptr and p->requested_capacity == 0)) {
             return p;
         } else {
             return init_input_buffer();
         }
     }
-    detail::thread_input_buffer* init_input_buffer();
+    detail::thread_input_buffer* replace_input_buffer(
+            detail::thread_input_buffer* pold, std::size_t size);
+    // Takes over the input buffers that exited threads have handed over,
+    // and gives those that have been drained and are no longer polled back
+    // to the input buffer pool. They are removed from
+    // *ptouched_input_buffers (unless it is nullptr) first. Only called by
+    // the output thread, or while the log is closed.
+    void collect_retired_input_buffers(
+            std::vector<detail::thread_input_buffer*>* ptouched_input_buffers);
+    // Writes a "messages dropped" notice to the output buffer for
+    // orphaned_dropped_messages_, if the formatter supports it. If sweep is
+    // true, it first takes over the unreported drops of all input buffers,
+    // which the output thread does when it has caught up with the input or
+    // the log is being closed, since their threads may never write again.
+    // Returns true if it wrote anything. Only called by the output thread.
+    bool write_orphaned_drop_notice(bool sweep);
     void on_panic_flush_done();
     bool is_open()
     {
         return output_thread_.joinable();
     }
 
-    typedef boost_1_56_0::lockfree::queue<detail::commit_extent, boost_1_56_0::lockfree::fixed_sized<true>> shared_input_queue_t;
+    typedef detail::mpsc_queue<detail::commit_extent> shared_input_queue_t;
 
     //typedef detail::thread_object<detail::thread_input_buffer, std::size_t, std::size_t> thread_input_buffer_t;
     //thread_input_buffer_t pthread_input_buffer_;
@@ -102,8 +988,45 @@ private:
     shared_input_queue_t shared_input_queue_;
     spsc_event shared_input_queue_full_event_;
     spsc_event shared_input_consumed_event_;
-    pthread_key_t thread_input_buffer_key_;
+    // Input buffers that exited threads have handed over, linked through
+    // pnext_retired. This has to be set up before the instance id is taken,
+    // since a thread may hand over a buffer as soon as it is.
+    std::atomic<detail::thread_input_buffer*> retired_input_buffers_;
+    std::size_t instance_id_;
+    unsigned instance_generation_;
     std::size_t thread_input_buffer_size_;
+    commit_mode commit_mode_;
+    std::atomic<unsigned> merge_window_us_;
+    unsigned formatter_threads_;
+    unsigned cooperative_helpers_;
+    bool output_thread_formatting_only_;
+    std::unique_ptr<detail::formatter_pool> formatter_pool_;
+    std::atomic<bool> output_thread_idle_;
+    std::atomic<wakeup_policy> wakeup_policy_;
+    std::atomic<unsigned> spin_budget_;
+    std::atomic<unsigned> max_idle_wait_ms_;
+    output_thread_settings output_thread_settings_;
+    spsc_event output_thread_started_event_;
+    std::atomic<overflow_policy> overflow_policy_;
+    std::atomic<std::size_t> input_buffer_growth_limit_;
+    std::atomic<std::size_t> input_buffer_auto_size_limit_;
+    std::atomic<bool> mirrored_input_buffers_;
+    std::atomic<bool> numa_local_input_buffers_;
+    std::atomic<memory_provider*> pmemory_provider_;
+    // Formats a "messages dropped" notice, or nullptr if no message has
+    // been dropped yet or the formatter can't do that.
+    std::atomic<void (*)(output_buffer*, std::size_t)>
+        pformat_dropped_messages_;
+    std::atomic<std::uint64_t> total_dropped_messages_;
+    // Unreported drops that the output thread has taken over from input
+    // buffers, see write_orphaned_drop_notice.
+    std::size_t orphaned_dropped_messages_;
+    // Retired input buffers that the output thread is still draining.
+    std::vector<detail::thread_input_buffer*> draining_input_buffers_;
+    detail::input_buffer_pool input_buffer_pool_;
+    // Indexed by NUMA node. Allocated by the first open().
+    std::unique_ptr<detail::numa_node_counters[]> numa_counters_;
+    std::size_t numa_node_count_;
     output_buffer output_buffer_;
     std::thread output_thread_;
     spsc_event panic_flush_done_event_;
@@ -117,23 +1040,76 @@ void call_formatter(output_buffer* poutput, std::tuple<Args...>& args, index_seq
     Formatter::format(poutput, std::move(std::get<Indexes>(args))...);
 }
 
-template <class Formatter, typename... Args>
-std::size_t formatter_dispatch(output_buffer* poutput, char* pinput)
+template <typename... Args, std::size_t... Indexes>
+std::size_t stored_arguments_size(std::tuple<Args...> const& args, index_sequence<Indexes...>)
 {
-    using namespace detail;
-    typedef std::tuple<Args...> args_t;
-    std::size_t const args_align = alignof(args_t);
-    std::size_t const args_offset = (sizeof(formatter_dispatch_function_t*) + args_align-1)/args_align*args_align;
-    std::size_t const frame_size = args_offset + sizeof(args_t);
-    args_t& args = *reinterpret_cast<args_t*>(pinput + args_offset);
+    std::size_t sizes[] = {0, stored_size(std::get<Indexes>(args))...};
+    std::size_t sum = 0;
+    for(std::size_t size : sizes)
+        sum += size;
+    return sum;
+}
 
-    typename make_index_sequence<sizeof...(Args)>::type indexes;
+template <class Formatter, class Layout>
+std::size_t dispatch_frame(std::false_type, output_buffer* poutput, char* pinput)
+{
+    typedef typename Layout::args_t args_t;
+    args_t& args = *reinterpret_cast<args_t*>(pinput + Layout::args_offset);
+
+    typename make_index_sequence<std::tuple_size<args_t>::value>::type indexes;
     call_formatter<Formatter>(poutput, args, indexes);
+    std::size_t frame_size = Layout::frame_size + stored_arguments_size(args, indexes);
 
     args.~args_t();
     return frame_size;
 }
 
+template <class T>
+T load_packed_argument(std::true_type, char*)
+{
+    return T();
+}
+
+// store_packed_argument constructed a T at p, and since T is trivially
+// destructible there is nothing to clean up after moving from it.
+template <class T>
+T load_packed_argument(std::false_type, char* p)
+{
+    return std::move(*reinterpret_cast<T*>(p));
+}
+
+template <class T>
+T load_packed_argument(char* p)
+{
+    return load_packed_argument<T>(is_elided_argument<T>(), p);
+}
+
+template <class Formatter, class Layout, std::size_t... Indexes>
+void call_packed_formatter(output_buffer* poutput, char* pinput,
+        index_sequence<Indexes...>)
+{
+    (void) pinput;
+    Formatter::format(poutput, load_packed_argument<
+        typename Layout::template argument<Indexes>::type>(
+            pinput + Layout::template argument<Indexes>::offset)...);
+}
+
+template <class Formatter, class Layout>
+std::size_t dispatch_frame(std::true_type, output_buffer* poutput, char* pinput)
+{
+    typename make_index_sequence<Layout::argument_count>::type indexes;
+    call_packed_formatter<Formatter, Layout>(poutput, pinput, indexes);
+    return Layout::frame_size;
+}
+
+template <class Formatter, typename... Args>
+std::size_t formatter_dispatch(output_buffer* poutput, char* pinput)
+{
+    typedef frame_layout<Args...> layout;
+    return dispatch_frame<Formatter, layout>(
+        std::integral_constant<bool, layout::trivial>(), poutput, pinput);
+}
+
 }   // namespace detail
 }   // namespace reckless
 
@@ -0,0 +1,302 @@
+#ifndef RECKLESS_BINARY_LOG_HPP
+#define RECKLESS_BINARY_LOG_HPP
+
+#include <reckless/basic_log.hpp>
+#include <reckless/compiled_format.hpp>
+
+#include <cstdint>
+#include <cstring>      // memcpy
+#include <utility>      // forward
+#include <type_traits>  // decay
+
+#include <time.h>       // clock_gettime
+
+namespace reckless {
+
+// A binary log stream is a sequence of records in the byte order of the host
+// that wrote it. Each record starts with a 32-bit tag:
+//
+// * binary_header_tag, followed by a 32-bit version number. This is written
+//   first by each output thread and starts a new dictionary, since call-site
+//   ids are only unique within the process that wrote them.
+// * binary_dictionary_tag, followed by a 32-bit call-site id, a 32-bit
+//   argument count, a 32-bit format string length, one binary_type per
+//   argument and the characters of the format string.
+// * Any other value is the call-site id of a log line, and is followed by a
+//   64-bit timestamp (nanoseconds since the epoch) and the arguments. Strings
+//   are stored as a 32-bit length followed by the characters, C strings
+//   additionally have the original 64-bit pointer value before the length.
+//   All other arguments are stored as the raw bytes of the value, without
+//   any padding.
+std::uint32_t const binary_header_tag = 0xffffffff;
+std::uint32_t const binary_dictionary_tag = 0;
+std::uint32_t const binary_log_version = 1;
+
+enum class binary_type : std::uint8_t {
+    type_char = 1,
+    type_signed_char,
+    type_unsigned_char,
+    type_short,
+    type_unsigned_short,
+    type_int,
+    type_unsigned_int,
+    type_long,
+    type_unsigned_long,
+    type_long_long,
+    type_unsigned_long_long,
+    type_float,
+    type_double,
+    type_long_double,
+    type_pointer,
+    type_string,
+    type_c_string
+};
+
+// Time of a binary log line, captured on the calling thread.
+class binary_timestamp {
+public:
+    binary_timestamp()
+    {
+        timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        nanoseconds_ = static_cast<std::uint64_t>(ts.tv_sec)*1000000000u
+            + static_cast<std::uint64_t>(ts.tv_nsec);
+    }
+
+    std::uint64_t nanoseconds() const
+    {
+        return nanoseconds_;
+    }
+
+private:
+    std::uint64_t nanoseconds_;
+};
+
+namespace detail {
+
+// The constant parts of a binary_log call site. These are written to the
+// stream once, as a dictionary entry, and each log line refers to them by
+// id.
+struct binary_call_site {
+    std::uint32_t id;
+    char const* format;
+    std::uint32_t argument_count;
+    binary_type const* argument_types;
+};
+
+std::uint32_t allocate_binary_call_site_id();
+
+// Writes the tag and timestamp of a log line. If this is the first line that
+// the calling thread writes for the call site, the dictionary entry is written
+// first (preceded by the stream header for the very first line).
+void write_binary_record_header(output_buffer* pbuffer,
+        binary_call_site const& call_site, std::uint64_t timestamp);
+
+template <class T>
+struct binary_argument {
+    static bool const supported = false;
+};
+
+template <class T, binary_type Type>
+struct binary_scalar_argument {
+    static bool const supported = true;
+    static binary_type const type = Type;
+
+    static void write(output_buffer* pbuffer, T const& v)
+    {
+        char* p = pbuffer->reserve(sizeof(T));
+        std::memcpy(p, &v, sizeof(T));
+        pbuffer->commit(sizeof(T));
+    }
+};
+
+template <> struct binary_argument<char> :
+    binary_scalar_argument<char, binary_type::type_char> {};
+template <> struct binary_argument<signed char> :
+    binary_scalar_argument<signed char, binary_type::type_signed_char> {};
+template <> struct binary_argument<unsigned char> :
+    binary_scalar_argument<unsigned char, binary_type::type_unsigned_char> {};
+template <> struct binary_argument<short> :
+    binary_scalar_argument<short, binary_type::type_short> {};
+template <> struct binary_argument<unsigned short> :
+    binary_scalar_argument<unsigned short, binary_type::type_unsigned_short> {};
+template <> struct binary_argument<int> :
+    binary_scalar_argument<int, binary_type::type_int> {};
+template <> struct binary_argument<unsigned int> :
+    binary_scalar_argument<unsigned int, binary_type::type_unsigned_int> {};
+template <> struct binary_argument<long> :
+    binary_scalar_argument<long, binary_type::type_long> {};
+template <> struct binary_argument<unsigned long> :
+    binary_scalar_argument<unsigned long, binary_type::type_unsigned_long> {};
+template <> struct binary_argument<long long> :
+    binary_scalar_argument<long long, binary_type::type_long_long> {};
+template <> struct binary_argument<unsigned long long> :
+    binary_scalar_argument<unsigned long long, binary_type::type_unsigned_long_long> {};
+template <> struct binary_argument<float> :
+    binary_scalar_argument<float, binary_type::type_float> {};
+template <> struct binary_argument<double> :
+    binary_scalar_argument<double, binary_type::type_double> {};
+template <> struct binary_argument<long double> :
+    binary_scalar_argument<long double, binary_type::type_long_double> {};
+
+template <class T>
+struct binary_argument<T*> {
+    static bool const supported = true;
+    static binary_type const type = binary_type::type_pointer;
+
+    static void write(output_buffer* pbuffer, T* v)
+    {
+        std::uint64_t value = reinterpret_cast<std::uintptr_t>(v);
+        binary_argument<unsigned long long>::write(pbuffer, value);
+    }
+};
+
+template <>
+struct binary_argument<inline_string> {
+    static bool const supported = true;
+    static binary_type const type = binary_type::type_string;
+
+    static void write(output_buffer* pbuffer, inline_string const& s)
+    {
+        std::uint32_t size = static_cast<std::uint32_t>(s.size());
+        char* p = pbuffer->reserve(sizeof(size));
+        std::memcpy(p, &size, sizeof(size));
+        pbuffer->commit(sizeof(size));
+        pbuffer->write(s.data(), size);
+    }
+};
+
+template <>
+struct binary_argument<inline_c_string> {
+    static bool const supported = true;
+    static binary_type const type = binary_type::type_c_string;
+
+    static void write(output_buffer* pbuffer, inline_c_string const& s)
+    {
+        binary_argument<void const*>::write(pbuffer, s.pointer());
+        binary_argument<inline_string>::write(pbuffer, s);
+    }
+};
+
+template <class Format, typename... Args>
+struct binary_call_site_descriptor {
+    // One extra element so that the array is never empty.
+    static binary_type const argument_types[sizeof...(Args) + 1];
+
+    static binary_call_site const& get()
+    {
+        static binary_call_site const call_site = {
+            allocate_binary_call_site_id(),
+            Format::str(),
+            sizeof...(Args),
+            argument_types
+        };
+        return call_site;
+    }
+};
+
+template <class Format, typename... Args>
+binary_type const binary_call_site_descriptor<Format, Args...>::argument_types[] =
+    {binary_argument<Args>::type..., binary_type()};
+
+}   // namespace detail
+
+// Writes log lines without converting them to text. Rendering them is
+// deferred to decode_binary_log(), or the reckless_decode tool.
+class binary_formatter {
+public:
+    template <class Format, typename... Args>
+    static void format(output_buffer* pbuffer, binary_timestamp timestamp,
+            Format, Args&&... args)
+    {
+        typedef detail::binary_call_site_descriptor<Format,
+            typename std::decay<Args>::type...> descriptor;
+        detail::write_binary_record_header(pbuffer, descriptor::get(),
+                timestamp.nanoseconds());
+        int dummy[] = {0, (detail::binary_argument<
+            typename std::decay<Args>::type>::write(pbuffer, args), 0)...};
+        (void) dummy;
+    }
+
+    static void format_dropped_messages(output_buffer* pbuffer,
+            std::size_t count)
+    {
+        format(pbuffer, binary_timestamp(),
+                RECKLESS_FORMAT("%d messages dropped"), count);
+    }
+};
+
+// A log that writes the arguments of each line to disk in binary form, along
+// with a dictionary of format strings, instead of formatting them. This takes
+// much less work on the output thread and much less disk space than a text
+// log. Only the native types supported by template_formatter may be used as
+// arguments, and the format string must be created with RECKLESS_FORMAT since
+// it is stored once per call site instead of once per line.
+//
+// The dictionary is kept by the output thread, which writes each entry just
+// before the first line that uses it. Lines can therefore only be formatted
+// on the output thread, and set_formatter_threads and
+// set_cooperative_draining throw std::logic_error.
+class binary_log : public basic_log {
+public:
+    binary_log()
+    {
+        require_output_thread_formatting();
+    }
+
+    binary_log(writer* pwriter,
+            std::size_t output_buffer_max_capacity = 0,
+            std::size_t shared_input_queue_size = 0,
+            std::size_t thread_input_buffer_size = 0) :
+        basic_log(pwriter,
+                 output_buffer_max_capacity,
+                 shared_input_queue_size,
+                 thread_input_buffer_size)
+    {
+        require_output_thread_formatting();
+    }
+
+    template <class Format, typename... Args>
+    void write(Format fmt, Args&&... args)
+    {
+        static_assert(is_compiled_format<Format>::value,
+            "binary_log requires a format string created with RECKLESS_FORMAT");
+        static_assert(all_supported<typename detail::frame_argument<
+                decltype(detail::capture_string(std::forward<Args>(args)))>::type...>::value,
+            "binary_log only supports arithmetic types, pointers and strings");
+        // Nothing is formatted here, but instantiating the compiled format
+        // program gives the same compile-time checks of the format string as
+        // for a text log. The target type picks the variadic overload, which
+        // is otherwise ambiguous when there is a single argument.
+        void (*check_format)(output_buffer*, typename detail::frame_argument<
+                decltype(detail::capture_string(std::forward<Args>(args)))>::type const&...) =
+            &detail::run_format_program<Format, typename detail::frame_argument<
+                decltype(detail::capture_string(std::forward<Args>(args)))>::type const&...>;
+        (void) check_format;
+        basic_log::write<binary_formatter>(
+                binary_timestamp(),
+                fmt,
+                detail::capture_string(std::forward<Args>(args))...);
+    }
+
+private:
+    template <typename... Args>
+    struct all_supported : std::is_same<
+        detail::bool_pack<true, detail::binary_argument<Args>::supported...>,
+        detail::bool_pack<detail::binary_argument<Args>::supported..., true>>
+    {
+    };
+};
+
+// Renders a binary log as text, in the same form as a policy_log with a
+// timestamp_field header. The formatting work is split over thread_count
+// threads (or one per CPU if thread_count is 0). Returns the number of bytes
+// decoded, which is less than size if the data ends with an incomplete record
+// (e.g. because the process crashed while writing it). Throws
+// std::runtime_error if the data is not a valid binary log.
+std::size_t decode_binary_log(void const* pdata, std::size_t size,
+        writer* pwriter, unsigned thread_count = 0);
+
+}   // namespace reckless
+
+#endif  // RECKLESS_BINARY_LOG_HPP
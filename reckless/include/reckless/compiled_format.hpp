@@ -0,0 +1,456 @@
+#ifndef RECKLESS_COMPILED_FORMAT_HPP
+#define RECKLESS_COMPILED_FORMAT_HPP
+
+#include "reckless/output_buffer.hpp"
+#include "reckless/ntoa.hpp"
+#include "reckless/inline_string.hpp"
+#include "reckless/detail/utility.hpp"    // make_index_sequence
+
+#include <string>
+#include <tuple>
+#include <type_traits>
+#include <cstring>  // memcpy
+#include <cstdint>  // uintptr_t
+
+// Creates a format object whose format string is parsed at compile time. The
+// result can be passed anywhere a format string is accepted by
+// template_formatter, e.g.
+//
+//   g_log.write(RECKLESS_FORMAT("%s: %d items"), name, count);
+//
+// The format string is turned into a fixed sequence of literal copies and
+// typed conversions, so the output thread never has to scan for specifiers
+// or parse them. Mismatches between conversion specifiers and argument types
+// (or argument count) are reported as compile errors.
+//
+// The format object is an empty class, so it takes up no space in the input
+// frame.
+#define RECKLESS_FORMAT(fmt) \
+    ([] { \
+        struct reckless_compiled_format : ::reckless::compiled_format { \
+            static constexpr char const* str() { return fmt; } \
+        }; \
+        return reckless_compiled_format(); \
+    }())
+
+namespace reckless {
+
+class output_buffer;
+
+// Base class for the objects created by RECKLESS_FORMAT. Derived classes
+// provide the function
+//     static constexpr char const* str();
+// which returns the format string.
+struct compiled_format {
+};
+
+template <class T>
+struct is_compiled_format :
+    std::is_base_of<compiled_format, typename std::decay<T>::type>
+{
+};
+
+namespace detail {
+    template <typename T>
+    char const* invoke_custom_format(output_buffer* pbuffer,
+        char const* pformat, T&& v);
+
+// The constexpr functions below are restricted to C++11 rules, i.e. a single
+// return statement each. Positions are indexes into the format string.
+
+constexpr bool format_is_digit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+constexpr bool format_is_flag(char c)
+{
+    return c == '-' || c == '+' || c == ' ' || c == '#' || c == '0';
+}
+
+// True if a conversion specification (as opposed to "%%") starts at pos.
+constexpr bool format_is_conversion(char const* s, std::size_t pos)
+{
+    return s[pos] == '%' && s[pos+1] != '%';
+}
+
+// Position of the next '%' or the terminating NUL.
+constexpr std::size_t format_find_percent(char const* s, std::size_t pos)
+{
+    return (s[pos] == '\0' || s[pos] == '%')? pos :
+        format_find_percent(s, pos+1);
+}
+
+constexpr std::size_t format_skip_flags(char const* s, std::size_t pos)
+{
+    return format_is_flag(s[pos])? format_skip_flags(s, pos+1) : pos;
+}
+
+constexpr std::size_t format_skip_digits(char const* s, std::size_t pos)
+{
+    return format_is_digit(s[pos])? format_skip_digits(s, pos+1) : pos;
+}
+
+constexpr unsigned format_parse_unsigned(char const* s, std::size_t pos,
+        unsigned value = 0)
+{
+    return format_is_digit(s[pos])?
+        format_parse_unsigned(s, pos+1, 10*value + (s[pos] - '0')) : value;
+}
+
+constexpr bool format_has_flag(char const* s, std::size_t pos, char flag)
+{
+    return format_is_flag(s[pos]) &&
+        (s[pos] == flag || format_has_flag(s, pos+1, flag));
+}
+
+// The functions below take the position just after the '%', i.e. the start
+// of the conversion specification, and follow the same grammar as
+// parse_conversion_specification in template_formatter.cpp.
+constexpr std::size_t format_width_pos(char const* s, std::size_t spec)
+{
+    return format_skip_flags(s, spec);
+}
+
+constexpr std::size_t format_precision_pos(char const* s, std::size_t spec)
+{
+    return format_skip_digits(s, format_width_pos(s, spec));
+}
+
+constexpr bool format_has_precision(char const* s, std::size_t spec)
+{
+    return s[format_precision_pos(s, spec)] == '.';
+}
+
+constexpr std::size_t format_conversion_pos(char const* s, std::size_t spec)
+{
+    return format_has_precision(s, spec)?
+        format_skip_digits(s, format_precision_pos(s, spec) + 1) :
+        format_precision_pos(s, spec);
+}
+
+constexpr unsigned format_precision(char const* s, std::size_t spec)
+{
+    return !format_has_precision(s, spec)? UNSPECIFIED_PRECISION :
+        !format_is_digit(s[format_precision_pos(s, spec) + 1])?
+            UNSPECIFIED_PRECISION :
+            format_parse_unsigned(s, format_precision_pos(s, spec) + 1);
+}
+
+// True if the conversion character follows the '%' immediately, i.e. there
+// are no flags, width or precision.
+constexpr bool format_is_bare_conversion(char const* s, std::size_t spec)
+{
+    return format_conversion_pos(s, spec) == spec;
+}
+
+// A literal step extends up to the next conversion specification. If it ends
+// in "%%", the first '%' is included in the literal and the second one is
+// skipped.
+constexpr bool format_literal_ends_in_percent(char const* s, std::size_t pos)
+{
+    return s[format_find_percent(s, pos)] == '%' &&
+        s[format_find_percent(s, pos) + 1] == '%';
+}
+
+constexpr std::size_t format_literal_length(char const* s, std::size_t pos)
+{
+    return format_find_percent(s, pos) - pos +
+        (format_literal_ends_in_percent(s, pos)? 1 : 0);
+}
+
+constexpr std::size_t format_next_step(char const* s, std::size_t pos)
+{
+    return format_is_conversion(s, pos)?
+            (s[format_conversion_pos(s, pos+1)] == '\0'?
+                format_conversion_pos(s, pos+1) :
+                format_conversion_pos(s, pos+1) + 1) :
+        format_find_percent(s, pos) +
+            (format_literal_ends_in_percent(s, pos)? 2 : 0);
+}
+
+constexpr std::size_t format_step_count(char const* s, std::size_t pos = 0)
+{
+    return s[pos] == '\0'? 0 :
+        1 + format_step_count(s, format_next_step(s, pos));
+}
+
+constexpr std::size_t format_step_pos(char const* s, std::size_t step,
+        std::size_t pos = 0)
+{
+    return step == 0? pos :
+        format_step_pos(s, step - 1, format_next_step(s, pos));
+}
+
+// Number of conversions among the steps preceding the given one, i.e. the
+// index of the argument consumed by the step if it is a conversion.
+constexpr std::size_t format_argument_index(char const* s, std::size_t step,
+        std::size_t pos = 0)
+{
+    return step == 0? 0 :
+        (format_is_conversion(s, pos)? 1 : 0) +
+        format_argument_index(s, step - 1, format_next_step(s, pos));
+}
+
+constexpr std::size_t format_conversion_count(char const* s)
+{
+    return format_argument_index(s, format_step_count(s));
+}
+
+enum class conversion_category {
+    integer,
+    character,
+    floating_point,
+    string,
+    string_object,
+    pointer,
+    custom
+};
+
+template <typename T>
+struct conversion_category_of : std::integral_constant<conversion_category,
+    std::is_same<T, char>::value ||
+    std::is_same<T, signed char>::value ||
+    std::is_same<T, unsigned char>::value? conversion_category::character :
+    // Wide character types have no built-in format() in
+    // template_formatter.cpp, so they go through the same lookup as
+    // user-defined types.
+    std::is_same<T, wchar_t>::value ||
+    std::is_same<T, char16_t>::value ||
+    std::is_same<T, char32_t>::value? conversion_category::custom :
+    std::is_integral<T>::value? conversion_category::integer :
+    std::is_floating_point<T>::value? conversion_category::floating_point :
+    std::is_same<T, char const*>::value ||
+    std::is_same<T, char*>::value ||
+    std::is_same<T, inline_c_string>::value? conversion_category::string :
+    std::is_same<T, std::string>::value ||
+    std::is_same<T, inline_string>::value?
+        conversion_category::string_object :
+    std::is_pointer<T>::value && (
+        std::is_void<typename std::remove_pointer<T>::type>::value ||
+        std::is_arithmetic<typename std::remove_pointer<T>::type>::value)?
+        conversion_category::pointer :
+    conversion_category::custom>
+{
+};
+
+// Tells whether the built-in formatting in template_formatter.cpp accepts
+// the conversion specification at spec for the given category. Strings,
+// pointers and %s for characters do not take any flags at runtime, so they
+// must not have any here either.
+constexpr bool format_accepts(conversion_category category, char const* s,
+        std::size_t spec)
+{
+    return category == conversion_category::integer?
+            s[format_conversion_pos(s, spec)] == 'd' ||
+            s[format_conversion_pos(s, spec)] == 'x' ||
+            s[format_conversion_pos(s, spec)] == 'X' :
+        category == conversion_category::character?
+            (s[format_conversion_pos(s, spec)] == 's' &&
+                format_is_bare_conversion(s, spec)) ||
+            s[format_conversion_pos(s, spec)] == 'd' ||
+            s[format_conversion_pos(s, spec)] == 'x' ||
+            s[format_conversion_pos(s, spec)] == 'X' :
+        category == conversion_category::floating_point?
+            s[format_conversion_pos(s, spec)] == 'f' :
+        category == conversion_category::string?
+            format_is_bare_conversion(s, spec) &&
+            (s[spec] == 's' || s[spec] == 'p') :
+        category == conversion_category::string_object?
+            format_is_bare_conversion(s, spec) && s[spec] == 's' :
+        category == conversion_category::pointer?
+            format_is_bare_conversion(s, spec) &&
+            (s[spec] == 'p' || s[spec] == 's') :
+        true;
+}
+
+template <class Format, std::size_t Spec>
+conversion_specification make_conversion_specification()
+{
+    // All of these are constant expressions, so the compiler should be able
+    // to fold this into a handful of immediate stores.
+    conversion_specification cs;
+    cs.minimum_field_width = format_parse_unsigned(Format::str(),
+            format_width_pos(Format::str(), Spec));
+    cs.precision = format_precision(Format::str(), Spec);
+    cs.plus_sign = format_has_flag(Format::str(), Spec, '+')? '+' :
+        format_has_flag(Format::str(), Spec, ' ')? ' ' : 0;
+    cs.left_justify = format_has_flag(Format::str(), Spec, '-');
+    cs.alternative_form = format_has_flag(Format::str(), Spec, '#');
+    cs.pad_with_zeroes = format_has_flag(Format::str(), Spec, '0');
+    cs.uppercase = Format::str()[format_conversion_pos(Format::str(), Spec)] == 'X';
+    return cs;
+}
+
+inline void append_pointer(output_buffer* pbuffer, void const* p)
+{
+    conversion_specification cs;
+    cs.precision = 1;
+    cs.alternative_form = true;
+    itoa_base16(pbuffer, reinterpret_cast<std::uintptr_t>(p), cs);
+}
+
+inline void append_string(output_buffer* pbuffer, char const* s,
+        std::size_t len)
+{
+    char* p = pbuffer->reserve(len);
+    std::memcpy(p, s, len);
+    pbuffer->commit(len);
+}
+
+template <class Format, std::size_t Spec, conversion_category Category>
+struct compiled_conversion;
+
+template <class Format, std::size_t Spec>
+struct compiled_conversion<Format, Spec, conversion_category::integer> {
+    template <typename T>
+    static void convert(output_buffer* pbuffer, T v)
+    {
+        if(Format::str()[format_conversion_pos(Format::str(), Spec)] == 'd')
+            itoa_base10(pbuffer, v, make_conversion_specification<Format, Spec>());
+        else
+            itoa_base16(pbuffer, v, make_conversion_specification<Format, Spec>());
+    }
+};
+
+template <class Format, std::size_t Spec>
+struct compiled_conversion<Format, Spec, conversion_category::character> {
+    template <typename T>
+    static void convert(output_buffer* pbuffer, T v)
+    {
+        if(Format::str()[Spec] == 's')
+            pbuffer->write(static_cast<char>(v));
+        else
+            compiled_conversion<Format, Spec, conversion_category::integer>::
+                convert(pbuffer, static_cast<int>(v));
+    }
+};
+
+template <class Format, std::size_t Spec>
+struct compiled_conversion<Format, Spec, conversion_category::floating_point> {
+    template <typename T>
+    static void convert(output_buffer* pbuffer, T v)
+    {
+        ftoa_base10_f(pbuffer, v, make_conversion_specification<Format, Spec>());
+    }
+};
+
+template <class Format, std::size_t Spec>
+struct compiled_conversion<Format, Spec, conversion_category::string> {
+    static void convert(output_buffer* pbuffer, char const* s)
+    {
+        if(Format::str()[Spec] == 's')
+            append_string(pbuffer, s, std::strlen(s));
+        else
+            append_pointer(pbuffer, s);
+    }
+
+    static void convert(output_buffer* pbuffer, inline_c_string const& s)
+    {
+        if(Format::str()[Spec] == 's')
+            append_string(pbuffer, s.data(), s.size());
+        else
+            append_pointer(pbuffer, s.pointer());
+    }
+};
+
+template <class Format, std::size_t Spec>
+struct compiled_conversion<Format, Spec, conversion_category::string_object> {
+    static void convert(output_buffer* pbuffer, std::string const& s)
+    {
+        append_string(pbuffer, s.data(), s.size());
+    }
+
+    static void convert(output_buffer* pbuffer, inline_string const& s)
+    {
+        append_string(pbuffer, s.data(), s.size());
+    }
+};
+
+template <class Format, std::size_t Spec>
+struct compiled_conversion<Format, Spec, conversion_category::pointer> {
+    static void convert(output_buffer* pbuffer, void const* p)
+    {
+        append_pointer(pbuffer, p);
+    }
+};
+
+template <class Format, std::size_t Spec>
+struct compiled_conversion<Format, Spec, conversion_category::custom> {
+    // We can't know the syntax of a user-defined conversion at compile time,
+    // so the specification is handed over to format() just like
+    // template_formatter would do it. The program resumes after the
+    // conversion character regardless of what the function consumed.
+    template <typename T>
+    static void convert(output_buffer* pbuffer, T&& v)
+    {
+        char const* pspec = Format::str() + Spec;
+        if(not invoke_custom_format(pbuffer, pspec, std::forward<T>(v))) {
+            std::size_t const end = format_next_step(Format::str(), Spec - 1);
+            pbuffer->write('%');
+            append_string(pbuffer, pspec, end - Spec);
+        }
+    }
+};
+
+template <class Format, std::size_t Step,
+    bool IsConversion = format_is_conversion(Format::str(),
+        format_step_pos(Format::str(), Step))>
+struct format_step;
+
+template <class Format, std::size_t Step>
+struct format_step<Format, Step, false> {
+    template <class Args>
+    static void execute(output_buffer* pbuffer, Args&)
+    {
+        std::size_t const pos = format_step_pos(Format::str(), Step);
+        std::size_t const len = format_literal_length(Format::str(), pos);
+        append_string(pbuffer, Format::str() + pos, len);
+    }
+};
+
+template <class Format, std::size_t Step>
+struct format_step<Format, Step, true> {
+    template <class Args>
+    static void execute(output_buffer* pbuffer, Args& args)
+    {
+        std::size_t const spec = format_step_pos(Format::str(), Step) + 1;
+        std::size_t const index = format_argument_index(Format::str(), Step);
+        typedef typename std::tuple_element<index, Args>::type argument_t;
+        typedef typename std::decay<argument_t>::type value_t;
+        conversion_category const category = conversion_category_of<value_t>::value;
+
+        static_assert(Format::str()[format_conversion_pos(Format::str(), spec)] != '\0',
+            "incomplete conversion specification at end of format string");
+        static_assert(format_accepts(category, Format::str(), spec),
+            "conversion specifier does not match the argument type");
+
+        compiled_conversion<Format, spec, category>::convert(pbuffer,
+            std::forward<argument_t>(std::get<index>(args)));
+    }
+};
+
+template <class Format, class Args, std::size_t... Steps>
+void run_format_program(output_buffer* pbuffer, Args& args,
+        index_sequence<Steps...>)
+{
+    int dummy[] = {0, (format_step<Format, Steps>::execute(pbuffer, args), 0)...};
+    (void) dummy;
+    (void) pbuffer;     // unused if the format string is empty
+}
+
+template <class Format, typename... Args>
+void run_format_program(output_buffer* pbuffer, Args&&... args)
+{
+    static_assert(format_conversion_count(Format::str()) == sizeof...(Args),
+        "number of conversion specifications in format string does not "
+        "match the number of arguments");
+    std::tuple<Args&&...> argument_refs(std::forward<Args>(args)...);
+    typename make_index_sequence<format_step_count(Format::str())>::type steps;
+    run_format_program<Format>(pbuffer, argument_refs, steps);
+}
+
+}   // namespace detail
+}   // namespace reckless
+
+#endif  // RECKLESS_COMPILED_FORMAT_HPP
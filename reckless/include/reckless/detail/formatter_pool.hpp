@@ -0,0 +1,143 @@
+#ifndef RECKLESS_DETAIL_FORMATTER_POOL_HPP
+#define RECKLESS_DETAIL_FORMATTER_POOL_HPP
+
+#include "reckless/detail/thread_input_buffer.hpp"
+#include "reckless/detail/spsc_event.hpp"
+#include "reckless/detail/numa.hpp"
+#include "reckless/output_buffer.hpp"
+#include "reckless/writer.hpp"
+
+#include <atomic>
+#include <memory>       // unique_ptr
+#include <thread>
+#include <vector>
+#include <utility>      // pair
+#include <cstdint>      // uint64_t
+#include <cstddef>      // size_t
+
+namespace reckless {
+namespace detail {
+
+// Formats batches of commit extents on several threads for the output
+// thread of a basic_log (see basic_log::set_formatter_threads). Each thread
+// formats into memory of its own, and the output thread then writes the
+// result to the log's output buffer in the order the extents were queued,
+// so the output is the same as if it had all been formatted on the output
+// thread.
+//
+// The frames of an input buffer have to be consumed in order, so all
+// extents in a batch that belong to the same input buffer are formatted by
+// one thread, and a batch is not started until the previous one has been
+// formatted. While the threads work on one batch, the output thread writes
+// the previous one and fetches the next.
+//
+// Besides its own threads, the pool has room for a number of guests:
+// threads that would otherwise sit waiting for the output thread, and format
+// part of the current batch instead (see basic_log::set_cooperative_draining).
+class formatter_pool {
+public:
+    // Starts thread_count formatter threads. The output thread also formats
+    // extents while it waits for them, and up to guest_count other threads
+    // may do so by calling help(). Consumed input is counted in
+    // pnuma_counters, if it is not nullptr, and the output buffers of the
+    // formatters are allocated from pprovider (see output_buffer::reset).
+    // Throws std::system_error if a thread can't be started, or
+    // std::bad_alloc.
+    formatter_pool(unsigned thread_count, unsigned guest_count,
+            std::size_t output_buffer_capacity,
+            numa_node_counters* pnuma_counters = nullptr,
+            memory_provider* pprovider = nullptr);
+    ~formatter_pool();
+
+    formatter_pool(formatter_pool const&) = delete;
+    formatter_pool& operator=(formatter_pool const&) = delete;
+
+    // Starts formatting count extents, none of which may be a control
+    // extent (with a null input buffer or end pointer). The output of the
+    // previous batch is written to poutput first, and the input buffers it
+    // consumed from are added to *ptouched_input_buffers (unless it is
+    // nullptr) as with consume_input().
+    void format(commit_extent const* pbatch, std::size_t count,
+            output_buffer* poutput,
+            std::vector<thread_input_buffer*>* ptouched_input_buffers);
+    // Waits for the batch that is being formatted, and writes its output.
+    void finish(output_buffer* poutput,
+            std::vector<thread_input_buffer*>* ptouched_input_buffers);
+    // Formats what is left of the current batch on the calling thread, if
+    // there is a free guest slot. Returns true if it formatted anything.
+    bool help();
+
+private:
+    // Appends the output of a formatter thread to the chunk for the batch
+    // it is working on.
+    class chunk_writer : public writer {
+    public:
+        chunk_writer() : pchunk(nullptr) {}
+        Result write(void const* pbuffer, std::size_t count);
+        std::vector<char>* pchunk;
+    };
+
+    // A formatter thread. The output thread is formatter 0, but has no
+    // thread of its own.
+    struct formatter {
+        chunk_writer chunk_output;
+        output_buffer buffer;
+        // Output and touched input buffers for each of the two batches.
+        std::vector<char> chunks[2];
+        std::vector<thread_input_buffer*> touched_input_buffers[2];
+        numa_input_counter numa_counter;
+        spsc_event wake_event;
+        std::thread thread;
+        // Set while a guest thread is using this formatter.
+        std::atomic<bool> guest_flag;
+    };
+
+    // Where the output for a commit extent is.
+    struct extent_output {
+        std::size_t formatter_index;
+        std::size_t offset;
+        std::size_t size;
+    };
+
+    struct batch {
+        std::vector<commit_extent> extents;
+        // Extents, sorted by input buffer and then by position in the batch.
+        std::vector<std::pair<thread_input_buffer*, std::size_t>> order;
+        // Start of each group of extents for the same input buffer in
+        // order, plus the end.
+        std::vector<std::size_t> group_starts;
+        std::vector<extent_output> outputs;
+        std::atomic<std::size_t> group_count;
+        std::atomic<std::size_t> finished_groups;
+    };
+
+    void run(std::size_t formatter_index);
+    bool format_groups(std::size_t formatter_index);
+    void format_group(std::size_t formatter_index, std::size_t slot,
+            std::size_t group);
+    void wait_formatted(
+            std::vector<thread_input_buffer*>* ptouched_input_buffers);
+    void write_output(std::size_t slot, output_buffer* poutput);
+    void stop();
+
+    // The output thread, then the formatter threads, then the guests.
+    std::vector<std::unique_ptr<formatter>> formatters_;
+    std::size_t thread_count_;
+    batch batches_[2];
+    // The batch number (whose low bit is its slot in batches_) in the high
+    // 32 bits, and the next group for a thread to take in the low 32 bits.
+    // Threads take a group with compare-and-swap, which fails if the output
+    // thread has moved on to another batch since they read it.
+    std::atomic<std::uint64_t> claim_;
+    std::atomic<bool> stop_;
+    spsc_event batch_done_event_;
+    // Whether the current batch has yet to be written, and whether it has
+    // been formatted. Only used by the output thread.
+    bool pending_;
+    bool formatted_;
+};
+
+}   // namespace detail
+}   // namespace reckless
+
+#endif  // RECKLESS_DETAIL_FORMATTER_POOL_HPP
@@ -0,0 +1,123 @@
+#ifndef RECKLESS_DETAIL_INPUT_BUFFER_POOL_HPP
+#define RECKLESS_DETAIL_INPUT_BUFFER_POOL_HPP
+
+#include "reckless/detail/thread_input_buffer.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <cstdint>      // uint64_t
+#include <cstddef>      // size_t
+
+namespace reckless {
+
+// See basic_log::input_buffer_pool_statistics.
+struct input_buffer_pool_statistics {
+    // Number of input buffers that were handed out from the pool, and
+    // number that had to be created because there was no match.
+    std::uint64_t hits;
+    std::uint64_t misses;
+    // Number of drained buffers waiting in the pool.
+    std::size_t pooled_buffers;
+    // Size of the rings of all buffers, in use or pooled, minus the memory
+    // that has been given back to the system for idle rings.
+    std::size_t resident_bytes;
+};
+
+namespace detail {
+
+// Creates and destroys the input buffers of a basic_log, and keeps drained
+// buffers of exited threads around for new threads to use, so that thread
+// churn doesn't cost an allocation and page faults on the ring per thread.
+// The rings of buffers that stay in the pool for a while are given back to
+// the system. All functions may be called from any thread.
+//
+// The pool also keeps track of all buffers it has created, so that the log
+// can destroy those that are still in the slots of live threads when it
+// goes away, and can hold their ring memory to a budget.
+class input_buffer_pool {
+public:
+    input_buffer_pool();
+    // Destroys the pooled buffers. Buffers in use are left alone.
+    ~input_buffer_pool();
+
+    input_buffer_pool(input_buffer_pool const&) = delete;
+    input_buffer_pool& operator=(input_buffer_pool const&) = delete;
+
+    // Keeps up to max_buffers buffers in the pool (0, the default, turns
+    // pooling off), and releases the ring memory of those that have been in
+    // the pool for idle_release_ms milliseconds.
+    void set_limits(std::size_t max_buffers, unsigned idle_release_ms);
+    // Limits the total ring size of the buffers in use and in the pool to
+    // the given number of bytes, or lifts the limit if it is 0.
+    void set_memory_budget(std::size_t bytes);
+
+    // Returns a pooled buffer that matches the arguments of
+    // thread_input_buffer::create, or creates one. If that would exceed
+    // the memory budget, pooled buffers are destroyed to make room; if that
+    // is not enough, std::bad_alloc is thrown.
+    thread_input_buffer* acquire(std::size_t size, bool mirrored,
+            int numa_node, memory_provider* pprovider = nullptr);
+    // Takes a drained buffer back. It is pooled if there is room, and
+    // destroyed otherwise.
+    void release(thread_input_buffer* pbuffer);
+    // Destroys a buffer.
+    void destroy(thread_input_buffer* pbuffer);
+    // Destroys every buffer that the pool has created, in use or pooled.
+    // None of them may be used after this.
+    void destroy_all();
+    // Releases the rings of buffers that have been idle for long enough.
+    // Cheap when none are due.
+    void release_idle_memory();
+    // Calls function(pbuffer) for every buffer that the pool has created
+    // and not yet destroyed, in use or pooled. The pool is locked meanwhile,
+    // so it must not call back into the pool.
+    template <class Function>
+    void for_each_buffer(Function function)
+    {
+        std::lock_guard<std::mutex> lk(mutex_);
+        for(thread_input_buffer* pbuffer : buffers_)
+            function(pbuffer);
+    }
+
+    input_buffer_pool_statistics statistics();
+
+private:
+    typedef std::chrono::steady_clock clock;
+
+    struct pooled_buffer {
+        thread_input_buffer* pbuffer;
+        clock::time_point pooled_time;
+        bool released;
+    };
+
+    // The capacity that thread_input_buffer::create gives a buffer.
+    static std::size_t ring_size(std::size_t size, bool mirrored);
+    void destroy_pooled(std::size_t index);
+    void forget(thread_input_buffer* pbuffer);
+
+    std::uint64_t const id_;
+    std::mutex mutex_;
+    // All buffers that the pool has created and not yet destroyed.
+    std::vector<thread_input_buffer*> buffers_;
+    std::vector<pooled_buffer> pooled_;
+    std::size_t max_buffers_;
+    clock::duration idle_release_time_;
+    std::size_t memory_budget_;
+    // Ring bytes of the buffers that this pool has created and not yet
+    // destroyed, and how many of them are resident.
+    std::size_t ring_bytes_;
+    std::size_t resident_bytes_;
+    std::uint64_t hits_;
+    std::uint64_t misses_;
+    // When the ring of a pooled buffer is next due to be released (as a
+    // count of clock ticks), or the maximum if none is, so that
+    // release_idle_memory() doesn't need the lock until then.
+    std::atomic<clock::rep> next_release_time_;
+};
+
+}   // namespace detail
+}   // namespace reckless
+
+#endif  // RECKLESS_DETAIL_INPUT_BUFFER_POOL_HPP
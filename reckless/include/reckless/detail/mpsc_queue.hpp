@@ -0,0 +1,176 @@
+#ifndef RECKLESS_DETAIL_MPSC_QUEUE_HPP
+#define RECKLESS_DETAIL_MPSC_QUEUE_HPP
+
+#include "reckless/memory_provider.hpp"
+
+#include <atomic>
+#include <new>          // bad_alloc
+#include <thread>       // yield
+#include <cstddef>      // size_t
+
+namespace reckless {
+namespace detail {
+
+// Bounded queue for any number of producers and a single consumer. A
+// producer claims a slot with a single fetch-add on the tail, then publishes
+// its element by bumping the slot's sequence number; there is no CAS loop to
+// retry and no ABA tag to maintain. The consumer takes whatever run of
+// published elements it finds at the head in one call to pop().
+//
+// push() fails if the queue looks full when it is called. If several
+// producers pass that check at the same time there may be more claimed slots
+// than the capacity, in which case the extra producers wait for the consumer
+// to free up their slot.
+template <class T>
+class mpsc_queue {
+public:
+    mpsc_queue() :
+        slots_(nullptr),
+        pprovider_(nullptr),
+        capacity_(0),
+        mask_(0),
+        tail_(0),
+        head_(0)
+    {
+    }
+
+    explicit mpsc_queue(std::size_t capacity) :
+        mpsc_queue()
+    {
+        reset(capacity);
+    }
+
+    ~mpsc_queue()
+    {
+        free_slots();
+    }
+
+    mpsc_queue(mpsc_queue const&) = delete;
+    mpsc_queue& operator=(mpsc_queue const&) = delete;
+
+    // Replaces the queue by an empty one with room for at least capacity
+    // elements, in memory from pprovider (or the default provider if it is
+    // nullptr). It must not be used by any other thread meanwhile. Throws
+    // std::bad_alloc (leaving the queue unchanged) if memory runs out.
+    void reset(std::size_t capacity, memory_provider* pprovider = nullptr)
+    {
+        if(pprovider == nullptr)
+            pprovider = default_memory_provider();
+        std::size_t size = 1;
+        while(size < capacity)
+            size *= 2;
+        slot* slots = static_cast<slot*>(pprovider->allocate(
+                    size*sizeof(slot), alignof(slot)));
+        if(slots == nullptr)
+            throw std::bad_alloc();
+        for(std::size_t i=0; i!=size; ++i) {
+            new (&slots[i]) slot();
+            slots[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        free_slots();
+        slots_ = slots;
+        pprovider_ = pprovider;
+        capacity_ = size;
+        mask_ = size - 1;
+        tail_.store(0, std::memory_order_relaxed);
+        head_.store(0, std::memory_order_relaxed);
+    }
+
+    std::size_t capacity() const
+    {
+        return capacity_;
+    }
+
+    bool push(T const& value)
+    {
+        std::size_t tail = tail_.load(std::memory_order_relaxed);
+        if(tail - head_.load(std::memory_order_acquire) >= capacity_)
+            return false;
+        std::size_t pos = tail_.fetch_add(1, std::memory_order_relaxed);
+        slot& s = slots_[pos & mask_];
+        while(s.sequence.load(std::memory_order_acquire) != pos)
+            std::this_thread::yield();
+        s.value = value;
+        s.sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Same as push(), but never waits: a slot is only claimed if the
+    // consumer is known to be done with it, even if other producers have
+    // claimed more slots than the capacity.
+    bool try_push(T const& value)
+    {
+        std::size_t tail = tail_.load(std::memory_order_relaxed);
+        do {
+            if(tail - head_.load(std::memory_order_acquire) >= capacity_)
+                return false;
+        } while(not tail_.compare_exchange_weak(tail, tail + 1,
+                    std::memory_order_relaxed));
+        // The consumer has popped the previous element in the slot, since
+        // the head is past it, and it did so before it moved the head.
+        slot& s = slots_[tail & mask_];
+        s.value = value;
+        s.sequence.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Moves up to max_count elements to pbatch and returns the number of
+    // elements moved. Only the consumer thread may call this.
+    std::size_t pop(T* pbatch, std::size_t max_count)
+    {
+        std::size_t head = head_.load(std::memory_order_relaxed);
+        std::size_t count = 0;
+        while(count != max_count) {
+            slot& s = slots_[(head + count) & mask_];
+            if(s.sequence.load(std::memory_order_acquire) != head + count + 1)
+                break;
+            pbatch[count] = s.value;
+            s.sequence.store(head + count + capacity_,
+                    std::memory_order_release);
+            ++count;
+        }
+        head_.store(head + count, std::memory_order_release);
+        return count;
+    }
+
+    bool empty() const
+    {
+        return tail_.load(std::memory_order_acquire)
+            == head_.load(std::memory_order_acquire);
+    }
+
+private:
+    struct slot {
+        std::atomic<std::size_t> sequence;
+        T value;
+    };
+
+    void free_slots()
+    {
+        if(slots_ == nullptr)
+            return;
+        for(std::size_t i=0; i!=capacity_; ++i)
+            slots_[i].~slot();
+        pprovider_->deallocate(slots_, capacity_*sizeof(slot));
+        slots_ = nullptr;
+    }
+
+    // Assumed cache line size, for keeping the producers' and consumer's
+    // counters apart.
+    static std::size_t const CACHE_LINE_SIZE = 64;
+
+    slot* slots_;
+    memory_provider* pprovider_;
+    std::size_t capacity_;
+    std::size_t mask_;
+    char pad1_[CACHE_LINE_SIZE];
+    std::atomic<std::size_t> tail_;     // next slot to claim, producers
+    char pad2_[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>)];
+    std::atomic<std::size_t> head_;     // next slot to pop, consumer
+    char pad3_[CACHE_LINE_SIZE - sizeof(std::atomic<std::size_t>)];
+};
+
+}   // namespace detail
+}   // namespace reckless
+
+#endif  // RECKLESS_DETAIL_MPSC_QUEUE_HPP
@@ -0,0 +1,79 @@
+#ifndef RECKLESS_DETAIL_NUMA_HPP
+#define RECKLESS_DETAIL_NUMA_HPP
+
+#include <atomic>
+#include <vector>
+#include <cstdint>  // uint64_t
+#include <cstddef>  // size_t
+
+namespace reckless {
+namespace detail {
+
+// The NUMA topology is read from sysfs the first time it is needed. On a
+// system without NUMA (or without sysfs) there is a single node 0 with all
+// CPUs on it.
+
+// Returns the number of NUMA nodes, i.e. one more than the highest node
+// number.
+unsigned numa_node_count();
+// Returns the NUMA node of the CPU that the calling thread is running on.
+unsigned current_numa_node();
+// Returns the CPUs that belong to a NUMA node.
+std::vector<unsigned> numa_node_cpus(unsigned node);
+// Asks for the pages in [p, p+size) to be allocated on the given node, and
+// moves those that have already been touched. p must be page aligned.
+// Returns false if that can't be done, in which case the pages are placed
+// as usual.
+bool place_on_numa_node(void* p, std::size_t size, unsigned node);
+// Parses a CPU or node list from sysfs, such as "0-3,8-11".
+std::vector<unsigned> parse_numa_list(char const* s);
+
+// Bytes of input that output threads have consumed from input buffers on one
+// NUMA node, in total and while running on another node.
+struct numa_node_counters {
+    numa_node_counters() : input_bytes(0), remote_input_bytes(0) {}
+    std::atomic<std::uint64_t> input_bytes;
+    std::atomic<std::uint64_t> remote_input_bytes;
+};
+
+// Counts the input that one thread consumes into a shared array of
+// numa_node_counters, indexed by the node of the input buffer.
+class numa_input_counter {
+public:
+    explicit numa_input_counter(numa_node_counters* pcounters = nullptr) :
+        pcounters_(pcounters),
+        node_(0)
+    {
+    }
+
+    // Finds out which node the calling thread is running on, to tell local
+    // input from remote input. Should be called now and then, since the
+    // thread may move.
+    void update_node()
+    {
+        node_ = current_numa_node();
+    }
+
+    // Counts bytes consumed from a buffer on buffer_node, which is -1 if the
+    // buffer was not placed on a particular node.
+    void count(int buffer_node, std::size_t bytes)
+    {
+        if(pcounters_ == nullptr or buffer_node < 0)
+            return;
+        numa_node_counters& counters = pcounters_[buffer_node];
+        counters.input_bytes.fetch_add(bytes, std::memory_order_relaxed);
+        if(static_cast<unsigned>(buffer_node) != node_) {
+            counters.remote_input_bytes.fetch_add(bytes,
+                    std::memory_order_relaxed);
+        }
+    }
+
+private:
+    numa_node_counters* pcounters_;
+    unsigned node_;
+};
+
+}   // namespace detail
+}   // namespace reckless
+
+#endif  // RECKLESS_DETAIL_NUMA_HPP
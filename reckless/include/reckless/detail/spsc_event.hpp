@@ -11,25 +11,25 @@
 
 class spsc_event {
 public:
-    spsc_event() : signal_(0)
+    spsc_event() : signal_(0), waiters_(0)
     {
     }
 
     void signal()
     {
-        // TODO possible performance improvement: If we know nobody is waiting,
-        // then we don't need to signal the futex.
+        // A thread counts itself as a waiter before it checks the signal and
+        // goes to sleep, and xchg is a full barrier, so if we see no waiters
+        // then nobody can miss the signal and there is no need for a system
+        // call.
         atomic_exchange_explicit(&signal_, 1, std::memory_order_release);
-        sys_futex(&signal_, FUTEX_WAKE, 1, nullptr, nullptr, 0);
+        if(__atomic_load_n(&waiters_, __ATOMIC_RELAXED) != 0)
+            sys_futex(&signal_, FUTEX_WAKE, 1, nullptr, nullptr, 0);
     }
 
     void wait()
     {
-        int signal = atomic_exchange_explicit(&signal_, 0, std::memory_order_acquire);
-        while(not signal) {
-            sys_futex(&signal_, FUTEX_WAIT, 0, nullptr, nullptr, 0);
-            signal = atomic_exchange_explicit(&signal_, 0, std::memory_order_acquire);
-        }
+        while(not wait_once(nullptr))
+            ;
     }
 
     bool wait(unsigned milliseconds)
@@ -48,9 +48,7 @@ public:
             unsigned remaining_ms = milliseconds - elapsed_ms;
             timeout.tv_sec = remaining_ms/1000;
             timeout.tv_nsec = static_cast<long>(remaining_ms%1000)*1000000;
-            sys_futex(&signal_, FUTEX_WAIT, 0, &timeout, nullptr, 0);
-            signal = atomic_exchange_explicit(&signal_, 0, std::memory_order_acquire);
-            if(signal)
+            if(wait_once(&timeout))
                 return true;
             
             struct timespec now;
@@ -64,6 +62,21 @@ public:
     }
 
 private:
+    // Sleeps until the event is signaled, or (if ptimeout isn't nullptr)
+    // until the timeout has passed or the thread is woken for some other
+    // reason. Returns true and clears the event if it was signaled.
+    bool wait_once(struct timespec const* ptimeout)
+    {
+        int signal = atomic_exchange_explicit(&signal_, 0, std::memory_order_acquire);
+        if(signal)
+            return true;
+        __sync_fetch_and_add(&waiters_, 1);
+        sys_futex(&signal_, FUTEX_WAIT, 0, ptimeout, nullptr, 0);
+        __sync_fetch_and_sub(&waiters_, 1);
+        signal = atomic_exchange_explicit(&signal_, 0, std::memory_order_acquire);
+        return signal != 0;
+    }
+
     int sys_futex(void *addr1, int op, int val1, struct timespec const *timeout,
             void *addr2, int val3)
     {
@@ -81,6 +94,8 @@ private:
     }
 
     int signal_;
+    // Number of threads that are asleep, or about to go to sleep, in wait().
+    int waiters_;
 };
 
 #endif // RECKLESS_DETAIL_SPSC_EVENT_HPP
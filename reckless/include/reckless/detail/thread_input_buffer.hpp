@@ -3,14 +3,22 @@
 
 #include "reckless/detail/spsc_event.hpp"
 #include "reckless/output_buffer.hpp"
+#include "reckless/memory_provider.hpp"
 #include "reckless/detail/utility.hpp"    // is_power_of_two
 
+#include <vector>
+#include <cstdint>      // uint64_t, uintptr_t
+#include <time.h>       // clock_gettime
+
 namespace reckless {
 
 class basic_log;
+enum class overflow_policy : unsigned char;
 
 namespace detail {
 
+class formatter_pool;
+
 typedef std::size_t formatter_dispatch_function_t(output_buffer*, char*);
 // TODO these checks need to be done at runtime now
 //static_assert(alignof(dispatch_function_t*) <= RECKLESS_FRAME_ALIGNMENT,
@@ -22,31 +30,123 @@ typedef std::size_t formatter_dispatch_function_t(output_buffer*, char*);
 //        "RECKLESS_FRAME_ALIGNMENT must at least match the size of a function pointer");
 formatter_dispatch_function_t* const WRAPAROUND_MARKER = reinterpret_cast<
     formatter_dispatch_function_t*>(0);
+// Tells the output thread to continue in the next input_segment, or back at
+// the start of the ring if it is at the end of the last segment.
+formatter_dispatch_function_t* const SEGMENT_MARKER = reinterpret_cast<
+    formatter_dispatch_function_t*>(1);
+
+// True for WRAPAROUND_MARKER and SEGMENT_MARKER, so that the output thread
+// only needs one test per frame to look for either of them.
+inline bool is_marker(formatter_dispatch_function_t* pdispatch)
+{
+    return reinterpret_cast<std::uintptr_t>(pdispatch)
+        <= reinterpret_cast<std::uintptr_t>(SEGMENT_MARKER);
+}
+
+// Time stamp for frames with commit_mode::merged_buffers, which is stored
+// where the dispatch pointer would otherwise be: the time stamp counter on
+// x86, the virtual counter on ARMv8, and the monotonic clock in nanoseconds
+// elsewhere. It is never mistaken for a marker since none of them go back
+// to 0 after boot. The output thread works out its frequency (see
+// merge_clock in basic_log.cpp).
+inline std::uint64_t read_frame_stamp_counter()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+    std::uint64_t value;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<std::uint64_t>(ts.tv_sec)*1000000000u
+        + static_cast<std::uint64_t>(ts.tv_nsec);
+#endif
+}
+
+// A block of memory that is chained to a thread_input_buffer when a burst of
+// log entries doesn't fit in the ring, or for an entry that is larger than
+// the ring. Unlike the ring, a segment is filled from start to end and is
+// never reused until the output thread has moved past it.
+struct input_segment {
+    input_segment* pnext;
+    std::size_t capacity;
+
+    char* data()
+    {
+        return static_cast<char*>(static_cast<void*>(this + 1));
+    }
+};
+
+// A saved value of input_end(), see thread_input_buffer::rewind_input_end.
+struct input_mark {
+    char* pinput_end;
+    input_segment* psegment;
+};
 
 class thread_input_buffer {
 public:
-    static thread_input_buffer* create(std::size_t size)
+    // If mirrored is true, the ring is mapped twice in a row in virtual
+    // memory, so that a frame can continue past the end of the ring into its
+    // start and no space is lost to wraparound. Its size is then rounded up
+    // to a multiple of the page size. If the mapping can't be set up, an
+    // ordinary ring is used instead. If numa_node is not -1, the buffer is
+    // allocated on that NUMA node if possible. Memory for anything but a
+    // mirrored ring comes from pprovider, or from the default provider if
+    // it is nullptr.
+    static thread_input_buffer* create(std::size_t size,
+            bool mirrored = false, int numa_node = -1,
+            memory_provider* pprovider = nullptr);
+
+    static void destroy(thread_input_buffer* p);
+    // Puts a drained buffer back in the state of a new one, so that it can
+    // be given to another thread (see input_buffer_pool).
+    void recycle();
+    // Gives the memory of the ring back to the system, for a buffer that
+    // isn't in use. It is zero-filled when it is touched again.
+    void release_ring_memory();
+    // returns pointer to allocated input frame, moves input_end() forward.
+    // If there is no room, a segment is chained as long as the segments in
+    // use stay within growth_limit bytes; otherwise it waits for the output
+    // thread, or helps it through pformatter_pool (see
+    // formatter_pool::help) if that is not nullptr. Before waiting, it
+    // signals pdoorbell (if not nullptr) to wake up the output thread.
+    char* allocate_input_frame(std::size_t size, std::size_t growth_limit,
+            formatter_pool* pformatter_pool = nullptr,
+            spsc_event* pdoorbell = nullptr);
+    // Same as allocate_input_frame, but returns nullptr instead of waiting
+    // if there is not enough room in the ring (or current segment), and
+    // never chains a new segment. If reserve is nonzero, then at least that
+    // many bytes must remain free in the ring after the frame has been
+    // allocated.
+    char* try_allocate_input_frame(std::size_t size, std::size_t reserve = 0);
+    // Allocates the frame at the start of a new segment, or returns nullptr
+    // if that would make the segments in use exceed growth_limit bytes.
+    // Frames that are larger than the ring are allowed to exceed the limit
+    // when everything else has been consumed, so that they can always be
+    // written eventually.
+    char* try_allocate_segment_frame(std::size_t size,
+            std::size_t growth_limit);
+    input_mark mark_input_end() const
     {
-        std::size_t full_size = sizeof(thread_input_buffer) + size - sizeof(formatter_dispatch_function_t*);
-        char* buf = new char[full_size];
-        try {
-            return new (buf) thread_input_buffer(size);
-        } catch(...) {
-            delete [] buf;
-            throw;
-        }
+        return {pinput_end_, psegment_};
     }
-
-    static void destroy(thread_input_buffer* p)
+    // Undoes the allocation of frames that have not been committed, by
+    // moving input_end() back to the marked position.
+    void rewind_input_end(input_mark const& mark)
     {
-        p->~thread_input_buffer();
-        delete [] static_cast<char*>(static_cast<void*>(p));
+        if(psegment_ != mark.psegment)
+            release_segments_after(mark.psegment);
+        psegment_ = mark.psegment;
+        pinput_end_ = mark.pinput_end;
     }
-    // returns pointer to allocated input frame, moves input_end() forward.
-    char* allocate_input_frame(std::size_t size);
     // returns pointer to following input frame
     char* discard_input_frame(std::size_t size);
     char* wraparound();
+    // Moves to the place that a SEGMENT_MARKER leads to, and releases the
+    // segment that it was found in.
+    char* next_segment();
     char* input_start() const
     {
         return pinput_start_.load(std::memory_order_relaxed);
@@ -55,16 +155,112 @@ public:
     {
         return pinput_end_;
     }
+    bool is_mirrored() const
+    {
+        return mirrored_;
+    }
+    memory_provider* provider() const
+    {
+        return pprovider_;
+    }
+    // Faults in the pages of the ring by writing to them, so that writing
+    // log entries later doesn't have to. Only for the owning thread. Returns
+    // false and does nothing if the buffer is not empty.
+    bool prefault_ring();
+    // Makes the input up to pinput_end visible to an output thread that
+    // polls the buffer (see commit_mode::polled_buffers). Returns true if
+    // the output thread had consumed everything published before, in which
+    // case it may have gone to sleep.
+    bool publish_input_end(char* pinput_end)
+    {
+        char* pprevious = ppublished_end_.load(std::memory_order_relaxed);
+        pcached_input_start_ = pinput_start_.load(std::memory_order_relaxed);
+        ppublished_end_.store(pinput_end, std::memory_order_release);
+        return pcached_input_start_ == pprevious;
+    }
+    char* published_input_end() const
+    {
+        return ppublished_end_.load(std::memory_order_acquire);
+    }
+    // Called by the owning thread as it exits, before it hands the buffer
+    // over to the output thread. Publishes the end of its input, so that
+    // the output thread can tell when it has drained the buffer, and sets
+    // abandoned_flag.
+    void retire()
+    {
+        ppublished_end_.store(pinput_end_, std::memory_order_release);
+        abandoned_flag.store(true, std::memory_order_release);
+    }
+    // Whether everything in a retired buffer has been consumed.
+    bool drained() const
+    {
+        return input_start() == published_input_end();
+    }
+    std::size_t capacity() const
+    {
+        return size_;
+    }
     void signal_input_consumed();
 
-    bool input_consumed_flag;
+    // Set when the buffer is registered with an output thread that polls
+    // it, and cleared by that output thread when it lets go of the buffer.
+    // The buffer is not destroyed while this is set.
+    std::atomic<bool> polled_flag;
+    // Set when the owning thread has exited, which tells a polling output
+    // thread to let go of the buffer once it has drained it.
+    std::atomic<bool> abandoned_flag;
+    // Links the buffers of exited threads that are waiting to be taken over
+    // by an output thread (see basic_log.cpp).
+    thread_input_buffer* pnext_retired;
+    // Id of the input_buffer_pool that counts the buffer, or 0 for none.
+    std::uint64_t pool_id;
+    // The NUMA node that the buffer was allocated on, or -1 if it was not
+    // placed on any particular node.
+    int const numa_node;
+    // Number of messages dropped because of the overflow policy since the
+    // last "messages dropped" notice was written. The output thread takes
+    // the count over (by exchanging it for 0) when the owning thread may
+    // not get around to writing the notice itself, see
+    // basic_log::write_orphaned_drop_notice.
+    std::atomic<std::size_t> unreported_dropped_messages;
+
+    // The remaining fields are only accessed by the thread that owns the
+    // buffer.
+    // Overflow policy set with basic_log::set_thread_overflow_policy, if
+    // has_overflow_policy is true.
+    bool has_overflow_policy;
+    overflow_policy thread_overflow_policy;
+    // Number of messages dropped because of the overflow policy.
+    std::size_t dropped_messages;
+    // Number of allocations that have had to wait for the output thread.
+    std::size_t stall_count;
+    // If nonzero, the buffer should be replaced by one of this size. See
+    // basic_log::set_thread_input_buffer_size.
+    std::size_t requested_capacity;
+    // Number of basic_log::handle objects that refer to the buffer. It can't
+    // be replaced while there are any.
+    unsigned handle_count;
 
 private:
-    thread_input_buffer(std::size_t size);
+    thread_input_buffer(std::size_t size, char* pmirrored_ring,
+            int numa_node, memory_provider* pprovider,
+            std::size_t allocated_size);
     ~thread_input_buffer();
     
     char* advance_frame_pointer(char* p, std::size_t distance);
-    void wait_input_consumed();
+    char* try_allocate_ring_frame(std::size_t size, std::size_t reserve);
+    char* fit_ring_frame(std::size_t size, std::size_t reserve,
+            char* pinput_start);
+    char* try_allocate_in_segment(std::size_t size, std::size_t reserve);
+    void write_segment_marker(input_segment* pnext);
+    void release_segments_after(input_segment* psegment);
+    void release_segment(input_segment* psegment);
+    bool is_in_ring(char* p)
+    {
+        return reinterpret_cast<std::uintptr_t>(p)
+            - reinterpret_cast<std::uintptr_t>(buffer_start()) < size_;
+    }
+    void wait_input_consumed(spsc_event* pdoorbell = nullptr);
     bool is_aligned(void* p) const
     {
         return (reinterpret_cast<std::uintptr_t>(p) & frame_alignment_mask()) == 0;
@@ -82,15 +278,47 @@ private:
 
     char* buffer_start()
     {
-        return static_cast<char*>(static_cast<void*>(&buffer_start_));
+        return pring_;
     }
 
+    // Assumed cache line size. The fields that the thread writing to the
+    // buffer updates for every frame are kept on different cache lines from
+    // those that the output thread updates, so that neither has to take a
+    // cache line away from the other unless the buffer runs full (or, with
+    // polling, the output thread checks for new input).
+    static std::size_t const CACHE_LINE_SIZE = 64;
+
+    // Fields that are rarely written after construction.
     spsc_event input_consumed_event_;
     std::size_t size_;                // number of chars in buffer
+    char* pring_;                     // start of the ring, buffer_start_ unless mirrored
+    bool mirrored_;                   // whether the ring is mapped twice in a row
+    memory_provider* pprovider_;      // where the memory of the buffer came from
+    std::size_t allocated_size_;      // how much of it
+    std::atomic<std::size_t> segment_bytes_;  // total capacity of chained segments
+    char pad1_[CACHE_LINE_SIZE];
 
-    std::atomic<char*> pinput_start_; // moved forward by output thread, read by logger::write (to determine free space left)
+    // Fields that are written by the thread that owns the buffer.
     char* pinput_end_;                // moved forward by logger::write, never read by anyone else
+    char* pcached_input_start_;       // last seen value of pinput_start_
+    std::atomic<char*> ppublished_end_;  // end of committed input, for a polling output thread
+    input_segment* psegment_;         // segment that pinput_end_ is in, or nullptr for the ring
+    input_segment* pring_exit_;       // segment that the SEGMENT_MARKER in the ring leads to
+    char pad2_[CACHE_LINE_SIZE];
+
+    // Fields that are written by the output thread.
+    std::atomic<char*> pinput_start_; // moved forward by output thread, read by logger::write (to determine free space left)
+    input_segment* pconsumer_segment_;  // segment that pinput_start_ is in, only used by the output thread
+public:
+    // Only accessed by the output thread.
+    bool input_consumed_flag;
+private:
+    char pad3_[CACHE_LINE_SIZE];
+
+    // Start of the ring, unless it is mirrored.
     formatter_dispatch_function_t* buffer_start_;
+
+    friend class thread_input_buffer_suite;
 };
 
 struct commit_extent {
@@ -98,6 +326,23 @@ struct commit_extent {
     char* pcommit_end;
 };
 
+// Adds pbuffer to *ptouched_input_buffers (unless it is nullptr) so that the
+// thread that owns it can be told that there is room now.
+inline void mark_input_consumed(thread_input_buffer* pbuffer,
+        std::vector<thread_input_buffer*>* ptouched_input_buffers)
+{
+    if(ptouched_input_buffers and not pbuffer->input_consumed_flag) {
+        ptouched_input_buffers->push_back(pbuffer);
+        pbuffer->input_consumed_flag = true;
+    }
+}
+
+// Formats the frames in pbuffer up to pinput_end, and marks the buffer as
+// consumed. Returns the total size of the frames.
+std::size_t consume_input(output_buffer* poutput, thread_input_buffer* pbuffer,
+        char* pinput_end,
+        std::vector<thread_input_buffer*>* ptouched_input_buffers);
+
 }
 }
 
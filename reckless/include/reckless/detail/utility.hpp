@@ -35,6 +35,19 @@ std::size_t get_page_size() __attribute__ ((const));
 //// cache_line_size instead.
 //std::size_t get_cache_line_size() __attribute__((const));
 void prefetch(void const* ptr, std::size_t size);
+
+// Hint to the CPU that we are in a spin-wait loop. Falls back to a plain
+// compiler barrier on architectures without a suitable instruction.
+inline void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield" ::: "memory");
+#else
+    asm volatile("" ::: "memory");
+#endif
+}
 //
 inline constexpr bool is_power_of_two(std::size_t v)
 {
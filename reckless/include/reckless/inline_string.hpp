@@ -0,0 +1,256 @@
+#ifndef RECKLESS_INLINE_STRING_HPP
+#define RECKLESS_INLINE_STRING_HPP
+
+#include <cstddef>      // size_t
+#include <cstring>      // strlen, memcpy
+#include <type_traits>  // enable_if, is_same, decay
+#include <utility>      // declval, forward
+
+namespace reckless {
+
+// A string argument whose characters have been copied into the input frame,
+// right after the other arguments. policy_log and severity_log store
+// std::string arguments (and other string-like types, see
+// detail::is_string_object) this way instead of copy-constructing them, so
+// logging a string never allocates memory on the calling thread. Formatters
+// receive an inline_string in place of the original object.
+//
+// Strings that would make the frame too large to fit comfortably in the
+// thread's input buffer are copied to the heap instead; this is invisible to
+// the formatter.
+class inline_string {
+public:
+    inline_string(char const* data, std::size_t size, bool heap_allocated) :
+        data_(data),
+        size_(size),
+        heap_allocated_(heap_allocated)
+    {
+    }
+
+    inline_string(inline_string&& other) :
+        data_(other.data_),
+        size_(other.size_),
+        heap_allocated_(other.heap_allocated_)
+    {
+        other.heap_allocated_ = false;
+    }
+
+    ~inline_string()
+    {
+        if(heap_allocated_)
+            delete [] data_;
+    }
+
+    char const* data() const
+    {
+        return data_;
+    }
+
+    std::size_t size() const
+    {
+        return size_;
+    }
+
+    // Number of bytes that the string occupies in the input frame.
+    std::size_t frame_size() const
+    {
+        return heap_allocated_? 0 : size_;
+    }
+
+private:
+    inline_string(inline_string const&) = delete;
+    inline_string& operator=(inline_string const&) = delete;
+
+    char const* data_;
+    std::size_t size_;
+    bool heap_allocated_;
+};
+
+// Same as inline_string, but used for char const* arguments. The original
+// pointer is kept so that it can still be formatted with %p.
+class inline_c_string : public inline_string {
+public:
+    inline_c_string(char const* data, std::size_t size, bool heap_allocated,
+            void const* pointer) :
+        inline_string(data, size, heap_allocated),
+        pointer_(pointer)
+    {
+    }
+
+    inline_c_string(inline_c_string&& other) :
+        inline_string(std::move(other)),
+        pointer_(other.pointer_)
+    {
+    }
+
+    void const* pointer() const
+    {
+        return pointer_;
+    }
+
+private:
+    void const* pointer_;
+};
+
+namespace detail {
+
+// Matches std::string and string_view-style types, i.e. types with a char
+// traits_type, data() and size().
+template <class T, class = void>
+struct is_string_object : std::false_type {
+};
+
+template <class T>
+struct is_string_object<T, typename std::enable_if<
+    std::is_same<typename T::traits_type::char_type, char>::value &&
+    std::is_convertible<decltype(std::declval<T const&>().data()), char const*>::value &&
+    std::is_convertible<decltype(std::declval<T const&>().size()), std::size_t>::value
+    >::type> : std::true_type
+{
+};
+
+template <class T>
+struct is_c_string : std::integral_constant<bool,
+    std::is_same<typename std::decay<T>::type, char const*>::value ||
+    std::is_same<typename std::decay<T>::type, char*>::value>
+{
+};
+
+// Produced on the calling thread by capture_string() and turned into the
+// stored inline string type String by basic_log when the frame is
+// constructed.
+template <class String>
+struct string_capture {
+    char const* data;
+    std::size_t size;
+    void const* pointer;
+};
+
+template <class T>
+typename std::enable_if<
+    not is_c_string<T>::value &&
+    not is_string_object<typename std::decay<T>::type>::value, T&&>::type
+capture_string(T&& v)
+{
+    return std::forward<T>(v);
+}
+
+template <class T>
+typename std::enable_if<is_c_string<T>::value,
+    string_capture<inline_c_string>>::type
+capture_string(T&& v)
+{
+    char const* s = v;
+    return {s, s? std::strlen(s) : 0, s};
+}
+
+template <class T>
+typename std::enable_if<is_string_object<typename std::decay<T>::type>::value,
+    string_capture<inline_string>>::type
+capture_string(T&& v)
+{
+    return {v.data(), v.size(), nullptr};
+}
+
+// Maps an argument passed to basic_log::write to the type stored in the
+// input frame.
+template <class T>
+struct frame_argument {
+    typedef typename std::decay<T>::type type;
+};
+
+template <class String>
+struct frame_argument<string_capture<String>> {
+    typedef String type;
+};
+
+template <class String>
+struct frame_argument<string_capture<String>&> {
+    typedef String type;
+};
+
+template <class String>
+struct frame_argument<string_capture<String> const&> {
+    typedef String type;
+};
+
+// Copies a captured string to pinline (which is then advanced past it), or
+// to the heap if pinline is null.
+inline char const* store_string_characters(char*& pinline,
+        char const* data, std::size_t size)
+{
+    if(size == 0)
+        return "";
+    char* p = pinline? pinline : new char[size];
+    std::memcpy(p, data, size);
+    if(pinline)
+        pinline += size;
+    return p;
+}
+
+template <class T>
+T&& store_frame_argument(char*&, T&& v)
+{
+    return std::forward<T>(v);
+}
+
+// The captures are taken by value so that these overloads win over the
+// forwarding template above.
+inline inline_string store_frame_argument(char*& pinline,
+        string_capture<inline_string> c)
+{
+    bool heap_allocated = pinline == nullptr && c.size != 0;
+    return inline_string(store_string_characters(pinline, c.data, c.size),
+            c.size, heap_allocated);
+}
+
+inline inline_c_string store_frame_argument(char*& pinline,
+        string_capture<inline_c_string> c)
+{
+    bool heap_allocated = pinline == nullptr && c.size != 0;
+    return inline_c_string(store_string_characters(pinline, c.data, c.size),
+            c.size, heap_allocated, c.pointer);
+}
+
+// Number of string characters that an argument adds to the frame.
+template <class T>
+std::size_t captured_size(T const&)
+{
+    return 0;
+}
+
+template <class String>
+std::size_t captured_size(string_capture<String> const& c)
+{
+    return c.size;
+}
+
+inline std::size_t total_captured_size()
+{
+    return 0;
+}
+
+template <class T, class... Args>
+std::size_t total_captured_size(T const& v, Args const&... args)
+{
+    return captured_size(v) + total_captured_size(args...);
+}
+
+// Same as above, but for the stored arguments on the output thread.
+template <class T>
+typename std::enable_if<not std::is_base_of<inline_string, T>::value,
+    std::size_t>::type
+stored_size(T const&)
+{
+    return 0;
+}
+
+inline std::size_t stored_size(inline_string const& s)
+{
+    return s.frame_size();
+}
+
+}   // namespace detail
+}   // namespace reckless
+
+#endif  // RECKLESS_INLINE_STRING_HPP
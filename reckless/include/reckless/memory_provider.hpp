@@ -0,0 +1,68 @@
+#ifndef RECKLESS_MEMORY_PROVIDER_HPP
+#define RECKLESS_MEMORY_PROVIDER_HPP
+
+#include <cstddef>  // size_t
+
+namespace reckless {
+
+// Supplies the memory for the buffers of a log: the thread input buffers,
+// the output buffer and the shared input queue (see
+// basic_log::set_memory_provider). A provider may be called from any thread.
+class memory_provider {
+public:
+    virtual ~memory_provider() = 0;
+    // Returns size bytes aligned to alignment, which is a power of two no
+    // larger than the page size, or nullptr if that can't be done.
+    virtual void* allocate(std::size_t size, std::size_t alignment) = 0;
+    // Gives back memory from allocate(), with the size that was asked for.
+    virtual void deallocate(void* p, std::size_t size) = 0;
+};
+
+// Memory from the heap. Logs use this unless they are given another
+// provider.
+class heap_memory_provider : public memory_provider {
+public:
+    void* allocate(std::size_t size, std::size_t alignment);
+    void deallocate(void* p, std::size_t size);
+};
+
+// Maps memory of its own for each allocation, in whole pages, with the
+// options given to the constructor.
+class mapped_memory_provider : public memory_provider {
+public:
+    enum options : unsigned {
+        // Asks for transparent huge pages (MADV_HUGEPAGE), which the kernel
+        // uses where it can for allocations of at least a huge page.
+        transparent_hugepages = 1,
+        // Maps explicit huge pages (MAP_HUGETLB) from those reserved through
+        // /proc/sys/vm/nr_hugepages. Ordinary pages are mapped instead if
+        // there are none left. Either way, allocations are rounded up to the
+        // huge page size.
+        explicit_hugepages = 2,
+        // Faults in all pages right away (MAP_POPULATE), so that the first
+        // write to them doesn't have to.
+        prefault = 4,
+        // Locks the pages in memory (mlock), so they can't be swapped out.
+        // Allocations fail if that would go past RLIMIT_MEMLOCK.
+        lock = 8
+    };
+
+    explicit mapped_memory_provider(unsigned options = 0);
+    void* allocate(std::size_t size, std::size_t alignment);
+    void deallocate(void* p, std::size_t size);
+
+private:
+    std::size_t mapped_size(std::size_t size) const;
+
+    unsigned options_;
+    std::size_t page_size_;
+};
+
+namespace detail {
+// The provider that is used when none is given.
+memory_provider* default_memory_provider();
+}
+
+}   // namespace reckless
+
+#endif  // RECKLESS_MEMORY_PROVIDER_HPP
@@ -9,6 +9,7 @@
 
 namespace reckless {
 class writer;
+class memory_provider;
 
 class output_buffer {
 public:
@@ -16,12 +17,17 @@ public:
     // TODO hide functions that are not relevant to the client, e.g. move
     // assignment, empty(), flush etc?
     output_buffer(output_buffer&& other);
-    output_buffer(writer* pwriter, std::size_t max_capacity);
+    output_buffer(writer* pwriter, std::size_t max_capacity,
+            memory_provider* pprovider = nullptr);
     ~output_buffer();
 
     output_buffer& operator=(output_buffer&& other);
 
-    void reset(writer* pwriter, std::size_t max_capacity);
+    // Throws std::bad_alloc if the buffer can't be allocated. Without a
+    // memory provider the buffer comes from the heap, and all but its first
+    // page are left to be faulted in as they are needed.
+    void reset(writer* pwriter, std::size_t max_capacity,
+            memory_provider* pprovider = nullptr);
 
     char* reserve(std::size_t size)
     {
@@ -69,7 +75,10 @@ private:
     output_buffer(output_buffer const&) = delete;
     output_buffer& operator=(output_buffer const&) = delete;
 
+    void free_buffer();
+
     writer* pwriter_;
+    memory_provider* pprovider_;
     char* pbuffer_;
     char* pcommit_end_;
     char* pbuffer_end_;
@@ -8,8 +8,6 @@
 #include <cstdlib>  // size_t
 
 namespace reckless {
-// TODO some way of allocating a specific input buffer size for a thread that
-// needs extra space.
 
 class timestamp_field {
 public:
@@ -89,12 +87,24 @@ private:
     unsigned level_;
 };
 
+namespace detail {
+    // The header field used for the line that reports dropped messages (see
+    // overflow_policy). Fields that can't be default-constructed specialize
+    // this.
+    template <class Field>
+    struct notice_field {
+        typedef Field type;
+    };
+}
+
 template <class IndentPolicy, char Separator, class... Fields>
 class policy_formatter {
 public:
-    template <typename... Args>
+    // Format is either char const* or a compiled format created by
+    // RECKLESS_FORMAT.
+    template <class Format, typename... Args>
     static void format(output_buffer* pbuffer, Fields&&... fields,
-        IndentPolicy indent, char const* pformat, Args&&... args)
+        IndentPolicy indent, Format pformat, Args&&... args)
     {
         format_fields(pbuffer, fields...);
         indent.apply(pbuffer);
@@ -104,6 +114,13 @@ public:
         pbuffer->commit(1);
     }
 
+    static void format_dropped_messages(output_buffer* pbuffer,
+            std::size_t count)
+    {
+        format(pbuffer, typename detail::notice_field<Fields>::type()...,
+                IndentPolicy(), "%d messages dropped", count);
+    }
+
 private:
     template <class Field, class... Remaining>
     static void format_fields(output_buffer* pbuffer, Field&& field, Remaining&&... remaining)
@@ -137,15 +154,54 @@ public:
     {
     }
 
-    template <typename... Args>
-    void write(char const* fmt, Args&&... args)
+    // fmt may be a plain format string or RECKLESS_FORMAT("..."). The
+    // characters of string arguments are copied to the input buffer (see
+    // inline_string), so they need not outlive the call.
+    template <class Format, typename... Args>
+    void write(Format fmt, Args&&... args)
     {
-        basic_log::write<policy_formatter<IndentPolicy, FieldSeparator, HeaderFields...>>(
+        basic_log::write<formatter_t>(
                 HeaderFields()...,
                 IndentPolicy(),
                 fmt,
-                std::forward<Args>(args)...);
+                detail::capture_string(std::forward<Args>(args))...);
     }
+
+    // Same as write, but never makes a system call or allocates memory.
+    // Messages are dropped instead of waiting for room. See
+    // basic_log::strict_write for the conditions.
+    template <class Format, typename... Args>
+    void strict_write(Format fmt, Args&&... args)
+    {
+        basic_log::strict_write<formatter_t>(
+                HeaderFields()...,
+                IndentPolicy(),
+                fmt,
+                detail::capture_string(std::forward<Args>(args))...);
+    }
+
+    // Writes lines from the calling thread without publishing them to the
+    // output thread until commit() is called. See basic_log::handle.
+    class handle : public basic_log::handle {
+    public:
+        explicit handle(policy_log& log) :
+            basic_log::handle(log)
+        {
+        }
+
+        template <class Format, typename... Args>
+        void write(Format fmt, Args&&... args)
+        {
+            basic_log::handle::write<formatter_t>(
+                    HeaderFields()...,
+                    IndentPolicy(),
+                    fmt,
+                    detail::capture_string(std::forward<Args>(args))...);
+        }
+    };
+
+private:
+    typedef policy_formatter<IndentPolicy, FieldSeparator, HeaderFields...> formatter_t;
 };
 
 }   // namespace reckless
@@ -19,18 +19,41 @@ private:
     char severity_;
 };
 
-namespace detail {
-    template <class HeaderField>
-    HeaderField construct_header_field(char)
+// A severity_field for a severity that is known at compile time, as it is for
+// each of the severity_log functions. Since it is an empty type it takes no
+// space in the input frame; it turns into a regular severity_field when the
+// frame is formatted.
+template <char Severity>
+class static_severity_field {
+public:
+    operator severity_field() const
     {
-         return HeaderField();
+        return severity_field(Severity);
     }
+};
 
-    template <>
-    inline severity_field construct_header_field<severity_field>(char severity)
+namespace detail {
+    template <class HeaderField, char Severity>
+    struct header_field {
+        typedef HeaderField type;
+    };
+
+    template <char Severity>
+    struct header_field<severity_field, Severity> {
+        typedef static_severity_field<Severity> type;
+    };
+
+    template <class HeaderField, char Severity>
+    typename header_field<HeaderField, Severity>::type construct_header_field()
     {
-         return severity_field(severity);
+         return typename header_field<HeaderField, Severity>::type();
     }
+
+    // Dropped messages are reported as warnings.
+    template <>
+    struct notice_field<severity_field> {
+        typedef static_severity_field<'W'> type;
+    };
 }
 
 template <class IndentPolicy, char FieldSeparator, class... HeaderFields>
@@ -51,36 +74,116 @@ public:
     {
     }
 
-    template <typename... Args>
-    void debug(char const* fmt, Args&&... args)
+    template <class Format, typename... Args>
+    void debug(Format fmt, Args&&... args)
     {
-        write('D', fmt, std::forward<Args>(args)...);
+        write<'D', true>(fmt, std::forward<Args>(args)...);
     }
-    template <typename... Args>
-    void info(char const* fmt, Args&&... args)
+    template <class Format, typename... Args>
+    void info(Format fmt, Args&&... args)
     {
-        write('I', fmt, std::forward<Args>(args)...);
+        write<'I', true>(fmt, std::forward<Args>(args)...);
     }
-    template <typename... Args>
-    void warn(char const* fmt, Args&&... args)
+    template <class Format, typename... Args>
+    void warn(Format fmt, Args&&... args)
     {
-        write('W', fmt, std::forward<Args>(args)...);
+        write<'W', false>(fmt, std::forward<Args>(args)...);
     }
-    template <typename... Args>
-    void error(char const* fmt, Args&&... args)
+    template <class Format, typename... Args>
+    void error(Format fmt, Args&&... args)
     {
-        write('E', fmt, std::forward<Args>(args)...);
+        write<'E', false>(fmt, std::forward<Args>(args)...);
     }
 
+    // Same as the above, but never make a system call or allocate memory.
+    // Messages are dropped instead of waiting for room. See
+    // basic_log::strict_write for the conditions.
+    template <class Format, typename... Args>
+    void strict_debug(Format fmt, Args&&... args)
+    {
+        strict_write<'D', true>(fmt, std::forward<Args>(args)...);
+    }
+    template <class Format, typename... Args>
+    void strict_info(Format fmt, Args&&... args)
+    {
+        strict_write<'I', true>(fmt, std::forward<Args>(args)...);
+    }
+    template <class Format, typename... Args>
+    void strict_warn(Format fmt, Args&&... args)
+    {
+        strict_write<'W', false>(fmt, std::forward<Args>(args)...);
+    }
+    template <class Format, typename... Args>
+    void strict_error(Format fmt, Args&&... args)
+    {
+        strict_write<'E', false>(fmt, std::forward<Args>(args)...);
+    }
+
+    // Writes lines from the calling thread without publishing them to the
+    // output thread until commit() is called. See basic_log::handle.
+    class handle : public basic_log::handle {
+    public:
+        explicit handle(severity_log& log) :
+            basic_log::handle(log)
+        {
+        }
+
+        template <class Format, typename... Args>
+        void debug(Format fmt, Args&&... args)
+        {
+            write<'D', true>(fmt, std::forward<Args>(args)...);
+        }
+        template <class Format, typename... Args>
+        void info(Format fmt, Args&&... args)
+        {
+            write<'I', true>(fmt, std::forward<Args>(args)...);
+        }
+        template <class Format, typename... Args>
+        void warn(Format fmt, Args&&... args)
+        {
+            write<'W', false>(fmt, std::forward<Args>(args)...);
+        }
+        template <class Format, typename... Args>
+        void error(Format fmt, Args&&... args)
+        {
+            write<'E', false>(fmt, std::forward<Args>(args)...);
+        }
+
+    private:
+        // Debug and info messages are low-severity messages for
+        // overflow_policy::drop_low_severity.
+        template <char Severity, bool LowSeverity, class Format, typename... Args>
+        void write(Format fmt, Args&&... args)
+        {
+            basic_log::handle::write<formatter_t, LowSeverity>(
+                    detail::construct_header_field<HeaderFields, Severity>()...,
+                    IndentPolicy(),
+                    fmt,
+                    detail::capture_string(std::forward<Args>(args))...);
+        }
+    };
+
 private:
-    template <typename... Args>
-    void write(char severity, char const* fmt, Args&&... args)
+    typedef policy_formatter<IndentPolicy, FieldSeparator, HeaderFields...> formatter_t;
+
+    template <char Severity, bool LowSeverity, class Format, typename... Args>
+    void write(Format fmt, Args&&... args)
+    {
+        basic_log::write<formatter_t, LowSeverity>(
+                detail::construct_header_field<HeaderFields, Severity>()...,
+                IndentPolicy(),
+                fmt,
+                detail::capture_string(std::forward<Args>(args))...);
+    }
+
+    template <char Severity, bool LowSeverity, class Format, typename... Args>
+    void strict_write(Format fmt, Args&&... args)
     {
-        basic_log::write<policy_formatter<IndentPolicy, FieldSeparator, HeaderFields...>>(
-                detail::construct_header_field<HeaderFields>(severity)...,
+        basic_log::strict_write<formatter_t, LowSeverity>(
+                detail::construct_header_field<HeaderFields, Severity>()...,
                 IndentPolicy(),
                 fmt,
-                std::forward<Args>(args)...);
+                detail::capture_string(std::forward<Args>(args))...);
     }
 };
 
@@ -0,0 +1,226 @@
+#ifndef RECKLESS_SHARDED_LOG_HPP
+#define RECKLESS_SHARDED_LOG_HPP
+
+#include <reckless/basic_log.hpp>
+#include <reckless/writer.hpp>
+
+#include <atomic>
+#include <memory>       // unique_ptr
+#include <vector>
+#include <utility>      // forward, pair
+#include <cassert>
+#include <cstddef>      // size_t
+
+namespace reckless {
+namespace detail {
+
+// The most shards that a sharded_log can have, since the shard index is
+// kept in one byte of thread_log_shards.
+std::size_t const max_log_shards = 255;
+
+// The shard that the calling thread writes to in each sharded_log, indexed
+// by the id of the sharded_log. The low byte is the shard index plus one,
+// and the rest is the generation of the log that gave it out (see
+// sharded_log_generation), so that a thread doesn't keep a shard that it
+// was given by an earlier log with the same id. A thread starts out with 0,
+// which matches no generation.
+extern __thread unsigned thread_log_shards[max_log_instances]
+    __attribute__((tls_model("initial-exec")));
+
+// Throws std::invalid_argument if shard_count is 0 or more than
+// max_log_shards, and std::bad_alloc if max_log_instances sharded logs exist
+// already.
+std::size_t acquire_sharded_log_id(std::size_t shard_count);
+void release_sharded_log_id(std::size_t id);
+// The generation of the sharded_log that has the id. It changes every time
+// the id is acquired, and is never 0.
+unsigned sharded_log_generation(std::size_t id);
+
+}   // namespace detail
+
+// Spreads the threads that write to a log over a number of independent logs
+// of type Log ("shards"), each with its own output thread, buffers and
+// writer. Nothing is shared between the shards, so the output thread of a
+// single log is no longer a bottleneck, at the price of one output file per
+// shard. The files can be put back together by time with merge_log_shards()
+// or the reckless_merge tool.
+//
+// A thread is given a shard when it first writes to the log, taking turns
+// between the shards (or those on its NUMA node, see set_numa_sharding),
+// unless it has called set_thread_shard(). Each shard counts towards the
+// limit of max_log_instances logs.
+template <class Log>
+class sharded_log {
+public:
+    // Creates shard_count closed shards. They can be configured through
+    // shard(index) before the log is opened. Throws std::invalid_argument
+    // if shard_count is 0 or more than detail::max_log_shards (255).
+    explicit sharded_log(std::size_t shard_count) :
+        id_(detail::acquire_sharded_log_id(shard_count)),
+        generation_(detail::sharded_log_generation(id_)),
+        next_shard_(0),
+        numa_sharding_(false)
+    {
+        try {
+            for(std::size_t i=0; i!=shard_count; ++i)
+                shards_.emplace_back(new Log());
+        } catch(...) {
+            shards_.clear();
+            detail::release_sharded_log_id(id_);
+            throw;
+        }
+    }
+
+    // Creates and opens one shard for each writer.
+    sharded_log(std::vector<writer*> const& writers,
+            std::size_t output_buffer_max_capacity = 0,
+            std::size_t shared_input_queue_size = 0,
+            std::size_t thread_input_buffer_size = 0) :
+        sharded_log(writers.size())
+    {
+        open(writers, output_buffer_max_capacity, shared_input_queue_size,
+                thread_input_buffer_size);
+    }
+
+    ~sharded_log()
+    {
+        // The shards close themselves.
+        shards_.clear();
+        detail::release_sharded_log_id(id_);
+    }
+
+    sharded_log(sharded_log const&) = delete;
+    sharded_log& operator=(sharded_log const&) = delete;
+
+    // Opens shard i with writers[i]. There must be one writer per shard. If
+    // a shard fails to open then the ones before it are closed again.
+    void open(std::vector<writer*> const& writers,
+            std::size_t output_buffer_max_capacity = 0,
+            std::size_t shared_input_queue_size = 0,
+            std::size_t thread_input_buffer_size = 0)
+    {
+        assert(writers.size() == shards_.size());
+        std::size_t i = 0;
+        try {
+            for(; i!=shards_.size(); ++i) {
+                shards_[i]->open(writers[i], output_buffer_max_capacity,
+                        shared_input_queue_size, thread_input_buffer_size);
+            }
+        } catch(...) {
+            while(i != 0)
+                shards_[--i]->close();
+            throw;
+        }
+    }
+
+    void close()
+    {
+        for(auto& pshard : shards_)
+            pshard->close();
+    }
+
+    std::size_t shard_count() const
+    {
+        return shards_.size();
+    }
+
+    // Gives each NUMA node a share of the shards, taking turns between the
+    // nodes: shard i belongs to node i % numa_node_count(). The output
+    // thread of a shard is kept on the CPUs of its node, input buffers are
+    // placed on the node of the thread that creates them (see
+    // basic_log::set_numa_local_input_buffers), and threads are given a
+    // shard on the node that they are running on when they first write to
+    // the log. Log entries then stay within one node all the way to the
+    // writer. This can only be done while the log is closed.
+    void set_numa_sharding(bool enable)
+    {
+        unsigned node_count = detail::numa_node_count();
+        for(std::size_t i=0; i!=shards_.size(); ++i) {
+            std::vector<unsigned> cpus;
+            if(enable)
+                cpus = detail::numa_node_cpus(i % node_count);
+            shards_[i]->set_output_thread_affinity(cpus);
+            shards_[i]->set_numa_local_input_buffers(enable);
+        }
+        numa_sharding_ = enable;
+    }
+
+    Log& shard(std::size_t index)
+    {
+        return *shards_[index];
+    }
+
+    // The shard that the calling thread writes to.
+    Log& shard()
+    {
+        unsigned& assigned = detail::thread_log_shards[id_];
+        if(detail::unlikely((assigned >> 8) != generation_)) {
+            std::size_t index = numa_sharding_? next_numa_shard()
+                : next_shard_.fetch_add(1, std::memory_order_relaxed)
+                    % shards_.size();
+            assigned = assigned_shard(index);
+        }
+        return *shards_[(assigned & 0xff) - 1];
+    }
+
+    // Makes the calling thread write to the given shard from now on. Lines
+    // that it has written to another shard before may come after the new
+    // ones when the shards are merged, if they have the same timestamp.
+    void set_thread_shard(std::size_t index)
+    {
+        assert(index < shards_.size());
+        detail::thread_log_shards[id_] = assigned_shard(index);
+    }
+
+    // Writes to the calling thread's shard, for logs that have a write
+    // function (such as policy_log).
+    template <typename... Args>
+    void write(Args&&... args)
+    {
+        shard().write(std::forward<Args>(args)...);
+    }
+
+private:
+    // The value of thread_log_shards for the given shard of this log.
+    unsigned assigned_shard(std::size_t index) const
+    {
+        return (generation_ << 8) | static_cast<unsigned>(index + 1);
+    }
+
+    // Takes turns between the shards on the calling thread's node. With
+    // fewer shards than nodes, some nodes have to share.
+    std::size_t next_numa_shard()
+    {
+        std::size_t node_count = detail::numa_node_count();
+        std::size_t node = detail::current_numa_node();
+        std::size_t turn = next_shard_.fetch_add(1,
+                std::memory_order_relaxed);
+        if(node >= shards_.size())
+            return node % shards_.size();
+        std::size_t node_shards = (shards_.size() - node + node_count - 1)
+            / node_count;
+        return node + (turn % node_shards)*node_count;
+    }
+
+    std::size_t id_;
+    unsigned generation_;
+    std::vector<std::unique_ptr<Log>> shards_;
+    std::atomic<std::size_t> next_shard_;
+    bool numa_sharding_;
+
+    friend class sharded_log_suite;
+};
+
+// Merges text logs written by the shards of a sharded_log into one, in the
+// order of the timestamps that timestamp_field puts at the start of each line
+// (after any other header fields). A line without a timestamp, such as the
+// continuation of a message that contains a newline, stays with the line
+// before it. Lines with the same timestamp are taken from the shards in the
+// order they are given.
+void merge_log_shards(
+        std::vector<std::pair<char const*, std::size_t>> const& shards,
+        writer* pwriter);
+
+}   // namespace reckless
+
+#endif  // RECKLESS_SHARDED_LOG_HPP
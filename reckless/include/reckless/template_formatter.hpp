@@ -1,9 +1,12 @@
 #ifndef RECKLESS_TEMPLATE_FORMATTER_HPP
 #define RECKLESS_TEMPLATE_FORMATTER_HPP
 
+#include "reckless/compiled_format.hpp"
+#include "reckless/inline_string.hpp"
+
 #include <utility>    // forward
 #include <string>
-#include <type_traits>  // is_convertible
+#include <type_traits>  // is_convertible, enable_if
 
 namespace reckless {
 
@@ -22,17 +25,42 @@ public:
     static void format(output_buffer* pbuffer, char const* pformat,
             T&& value, Args&&... args)
     {
-        pformat = next_specifier(pbuffer, pformat);
+        pformat = format_argument(pbuffer, pformat, std::forward<T>(value));
         if(not pformat)
             return;
+        return template_formatter::format(pbuffer, pformat,
+                std::forward<Args>(args)...);
+    }
+
+    // Writes the text up to the next conversion specification in pformat
+    // and converts value according to it. Returns the remainder of the
+    // format string, or nullptr if there was no conversion specification
+    // left. This is for callers that only know the argument types at run
+    // time; they should finish with format(pbuffer, pformat) to write any
+    // trailing text.
+    template <typename T>
+    static char const* format_argument(output_buffer* pbuffer,
+            char const* pformat, T&& value)
+    {
+        pformat = next_specifier(pbuffer, pformat);
+        if(not pformat)
+            return nullptr;
 
         char const* pnext_format = detail::invoke_custom_format(pbuffer,
                 pformat, std::forward<T>(value));
         if(pnext_format)
-            pformat = pnext_format;
-        else
-            append_percent(pbuffer);
-        return template_formatter::format(pbuffer, pformat,
+            return pnext_format;
+        append_percent(pbuffer);
+        return pformat;
+    }
+
+    // Format using a format string that was parsed at compile time, see
+    // RECKLESS_FORMAT.
+    template <class Format, typename... Args>
+    static typename std::enable_if<is_compiled_format<Format>::value>::type
+    format(output_buffer* pbuffer, Format const&, Args&&... args)
+    {
+        detail::run_format_program<Format>(pbuffer,
                 std::forward<Args>(args)...);
     }
 
@@ -64,6 +92,8 @@ char const* format(output_buffer* pbuffer, char const* pformat, long double v);
 
 char const* format(output_buffer* pbuffer, char const* pformat, char const* v);
 char const* format(output_buffer* pbuffer, char const* pformat, std::string const& v);
+char const* format(output_buffer* pbuffer, char const* pformat, inline_string const& v);
+char const* format(output_buffer* pbuffer, char const* pformat, inline_c_string const& v);
 
 char const* format(output_buffer* pbuffer, char const* pformat, void const* p);
 
@@ -1,41 +1,203 @@
 #include <reckless/basic_log.hpp>
+#include <reckless/detail/formatter_pool.hpp>
+#include <reckless/detail/utility.hpp>  // cpu_relax
 
 #include <vector>
+#include <mutex>
+#include <algorithm>    // find, min, make_heap
+#include <cassert>
+#include <cstdint>      // uint64_t
+#include <cstring>      // memcpy
 #include <ciso646>
 
-#include <unistd.h>     // sleep
+#include <system_error>
+#include <stdexcept>    // logic_error
+#include <cerrno>
+
+#include <pthread.h>
+#include <sched.h>      // sched_param, cpu_set_t
+#include <time.h>       // clock_gettime
+#include <unistd.h>     // sleep, syscall
+#include <sys/resource.h>   // setpriority
+#include <sys/syscall.h>    // SYS_gettid
+
+__thread reckless::detail::thread_input_buffer*
+    reckless::detail::thread_input_buffers[max_log_instances];
+__thread unsigned
+    reckless::detail::thread_input_buffer_generations[max_log_instances];
 
 namespace {
-void destroy_thread_input_buffer(void* p)
+using reckless::detail::max_log_instances;
+
+// With auto-sizing, a thread's input buffer is doubled after this many
+// allocations have had to wait for the output thread.
+std::size_t const STALLS_BEFORE_AUTO_SIZE = 8;
+
+// What a thread needs to know about a log instance when it exits: the event
+// that wakes up the output thread, where to hand over the thread's input
+// buffer, and the generation of the log that has the id (which is
+// incremented each time the id is taken).
+struct instance_slot {
+    spsc_event* pdoorbell;
+    std::atomic<reckless::detail::thread_input_buffer*>* pretired_buffers;
+    unsigned generation;
+};
+
+// The instance ids in use. An id is free if its doorbell is nullptr.
+std::mutex g_instance_ids_mutex;
+instance_slot g_instances[max_log_instances];
+
+// A single key for the whole process, shared by all log instances. Its only
+// purpose is to get a callback on thread exit so that we can destroy the
+// thread's input buffers; the value is always the thread's buffer table.
+pthread_once_t g_thread_exit_key_once = PTHREAD_ONCE_INIT;
+pthread_key_t g_thread_exit_key;
+int g_thread_exit_key_result;
+
+void destroy_thread_input_buffers(void*)
 {
     using reckless::detail::thread_input_buffer;
-    thread_input_buffer* pbuffer = static_cast<thread_input_buffer*>(p);
-    thread_input_buffer::destroy(pbuffer);
+    using reckless::detail::thread_input_buffers;
+    using reckless::detail::thread_input_buffer_generations;
+    for(std::size_t i=0; i!=max_log_instances; ++i) {
+        thread_input_buffer* pbuffer = thread_input_buffers[i];
+        if(not pbuffer)
+            continue;
+        thread_input_buffers[i] = nullptr;
+        // The output thread may not be done with the buffer yet. Rather
+        // than wait for it, we leave the buffer for it to destroy. If the
+        // log that the buffer belongs to is gone, or on its way out, then
+        // it destroys the buffer itself (see ~basic_log) and we must not
+        // touch it.
+        std::lock_guard<std::mutex> lk(g_instance_ids_mutex);
+        instance_slot const& slot = g_instances[i];
+        if(not slot.pdoorbell
+                or slot.generation != thread_input_buffer_generations[i])
+        {
+            continue;
+        }
+        pbuffer->retire();
+        auto& head = *slot.pretired_buffers;
+        pbuffer->pnext_retired = head.load(std::memory_order_relaxed);
+        while(not head.compare_exchange_weak(pbuffer->pnext_retired,
+                    pbuffer, std::memory_order_release,
+                    std::memory_order_relaxed))
+        {
+        }
+        slot.pdoorbell->signal();
+    }
+}
+
+void create_thread_exit_key()
+{
+    g_thread_exit_key_result = pthread_key_create(&g_thread_exit_key,
+            &destroy_thread_input_buffers);
+}
+
+std::size_t acquire_instance_id(spsc_event* pdoorbell,
+        std::atomic<reckless::detail::thread_input_buffer*>* pretired_buffers)
+{
+    pthread_once(&g_thread_exit_key_once, &create_thread_exit_key);
+    if(0 != g_thread_exit_key_result)
+        throw std::bad_alloc();
+
+    std::lock_guard<std::mutex> lk(g_instance_ids_mutex);
+    for(std::size_t id=0; id!=max_log_instances; ++id) {
+        instance_slot& slot = g_instances[id];
+        if(not slot.pdoorbell) {
+            slot.pdoorbell = pdoorbell;
+            slot.pretired_buffers = pretired_buffers;
+            // Threads start out with generation 0 in every slot, so that is
+            // skipped when the counter wraps around.
+            if(++slot.generation == 0)
+                slot.generation = 1;
+            return id;
+        }
+    }
+    throw std::bad_alloc();
 }
+
+unsigned instance_generation(std::size_t id)
+{
+    std::lock_guard<std::mutex> lk(g_instance_ids_mutex);
+    return g_instances[id].generation;
 }
 
-// FIXME we need to destroy the pthreads key in dtor
+void release_instance_id(std::size_t id)
+{
+    std::lock_guard<std::mutex> lk(g_instance_ids_mutex);
+    g_instances[id].pdoorbell = nullptr;
+    g_instances[id].pretired_buffers = nullptr;
+}
+}
 
 reckless::basic_log::basic_log() :
-    shared_input_queue_(0),
+    retired_input_buffers_(nullptr),
+    instance_id_(acquire_instance_id(&shared_input_queue_full_event_,
+                &retired_input_buffers_)),
+    instance_generation_(instance_generation(instance_id_)),
     thread_input_buffer_size_(0),
+    commit_mode_(commit_mode::shared_queue),
+    merge_window_us_(1000),
+    formatter_threads_(0),
+    cooperative_helpers_(0),
+    output_thread_formatting_only_(false),
+    output_thread_idle_(false),
+    wakeup_policy_(wakeup_policy::timed_wait),
+    spin_budget_(10000),
+    max_idle_wait_ms_(1000),
+    overflow_policy_(overflow_policy::block),
+    input_buffer_growth_limit_(0),
+    input_buffer_auto_size_limit_(0),
+    mirrored_input_buffers_(false),
+    numa_local_input_buffers_(false),
+    pmemory_provider_(nullptr),
+    pformat_dropped_messages_(nullptr),
+    total_dropped_messages_(0),
+    orphaned_dropped_messages_(0),
+    numa_node_count_(0),
     panic_flush_(false)
 {
-    if(0 != pthread_key_create(&thread_input_buffer_key_, &destroy_thread_input_buffer))
-        throw std::bad_alloc();
 }
 
 reckless::basic_log::basic_log(writer* pwriter, 
         std::size_t output_buffer_max_capacity,
         std::size_t shared_input_queue_size,
         std::size_t thread_input_buffer_size) :
-    shared_input_queue_(0),
+    retired_input_buffers_(nullptr),
+    instance_id_(acquire_instance_id(&shared_input_queue_full_event_,
+                &retired_input_buffers_)),
+    instance_generation_(instance_generation(instance_id_)),
     thread_input_buffer_size_(0),
+    commit_mode_(commit_mode::shared_queue),
+    merge_window_us_(1000),
+    formatter_threads_(0),
+    cooperative_helpers_(0),
+    output_thread_formatting_only_(false),
+    output_thread_idle_(false),
+    wakeup_policy_(wakeup_policy::timed_wait),
+    spin_budget_(10000),
+    max_idle_wait_ms_(1000),
+    overflow_policy_(overflow_policy::block),
+    input_buffer_growth_limit_(0),
+    input_buffer_auto_size_limit_(0),
+    mirrored_input_buffers_(false),
+    numa_local_input_buffers_(false),
+    pmemory_provider_(nullptr),
+    pformat_dropped_messages_(nullptr),
+    total_dropped_messages_(0),
+    orphaned_dropped_messages_(0),
+    numa_node_count_(0),
     panic_flush_(false)
 {
-    if(0 != pthread_key_create(&thread_input_buffer_key_, &destroy_thread_input_buffer))
-        throw std::bad_alloc();
-    open(pwriter, output_buffer_max_capacity, shared_input_queue_size, thread_input_buffer_size);
+    try {
+        open(pwriter, output_buffer_max_capacity, shared_input_queue_size, thread_input_buffer_size);
+    } catch(...) {
+        release_instance_id(instance_id_);
+        collect_retired_input_buffers(nullptr);
+        input_buffer_pool_.destroy_all();
+        throw;
+    }
 }
 
 reckless::basic_log::~basic_log()
@@ -44,6 +206,14 @@ reckless::basic_log::~basic_log()
         return;
     if(is_open())
         close();
+    // Other threads may still have input buffers in the slot for this
+    // instance. Those are empty since close() drains them. Once the id is
+    // released, no more buffers are handed over to us, and exiting threads
+    // leave theirs alone, so we can destroy them all. The generation of the
+    // next log with the id won't match, so threads don't touch them either.
+    release_instance_id(instance_id_);
+    collect_retired_input_buffers(nullptr);
+    input_buffer_pool_.destroy_all();
 }
 
 void reckless::basic_log::open(writer* pwriter, 
@@ -70,10 +240,35 @@ void reckless::basic_log::open(writer* pwriter,
         if(thread_input_buffer_size == 0)
             thread_input_buffer_size = ASSUMED_DISK_SECTOR_SIZE;
     }
-    reset_shared_input_queue(shared_input_queue_size);
+    memory_provider* pprovider = pmemory_provider_.load(
+            std::memory_order_relaxed);
+    shared_input_queue_.reset(shared_input_queue_size, pprovider);
     thread_input_buffer_size_ = thread_input_buffer_size;
-    output_buffer_ = output_buffer(pwriter, output_buffer_max_capacity);
-    output_thread_ = std::thread(std::mem_fn(&basic_log::output_worker), this);
+    input_buffer_growth_limit_.store(8*thread_input_buffer_size,
+            std::memory_order_relaxed);
+    output_buffer_ = output_buffer(pwriter, output_buffer_max_capacity,
+            pprovider);
+    if(not numa_counters_) {
+        numa_node_count_ = detail::numa_node_count();
+        numa_counters_.reset(new detail::numa_node_counters[numa_node_count_]);
+    }
+    output_thread_idle_.store(false, std::memory_order_relaxed);
+    void (basic_log::*worker)();
+    if(polls_input_buffers())
+        worker = &basic_log::poll_worker;
+    else if(formatter_threads_ != 0 or cooperative_helpers_ != 0)
+        worker = &basic_log::parallel_output_worker;
+    else
+        worker = &basic_log::output_worker;
+    std::exception_ptr startup_error;
+    output_thread_ = std::thread(std::mem_fn(&basic_log::run_output_thread),
+            this, worker, output_buffer_max_capacity, &startup_error);
+    output_thread_started_event_.wait();
+    if(startup_error) {
+        output_thread_.join();
+        formatter_pool_.reset();
+        std::rethrow_exception(startup_error);
+    }
 }
 
 void reckless::basic_log::close()
@@ -84,7 +279,12 @@ void reckless::basic_log::close()
     // second before the thread exits.
     queue_commit_extent({nullptr, nullptr});
     output_thread_.join();
+    formatter_pool_.reset();
     assert(shared_input_queue_.empty());
+    // Everything has been written, so the buffers of threads that have
+    // exited can go. Buffers that are handed over after this are destroyed
+    // by the next output thread, or by the destructor.
+    collect_retired_input_buffers(nullptr);
     // FIXME reverse everything that open() does, including getting rid of the
     // buffers etc.
 }
@@ -96,6 +296,462 @@ void reckless::basic_log::panic_flush()
     panic_flush_done_event_.wait();
 }
 
+void reckless::basic_log::set_commit_mode(commit_mode mode)
+{
+    assert(not is_open());
+    commit_mode_ = mode;
+}
+
+void reckless::basic_log::set_merge_window(unsigned microseconds)
+{
+    merge_window_us_.store(microseconds, std::memory_order_relaxed);
+}
+
+void reckless::basic_log::set_formatter_threads(unsigned count)
+{
+    assert(not is_open());
+    if(count != 0 and output_thread_formatting_only_) {
+        throw std::logic_error("the formatter of this log must run on the "
+                "output thread");
+    }
+    formatter_threads_ = count;
+}
+
+void reckless::basic_log::set_cooperative_draining(unsigned max_helpers)
+{
+    assert(not is_open());
+    if(max_helpers != 0 and output_thread_formatting_only_) {
+        throw std::logic_error("the formatter of this log must run on the "
+                "output thread");
+    }
+    cooperative_helpers_ = max_helpers;
+}
+
+void reckless::basic_log::set_wakeup_policy(wakeup_policy policy)
+{
+    wakeup_policy_.store(policy, std::memory_order_relaxed);
+}
+
+void reckless::basic_log::set_spin_budget(unsigned checks)
+{
+    spin_budget_.store(checks, std::memory_order_relaxed);
+}
+
+void reckless::basic_log::set_max_idle_wait(unsigned milliseconds)
+{
+    max_idle_wait_ms_.store(milliseconds, std::memory_order_relaxed);
+}
+
+void reckless::basic_log::set_output_thread_affinity(
+        std::vector<unsigned> const& cpus)
+{
+    assert(not is_open());
+    output_thread_settings_.cpus = cpus;
+}
+
+void reckless::basic_log::set_output_thread_scheduling(int policy,
+        int priority)
+{
+    assert(not is_open());
+    output_thread_settings_.set_scheduling = true;
+    output_thread_settings_.scheduling_policy = policy;
+    output_thread_settings_.scheduling_priority = priority;
+}
+
+void reckless::basic_log::set_output_thread_nice(int nice)
+{
+    assert(not is_open());
+    output_thread_settings_.set_nice = true;
+    output_thread_settings_.nice = nice;
+}
+
+void reckless::basic_log::set_output_thread_name(std::string const& name)
+{
+    assert(not is_open());
+    output_thread_settings_.name = name;
+}
+
+void reckless::basic_log::set_output_thread_start_hook(
+        std::function<void()> hook)
+{
+    assert(not is_open());
+    output_thread_settings_.start_hook = std::move(hook);
+}
+
+void reckless::basic_log::set_overflow_policy(overflow_policy policy)
+{
+    overflow_policy_.store(policy, std::memory_order_relaxed);
+}
+
+void reckless::basic_log::set_thread_overflow_policy(overflow_policy policy)
+{
+    // A pending resize (see set_thread_input_buffer_size) is left for the
+    // next write, which carries the policy over to the new buffer.
+    auto pbuffer = current_input_buffer();
+    if(not pbuffer)
+        pbuffer = replace_input_buffer(nullptr, thread_input_buffer_size_);
+    pbuffer->thread_overflow_policy = policy;
+    pbuffer->has_overflow_policy = true;
+}
+
+void reckless::basic_log::set_input_buffer_growth_limit(std::size_t bytes)
+{
+    input_buffer_growth_limit_.store(bytes, std::memory_order_relaxed);
+}
+
+void reckless::basic_log::set_thread_input_buffer_size(std::size_t size)
+{
+    auto p = current_input_buffer();
+    if(not p) {
+        replace_input_buffer(nullptr, size);
+    } else if(p->capacity() == size) {
+        p->requested_capacity = 0;
+    } else {
+        p->requested_capacity = size;
+        get_input_buffer();
+    }
+}
+
+void reckless::basic_log::set_mirrored_input_buffers(bool enable)
+{
+    mirrored_input_buffers_.store(enable, std::memory_order_relaxed);
+}
+
+void reckless::basic_log::set_input_buffer_auto_sizing(std::size_t max_size)
+{
+    input_buffer_auto_size_limit_.store(max_size, std::memory_order_relaxed);
+}
+
+void reckless::basic_log::set_numa_local_input_buffers(bool enable)
+{
+    numa_local_input_buffers_.store(enable, std::memory_order_relaxed);
+}
+
+void reckless::basic_log::set_input_buffer_pool(std::size_t max_buffers,
+        unsigned idle_release_ms)
+{
+    input_buffer_pool_.set_limits(max_buffers, idle_release_ms);
+}
+
+void reckless::basic_log::set_input_buffer_memory_budget(std::size_t bytes)
+{
+    input_buffer_pool_.set_memory_budget(bytes);
+}
+
+void reckless::basic_log::set_memory_provider(memory_provider* pprovider)
+{
+    assert(not is_open());
+    pmemory_provider_.store(pprovider, std::memory_order_relaxed);
+}
+
+void reckless::basic_log::warm_up()
+{
+    get_input_buffer()->prefault_ring();
+}
+
+reckless::input_buffer_pool_statistics
+reckless::basic_log::input_buffer_statistics()
+{
+    return input_buffer_pool_.statistics();
+}
+
+std::vector<reckless::numa_node_statistics>
+reckless::basic_log::numa_statistics() const
+{
+    std::vector<numa_node_statistics> statistics(numa_node_count_);
+    for(std::size_t node=0; node!=numa_node_count_; ++node) {
+        statistics[node].input_bytes = numa_counters_[node].input_bytes.load(
+                std::memory_order_relaxed);
+        statistics[node].remote_input_bytes =
+            numa_counters_[node].remote_input_bytes.load(
+                    std::memory_order_relaxed);
+    }
+    return statistics;
+}
+
+std::size_t reckless::basic_log::dropped_messages()
+{
+    auto pbuffer = current_input_buffer();
+    return pbuffer? pbuffer->dropped_messages : 0;
+}
+
+std::uint64_t reckless::basic_log::total_dropped_messages() const
+{
+    return total_dropped_messages_.load(std::memory_order_relaxed);
+}
+
+namespace {
+std::uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return static_cast<std::uint64_t>(ts.tv_sec)*1000000000u
+        + static_cast<std::uint64_t>(ts.tv_nsec);
+}
+
+// Tells the output thread how far it may go with commit_mode::merged_buffers:
+// frames stamped after the returned horizon are less than the merge window
+// old. The frequency of the time stamp counter is measured against the
+// monotonic clock during the first second, and until that has been going on
+// for a while there is no window at all.
+class merge_clock {
+public:
+    explicit merge_clock(unsigned window_us) :
+        window_ns_(1000u*static_cast<std::uint64_t>(window_us)),
+        window_ticks_(0),
+        start_ns_(now_ns()),
+        start_stamp_(reckless::detail::read_frame_stamp_counter()),
+        calibrated_(window_us == 0)
+    {
+    }
+
+    std::uint64_t horizon()
+    {
+        std::uint64_t stamp = reckless::detail::read_frame_stamp_counter();
+        if(reckless::detail::unlikely(not calibrated_))
+            calibrate(stamp);
+        return stamp - std::min(stamp, window_ticks_);
+    }
+
+private:
+    void calibrate(std::uint64_t stamp)
+    {
+        std::uint64_t elapsed_ns = now_ns() - start_ns_;
+        if(elapsed_ns < 100000)
+            return;
+        double ticks_per_ns = static_cast<double>(stamp - start_stamp_)
+            / static_cast<double>(elapsed_ns);
+        window_ticks_ = static_cast<std::uint64_t>(ticks_per_ns
+                * static_cast<double>(window_ns_));
+        calibrated_ = elapsed_ns >= 1000000000u;
+    }
+
+    std::uint64_t const window_ns_;
+    std::uint64_t window_ticks_;
+    std::uint64_t const start_ns_;
+    std::uint64_t const start_stamp_;
+    bool calibrated_;
+};
+
+// Merges the frames of all polled input buffers in stamp order for
+// commit_mode::merged_buffers. Only the first waiting frame of each buffer is
+// compared, so frames from the same thread always keep their order.
+class input_merger {
+public:
+    // Makes sure that merge() doesn't allocate memory for up to count
+    // buffers.
+    void reserve(std::size_t count)
+    {
+        sources_.reserve(count);
+    }
+
+    // Formats the published frames of the buffers that are stamped no later
+    // than horizon. Returns true if it formatted anything, and sets *pheld if
+    // there are frames left that are stamped later.
+    bool merge(reckless::output_buffer* poutput,
+            std::vector<reckless::detail::thread_input_buffer*> const& buffers,
+            std::uint64_t horizon,
+            std::vector<reckless::detail::thread_input_buffer*>* ptouched_input_buffers,
+            reckless::detail::numa_input_counter* pnuma_counter,
+            bool* pheld)
+    {
+        using namespace reckless::detail;
+        sources_.clear();
+        for(thread_input_buffer* pbuffer : buffers) {
+            char* pinput_end = pbuffer->published_input_end();
+            if(pinput_end != pbuffer->input_start())
+                sources_.push_back({next_stamp(pbuffer), pbuffer, pinput_end});
+        }
+        std::make_heap(sources_.begin(), sources_.end(), later_stamp);
+
+        bool consumed = false;
+        while(not sources_.empty()) {
+            if(sources_.front().stamp > horizon) {
+                *pheld = true;
+                break;
+            }
+            std::pop_heap(sources_.begin(), sources_.end(), later_stamp);
+            source& s = sources_.back();
+            char* pframe = s.pbuffer->input_start() + sizeof(std::uint64_t);
+            auto pdispatch = *reinterpret_cast<formatter_dispatch_function_t**>(pframe);
+            auto frame_size = (*pdispatch)(poutput, pframe);
+            char* pnext = s.pbuffer->discard_input_frame(
+                    sizeof(std::uint64_t) + frame_size);
+            mark_input_consumed(s.pbuffer, ptouched_input_buffers);
+            pnuma_counter->count(s.pbuffer->numa_node,
+                    sizeof(std::uint64_t) + frame_size);
+            consumed = true;
+            if(pnext == s.pinput_end) {
+                sources_.pop_back();
+            } else {
+                s.stamp = next_stamp(s.pbuffer);
+                std::push_heap(sources_.begin(), sources_.end(), later_stamp);
+            }
+        }
+        return consumed;
+    }
+
+private:
+    struct source {
+        std::uint64_t stamp;
+        reckless::detail::thread_input_buffer* pbuffer;
+        char* pinput_end;
+    };
+
+    static bool later_stamp(source const& a, source const& b)
+    {
+        return a.stamp > b.stamp;
+    }
+
+    // Moves past any marker at the start of the buffer's input, and returns
+    // the stamp of the frame there.
+    static std::uint64_t next_stamp(
+            reckless::detail::thread_input_buffer* pbuffer)
+    {
+        using namespace reckless::detail;
+        char* pinput_start = pbuffer->input_start();
+        auto pdispatch = *reinterpret_cast<formatter_dispatch_function_t**>(pinput_start);
+        if(unlikely(is_marker(pdispatch))) {
+            if(WRAPAROUND_MARKER == pdispatch)
+                pinput_start = pbuffer->wraparound();
+            else
+                pinput_start = pbuffer->next_segment();
+        }
+        std::uint64_t stamp;
+        std::memcpy(&stamp, pinput_start, sizeof(stamp));
+        return stamp;
+    }
+
+    std::vector<source> sources_;
+};
+
+// Removes pbuffer from the output thread's lists, and (as the very last
+// access to it) tells the thread that owns it that it is no longer polled.
+void release_polled_buffer(
+        reckless::detail::thread_input_buffer* pbuffer,
+        std::vector<reckless::detail::thread_input_buffer*>& polled_input_buffers,
+        std::vector<reckless::detail::thread_input_buffer*>& touched_input_buffers)
+{
+    auto it = std::find(polled_input_buffers.begin(),
+            polled_input_buffers.end(), pbuffer);
+    if(it != polled_input_buffers.end()) {
+        *it = polled_input_buffers.back();
+        polled_input_buffers.pop_back();
+    }
+    it = std::find(touched_input_buffers.begin(), touched_input_buffers.end(),
+            pbuffer);
+    if(it != touched_input_buffers.end()) {
+        pbuffer->input_consumed_flag = false;
+        touched_input_buffers.erase(it);
+    }
+    pbuffer->polled_flag.store(false, std::memory_order_release);
+}
+
+void throw_system_error(int error)
+{
+    throw std::system_error(error, std::system_category());
+}
+
+// Paces an idle output thread's checks for new input according to the
+// wakeup policy. One is made for each stretch of idle time, and wait() is
+// called between checks.
+class idle_waiter {
+public:
+    idle_waiter(spsc_event* pevent, reckless::wakeup_policy policy,
+            unsigned spin_budget, unsigned max_wait_ms) :
+        pevent_(pevent),
+        policy_(policy),
+        spins_left_(policy == reckless::wakeup_policy::spin_then_wait?
+                spin_budget : 0),
+        max_wait_ms_(max_wait_ms),
+        wait_time_ms_(0)
+    {
+    }
+
+    void wait()
+    {
+        if(policy_ == reckless::wakeup_policy::busy_poll or spins_left_ != 0) {
+            if(spins_left_ != 0)
+                --spins_left_;
+            reckless::detail::cpu_relax();
+            return;
+        }
+        pevent_->wait(wait_time_ms_);
+        wait_time_ms_ += std::max(1u, wait_time_ms_/4);
+        wait_time_ms_ = std::min(wait_time_ms_, max_wait_ms_);
+    }
+
+private:
+    spsc_event* pevent_;
+    reckless::wakeup_policy policy_;
+    unsigned spins_left_;
+    unsigned max_wait_ms_;
+    unsigned wait_time_ms_;
+};
+}
+
+void reckless::basic_log::apply_output_thread_settings()
+{
+    output_thread_settings const& settings = output_thread_settings_;
+    if(not settings.cpus.empty()) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for(unsigned cpu : settings.cpus) {
+            if(cpu >= CPU_SETSIZE)
+                throw_system_error(EINVAL);
+            CPU_SET(cpu, &cpus);
+        }
+        int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus),
+                &cpus);
+        if(error != 0)
+            throw_system_error(error);
+    }
+    if(settings.set_scheduling) {
+        sched_param param = sched_param();
+        param.sched_priority = settings.scheduling_priority;
+        int error = pthread_setschedparam(pthread_self(),
+                settings.scheduling_policy, &param);
+        if(error != 0)
+            throw_system_error(error);
+    }
+    if(settings.set_nice) {
+        // On Linux the nice value belongs to the thread, not the process.
+        auto tid = static_cast<id_t>(syscall(SYS_gettid));
+        if(0 != setpriority(PRIO_PROCESS, tid, settings.nice))
+            throw_system_error(errno);
+    }
+    if(not settings.name.empty()) {
+        int error = pthread_setname_np(pthread_self(),
+                settings.name.substr(0, 15).c_str());
+        if(error != 0)
+            throw_system_error(error);
+    }
+}
+
+void reckless::basic_log::run_output_thread(void (basic_log::*worker)(),
+        std::size_t output_buffer_max_capacity,
+        std::exception_ptr* pstartup_error)
+{
+    try {
+        apply_output_thread_settings();
+        // Started from here, the formatter threads inherit the settings.
+        if(worker == &basic_log::parallel_output_worker) {
+            formatter_pool_.reset(new detail::formatter_pool(
+                        formatter_threads_, cooperative_helpers_,
+                        output_buffer_max_capacity, numa_counters_.get(),
+                        pmemory_provider_.load(std::memory_order_relaxed)));
+        }
+        if(output_thread_settings_.start_hook)
+            output_thread_settings_.start_hook();
+    } catch(...) {
+        *pstartup_error = std::current_exception();
+        output_thread_started_event_.signal();
+        return;
+    }
+    output_thread_started_event_.signal();
+    (this->*worker)();
+}
+
 void reckless::basic_log::output_worker()
 {
     // TODO if possible we should call signal_input_consumed() whenever the
@@ -104,10 +760,24 @@ void reckless::basic_log::output_worker()
     using namespace detail;
     std::vector<thread_input_buffer*> touched_input_buffers;
     touched_input_buffers.reserve(std::max(8u, 2*std::thread::hardware_concurrency()));
+    // Commit extents are taken off the queue in batches, which frees up
+    // their slots for the producers right away.
+    commit_extent batch[32];
+    std::size_t const max_batch_size = sizeof(batch)/sizeof(batch[0]);
+    std::size_t batch_size = 0;
+    std::size_t batch_index = 0;
+    numa_input_counter numa_counter(numa_counters_.get());
     while(true) {
-        commit_extent ce;
-        unsigned wait_time_ms = 0;
-        if(not shared_input_queue_.pop(ce)) {
+        if(batch_index == batch_size) {
+            batch_index = 0;
+            batch_size = shared_input_queue_.pop(batch, max_batch_size);
+            numa_counter.update_node();
+            if(likely(!panic_flush_)) {
+                collect_retired_input_buffers(&touched_input_buffers);
+                write_orphaned_drop_notice(false);
+            }
+        }
+        if(batch_size == 0) {
             if(unlikely(panic_flush_)) {
                 on_panic_flush_done();
             } else {
@@ -117,41 +787,345 @@ void reckless::basic_log::output_worker()
                 for(thread_input_buffer* pbuffer : touched_input_buffers)
                     pbuffer->input_consumed_flag = false;
                 touched_input_buffers.clear();
+                write_orphaned_drop_notice(true);
                 if(not output_buffer_.empty())
                     output_buffer_.flush();
-                while(not shared_input_queue_.pop(ce)) {
-                    shared_input_queue_full_event_.wait(wait_time_ms);
-                    wait_time_ms += std::max(1u, wait_time_ms/4);
-                    wait_time_ms = std::min(wait_time_ms, 1000u);
+                idle_waiter waiter(&shared_input_queue_full_event_,
+                        wakeup_policy_.load(std::memory_order_relaxed),
+                        spin_budget_.load(std::memory_order_relaxed),
+                        max_idle_wait_ms_.load(std::memory_order_relaxed));
+                while(0 == (batch_size = shared_input_queue_.pop(batch,
+                                max_batch_size)))
+                {
+                    // A thread that exits rings the doorbell when it hands
+                    // over its buffer, which may well be drained already.
+                    collect_retired_input_buffers(nullptr);
+                    if(write_orphaned_drop_notice(false))
+                        output_buffer_.flush();
+                    input_buffer_pool_.release_idle_memory();
+                    waiter.wait();
                 }
+                numa_counter.update_node();
             }
         }
-            
+        commit_extent ce = batch[batch_index++];
+
         if(not ce.pinput_buffer) {
             if(unlikely(panic_flush_))
                 on_panic_flush_done();
+            write_orphaned_drop_notice(true);
             output_buffer_.flush();
+            // The input buffers outlive the output thread if the log is
+            // reopened (or its instance id is reused), so they must not be
+            // left marked as touched.
+            for(thread_input_buffer* pinput_buffer : touched_input_buffers) {
+                pinput_buffer->input_consumed_flag = false;
+                pinput_buffer->signal_input_consumed();
+            }
             return;
         }
 
-        char* pinput_start = ce.pinput_buffer->input_start();
-        while(pinput_start != ce.pcommit_end) {
-            auto pdispatch = *reinterpret_cast<formatter_dispatch_function_t**>(pinput_start);
-            if(WRAPAROUND_MARKER == pdispatch) {
-                pinput_start = ce.pinput_buffer->wraparound();
-                pdispatch = *reinterpret_cast<formatter_dispatch_function_t**>(pinput_start);
+        if(unlikely(ce.pcommit_end == nullptr)) {
+            // The thread has replaced its input buffer and handed the old one
+            // over to us. Everything in it was committed before this, so we
+            // are done with it. (Unless we're in panic-flush mode, where we
+            // stay off the heap.)
+            if(likely(!panic_flush_)) {
+                auto it = std::find(touched_input_buffers.begin(),
+                        touched_input_buffers.end(), ce.pinput_buffer);
+                if(it != touched_input_buffers.end())
+                    touched_input_buffers.erase(it);
+                input_buffer_pool_.destroy(ce.pinput_buffer);
+            }
+            continue;
+        }
+
+        // If we're in panic-flush mode then we don't try to touch the
+        // heap-allocated vector.
+        numa_counter.count(ce.pinput_buffer->numa_node,
+                consume_input(&output_buffer_, ce.pinput_buffer,
+                    ce.pcommit_end,
+                    panic_flush_? nullptr : &touched_input_buffers));
+    }
+}
+
+// Output worker for commit_mode::shared_queue with formatter threads. Runs
+// of ordinary commit extents are handed to the formatter pool, and control
+// extents are handled as in output_worker() once everything before them has
+// been written.
+void reckless::basic_log::parallel_output_worker()
+{
+    using namespace detail;
+    std::vector<thread_input_buffer*> touched_input_buffers;
+    touched_input_buffers.reserve(std::max(8u, 2*std::thread::hardware_concurrency()));
+    formatter_pool& pool = *formatter_pool_;
+    commit_extent batch[256];
+    std::size_t const max_batch_size = sizeof(batch)/sizeof(batch[0]);
+    // The formatter threads may still be reading the buffers of exited
+    // threads, so they can only be collected after pool.finish(). Under
+    // steady load the queue may never run empty, so we wait for them every
+    // so many batches while there are buffers to collect.
+    unsigned const batches_per_collect = 16;
+    unsigned batches_since_collect = 0;
+    while(true) {
+        if(unlikely(panic_flush_)) {
+            // Stay off the heap from here on and let output_worker() take
+            // care of the rest.
+            pool.finish(&output_buffer_, nullptr);
+            return output_worker();
+        }
+        std::size_t batch_size = shared_input_queue_.pop(batch,
+                max_batch_size);
+        if(batch_size == 0) {
+            pool.finish(&output_buffer_, &touched_input_buffers);
+            shared_input_consumed_event_.signal();
+            for(thread_input_buffer* pinput_buffer : touched_input_buffers)
+                pinput_buffer->signal_input_consumed();
+            for(thread_input_buffer* pbuffer : touched_input_buffers)
+                pbuffer->input_consumed_flag = false;
+            touched_input_buffers.clear();
+            // Now that the formatter threads are done, nothing refers to
+            // the buffers of exited threads but us.
+            collect_retired_input_buffers(nullptr);
+            write_orphaned_drop_notice(true);
+            if(not output_buffer_.empty())
+                output_buffer_.flush();
+            idle_waiter waiter(&shared_input_queue_full_event_,
+                    wakeup_policy_.load(std::memory_order_relaxed),
+                    spin_budget_.load(std::memory_order_relaxed),
+                    max_idle_wait_ms_.load(std::memory_order_relaxed));
+            while(not panic_flush_ and shared_input_queue_.empty()) {
+                collect_retired_input_buffers(nullptr);
+                if(write_orphaned_drop_notice(false))
+                    output_buffer_.flush();
+                input_buffer_pool_.release_idle_memory();
+                waiter.wait();
+            }
+            continue;
+        }
+
+        std::size_t first = 0;
+        for(std::size_t i=0; i!=batch_size; ++i) {
+            commit_extent const& ce = batch[i];
+            if(likely(ce.pinput_buffer and ce.pcommit_end))
+                continue;
+            if(i != first) {
+                pool.format(batch + first, i - first, &output_buffer_,
+                        &touched_input_buffers);
             }
-            auto frame_size = (*pdispatch)(&output_buffer_, pinput_start);
-            pinput_start = ce.pinput_buffer->discard_input_frame(frame_size);
+            pool.finish(&output_buffer_, &touched_input_buffers);
+            first = i + 1;
+            if(not ce.pinput_buffer) {
+                if(unlikely(panic_flush_))
+                    on_panic_flush_done();
+                write_orphaned_drop_notice(true);
+                output_buffer_.flush();
+                for(thread_input_buffer* pinput_buffer : touched_input_buffers) {
+                    pinput_buffer->input_consumed_flag = false;
+                    pinput_buffer->signal_input_consumed();
+                }
+                return;
+            }
+            // A replaced input buffer, see output_worker().
             if(likely(!panic_flush_)) {
-                // If we're in panic-flush mode then we don't try to touch the
-                // heap-allocated vector.
-                if(not ce.pinput_buffer->input_consumed_flag) {
-                    touched_input_buffers.push_back(ce.pinput_buffer);
-                    ce.pinput_buffer->input_consumed_flag = true;
+                auto it = std::find(touched_input_buffers.begin(),
+                        touched_input_buffers.end(), ce.pinput_buffer);
+                if(it != touched_input_buffers.end())
+                    touched_input_buffers.erase(it);
+                input_buffer_pool_.destroy(ce.pinput_buffer);
+            }
+        }
+        if(first != batch_size) {
+            pool.format(batch + first, batch_size - first, &output_buffer_,
+                    &touched_input_buffers);
+        }
+        if(++batches_since_collect >= batches_per_collect
+                and likely(!panic_flush_)
+                and (retired_input_buffers_.load(std::memory_order_relaxed)
+                    or not draining_input_buffers_.empty()))
+        {
+            batches_since_collect = 0;
+            pool.finish(&output_buffer_, &touched_input_buffers);
+            collect_retired_input_buffers(&touched_input_buffers);
+            write_orphaned_drop_notice(false);
+        }
+    }
+}
+
+// Output worker for commit_mode::polled_buffers and merged_buffers. The
+// shared queue is only used for registering input buffers (a commit extent
+// with an end pointer), handing over replaced input buffers (a null end
+// pointer) and shutting down (a null input buffer). Log entries are found by
+// polling the registered input buffers for published input.
+void reckless::basic_log::poll_worker()
+{
+    using namespace detail;
+    std::vector<thread_input_buffer*> touched_input_buffers;
+    touched_input_buffers.reserve(std::max(8u, 2*std::thread::hardware_concurrency()));
+    std::vector<thread_input_buffer*> polled_input_buffers;
+    polled_input_buffers.reserve(std::max(8u, 2*std::thread::hardware_concurrency()));
+    auto has_pending_input = [&]()
+    {
+        if(not shared_input_queue_.empty())
+            return true;
+        for(thread_input_buffer* pbuffer : polled_input_buffers) {
+            if(pbuffer->published_input_end() != pbuffer->input_start()
+                    or pbuffer->abandoned_flag.load(std::memory_order_relaxed))
+            {
+                return true;
+            }
+        }
+        return false;
+    };
+
+    bool const merged = commit_mode_ == commit_mode::merged_buffers;
+    merge_clock clock(merge_window_us_.load(std::memory_order_relaxed));
+    input_merger merger;
+    merger.reserve(polled_input_buffers.capacity());
+    numa_input_counter numa_counter(numa_counters_.get());
+    std::uint64_t const no_horizon = ~static_cast<std::uint64_t>(0);
+    // Consumes the published input of all buffers. When merging, only the
+    // frames stamped up to horizon are consumed and *pheld is set if there
+    // are others.
+    auto consume_polled_input = [&](std::uint64_t horizon,
+            std::vector<thread_input_buffer*>* ptouched_input_buffers,
+            bool* pheld)
+    {
+        if(merged) {
+            return merger.merge(&output_buffer_, polled_input_buffers,
+                    horizon, ptouched_input_buffers, &numa_counter, pheld);
+        }
+        bool consumed = false;
+        for(thread_input_buffer* pbuffer : polled_input_buffers) {
+            char* pinput_end = pbuffer->published_input_end();
+            if(pinput_end != pbuffer->input_start()) {
+                numa_counter.count(pbuffer->numa_node,
+                        consume_input(&output_buffer_, pbuffer, pinput_end,
+                            ptouched_input_buffers));
+                consumed = true;
+            }
+        }
+        return consumed;
+    };
+
+    commit_extent batch[32];
+    std::size_t const max_batch_size = sizeof(batch)/sizeof(batch[0]);
+    while(true) {
+        // If we're in panic-flush mode then we don't try to touch the
+        // heap-allocated vectors, except for registering buffers which only
+        // allocates if there are more threads than we expected.
+        auto ptouched_input_buffers = panic_flush_? nullptr :
+            &touched_input_buffers;
+        std::size_t batch_size = shared_input_queue_.pop(batch,
+                max_batch_size);
+        bool held = false;
+        for(std::size_t i=0; i!=batch_size; ++i) {
+            commit_extent const& ce = batch[i];
+            if(not ce.pinput_buffer) {
+                // Everything that was committed before close() has been
+                // published by now.
+                consume_polled_input(no_horizon, ptouched_input_buffers,
+                        &held);
+                if(unlikely(panic_flush_))
+                    on_panic_flush_done();
+                write_orphaned_drop_notice(true);
+                output_buffer_.flush();
+                for(thread_input_buffer* pinput_buffer : touched_input_buffers) {
+                    pinput_buffer->input_consumed_flag = false;
+                    pinput_buffer->signal_input_consumed();
                 }
+                // The buffers have to register again if the log is reopened.
+                for(thread_input_buffer* pbuffer : polled_input_buffers)
+                    pbuffer->polled_flag.store(false, std::memory_order_release);
+                return;
+            } else if(ce.pcommit_end == nullptr) {
+                // A replaced input buffer, see output_worker(). Its owner
+                // published everything in it before handing it over. When
+                // merging, everything else that is waiting has to go out
+                // first.
+                if(likely(!panic_flush_)) {
+                    if(ce.pinput_buffer->polled_flag.load(std::memory_order_relaxed)) {
+                        consume_polled_input(no_horizon, &touched_input_buffers,
+                                &held);
+                        release_polled_buffer(ce.pinput_buffer,
+                                polled_input_buffers, touched_input_buffers);
+                    }
+                    input_buffer_pool_.destroy(ce.pinput_buffer);
+                }
+            } else if(likely(!panic_flush_) or polled_input_buffers.size()
+                    < polled_input_buffers.capacity())
+            {
+                polled_input_buffers.push_back(ce.pinput_buffer);
+                merger.reserve(polled_input_buffers.capacity());
+            }
+        }
+
+        bool busy = batch_size != 0;
+        held = false;
+        numa_counter.update_node();
+        if(consume_polled_input(panic_flush_? no_horizon : clock.horizon(),
+                    ptouched_input_buffers, &held))
+        {
+            busy = true;
+        }
+        for(std::size_t i=0; i!=polled_input_buffers.size();) {
+            thread_input_buffer* pbuffer = polled_input_buffers[i];
+            // The owner sets the flag after its last commit, so if the
+            // buffer is empty after we have seen the flag then there is
+            // nothing more to come.
+            if(unlikely(pbuffer->abandoned_flag.load(std::memory_order_acquire)
+                    and pbuffer->published_input_end() == pbuffer->input_start()
+                    and !panic_flush_))
+            {
+                release_polled_buffer(pbuffer, polled_input_buffers,
+                        touched_input_buffers);
+            } else {
+                ++i;
             }
         }
+        if(likely(!panic_flush_)) {
+            collect_retired_input_buffers(&touched_input_buffers);
+            write_orphaned_drop_notice(false);
+        }
+        if(busy)
+            continue;
+
+        if(unlikely(panic_flush_))
+            on_panic_flush_done();
+        shared_input_consumed_event_.signal();
+        for(thread_input_buffer* pinput_buffer : touched_input_buffers)
+            pinput_buffer->signal_input_consumed();
+        for(thread_input_buffer* pbuffer : touched_input_buffers)
+            pbuffer->input_consumed_flag = false;
+        touched_input_buffers.clear();
+        if(not held)
+            write_orphaned_drop_notice(true);
+        if(not output_buffer_.empty())
+            output_buffer_.flush();
+        if(held) {
+            // Come back when the oldest of them is past the merge window.
+            shared_input_queue_full_event_.wait(1);
+            continue;
+        }
+
+        // Producers only ring the doorbell if they see that we are idle
+        // after publishing input to an empty buffer. A producer that finds
+        // its buffer non-empty counts on us to come back to it; should we
+        // still miss its input, we pick it up after the timeout.
+        output_thread_idle_.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        idle_waiter waiter(&shared_input_queue_full_event_,
+                wakeup_policy_.load(std::memory_order_relaxed),
+                spin_budget_.load(std::memory_order_relaxed),
+                max_idle_wait_ms_.load(std::memory_order_relaxed));
+        while(not panic_flush_ and not has_pending_input()) {
+            collect_retired_input_buffers(nullptr);
+            if(write_orphaned_drop_notice(false))
+                output_buffer_.flush();
+            input_buffer_pool_.release_idle_memory();
+            waiter.wait();
+        }
+        output_thread_idle_.store(false, std::memory_order_relaxed);
     }
 }
 
@@ -171,40 +1145,240 @@ void reckless::basic_log::queue_commit_extent(detail::commit_extent const& ce)
         while(true)
             sleep(3600);
     }
+    if(polls_input_buffers() and ce.pcommit_end)
+        publish_commit_extent(ce);
+    else
+        push_commit_extent(ce);
+}
+
+void reckless::basic_log::push_commit_extent(detail::commit_extent const& ce)
+{
+    using namespace detail;
     if(unlikely(not shared_input_queue_.push(ce))) {
         do {
             shared_input_queue_full_event_.signal();
-            shared_input_consumed_event_.wait();
+            if(not (formatter_pool_ and formatter_pool_->help()))
+                shared_input_consumed_event_.wait();
         } while(not shared_input_queue_.push(ce));
     }
 }
 
-void reckless::basic_log::reset_shared_input_queue(std::size_t node_count)
+void reckless::basic_log::publish_commit_extent(
+        detail::commit_extent const& ce)
 {
-    // boost's lockfree queue has no move constructor and provides no reserve()
-    // function when you use fixed_sized policy. So we'll just explicitly
-    // destroy the current queue and create a new one with the desired size. We
-    // are guaranteed that the queue is empty since close() clears it.
-    shared_input_queue_.~shared_input_queue_t();
-    // TODO how do we handle an exception here?
-    new (&shared_input_queue_) shared_input_queue_t(node_count);
+    using namespace detail;
+    thread_input_buffer* pbuffer = ce.pinput_buffer;
+    if(unlikely(not pbuffer->polled_flag.load(std::memory_order_relaxed))) {
+        // First commit since the buffer was created or the log was opened.
+        pbuffer->polled_flag.store(true, std::memory_order_relaxed);
+        push_commit_extent(ce);
+    }
+    if(pbuffer->publish_input_end(ce.pcommit_end)) {
+        // Pairs with the fence in poll_worker(): either we see that the
+        // output thread is idle, or it sees our input.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if(output_thread_idle_.load(std::memory_order_relaxed))
+            shared_input_queue_full_event_.signal();
+    }
+}
+
+bool reckless::basic_log::try_queue_commit_extent(
+        detail::commit_extent const& ce, bool low_severity)
+{
+    using namespace detail;
+    // Publishing never fails, so there is nothing to drop.
+    if(polls_input_buffers()) {
+        queue_commit_extent(ce);
+        return true;
+    }
+    if(likely(not panic_flush_ and shared_input_queue_.push(ce)))
+        return true;
+    if(not panic_flush_ and should_drop(ce.pinput_buffer, low_severity)) {
+        // Make sure the output thread is awake and working on the queue,
+        // even though we're not waiting for it.
+        shared_input_queue_full_event_.signal();
+        return false;
+    }
+    queue_commit_extent(ce);
+    return true;
+}
+
+bool reckless::basic_log::strict_queue_commit_extent(
+        detail::commit_extent const& ce)
+{
+    using namespace detail;
+    // Unlike queue_commit_extent, we can't suspend the thread in panic
+    // mode, so the entry is dropped.
+    if(unlikely(panic_flush_))
+        return false;
+    if(not polls_input_buffers())
+        return shared_input_queue_.try_push(ce);
+    thread_input_buffer* pbuffer = ce.pinput_buffer;
+    if(unlikely(not pbuffer->polled_flag.load(std::memory_order_relaxed))) {
+        pbuffer->polled_flag.store(true, std::memory_order_relaxed);
+        if(not shared_input_queue_.try_push(ce)) {
+            pbuffer->polled_flag.store(false, std::memory_order_relaxed);
+            return false;
+        }
+    }
+    // No matter if the output thread is idle; it will find the input when
+    // its wait times out.
+    pbuffer->publish_input_end(ce.pcommit_end);
+    return true;
+}
+
+char* reckless::basic_log::allocate_input_frame(
+        detail::thread_input_buffer* pbuffer, std::size_t frame_size,
+        bool low_severity)
+{
+    // The stamp is taken before we wait, so that the entry is put in order
+    // by when it was written rather than by when there was room for it.
+    std::uint64_t stamp = stamp_size() == 0? 0 :
+        detail::read_frame_stamp_counter();
+    frame_size += stamp_size();
+    // Low-severity messages are not allowed to use extra segments when they
+    // are to be dropped, since that would defeat the purpose of
+    // drop_low_severity.
+    overflow_policy policy = effective_overflow_policy(pbuffer);
+    std::size_t growth_limit = input_buffer_growth_limit_.load(
+            std::memory_order_relaxed);
+    if(not (low_severity and policy == overflow_policy::drop_low_severity)) {
+        char* pframe = pbuffer->try_allocate_segment_frame(frame_size,
+                growth_limit);
+        if(pframe != nullptr)
+            return stamp_frame(pframe, stamp);
+    }
+    if(should_drop(pbuffer, low_severity))
+        return nullptr;
+    char* pframe = pbuffer->allocate_input_frame(frame_size, growth_limit,
+            formatter_pool_.get(), &shared_input_queue_full_event_);
+
+    std::size_t max_size = input_buffer_auto_size_limit_.load(
+            std::memory_order_relaxed);
+    if(pbuffer->stall_count >= STALLS_BEFORE_AUTO_SIZE
+            and pbuffer->capacity() < max_size
+            and pbuffer->requested_capacity == 0)
+    {
+        // The buffer is replaced on the next call to get_input_buffer().
+        pbuffer->requested_capacity = std::min(2*pbuffer->capacity(),
+                max_size);
+    }
+    return stamp_frame(pframe, stamp);
 }
 
 reckless::detail::thread_input_buffer* reckless::basic_log::init_input_buffer()
 {
-    auto p = detail::thread_input_buffer::create(thread_input_buffer_size_);
-    try {
-        int result = pthread_setspecific(thread_input_buffer_key_, p);
-        if(detail::likely(result == 0))
-            return p;
-        else if(result == ENOMEM)
+    auto pold = current_input_buffer();
+    if(not pold)
+        return replace_input_buffer(nullptr, thread_input_buffer_size_);
+    // A new size has been requested for the buffer. We have to keep the old
+    // one for now if a handle refers to it.
+    if(pold->handle_count != 0)
+        return pold;
+    return replace_input_buffer(pold, pold->requested_capacity);
+}
+
+reckless::detail::thread_input_buffer* reckless::basic_log::replace_input_buffer(
+        detail::thread_input_buffer* pold, std::size_t size)
+{
+    int numa_node = -1;
+    if(numa_local_input_buffers_.load(std::memory_order_relaxed))
+        numa_node = static_cast<int>(detail::current_numa_node());
+    auto p = input_buffer_pool_.acquire(size,
+            mirrored_input_buffers_.load(std::memory_order_relaxed),
+            numa_node, pmemory_provider_.load(std::memory_order_relaxed));
+    // Setting the key (again) for every new buffer makes sure that we get the
+    // destructor callback, even if the buffer is created from another key's
+    // destructor during thread exit.
+    int result = pthread_setspecific(g_thread_exit_key,
+            detail::thread_input_buffers);
+    if(detail::unlikely(result != 0)) {
+        input_buffer_pool_.destroy(p);
+        if(result == ENOMEM)
             throw std::bad_alloc();
         else
             throw std::system_error(result, std::system_category());
-    } catch(...) {
-        detail::thread_input_buffer::destroy(p);
-        throw;
     }
+
+    detail::thread_input_buffers[instance_id_] = p;
+    detail::thread_input_buffer_generations[instance_id_] =
+        instance_generation_;
+    if(pold) {
+        p->has_overflow_policy = pold->has_overflow_policy;
+        p->thread_overflow_policy = pold->thread_overflow_policy;
+        p->dropped_messages = pold->dropped_messages;
+        p->unreported_dropped_messages.store(
+                pold->unreported_dropped_messages.exchange(0,
+                    std::memory_order_relaxed),
+                std::memory_order_relaxed);
+        // The output thread may still be working on the old buffer, so it
+        // is the one to free it. If the log is closed then everything has
+        // been written already.
+        if(is_open())
+            queue_commit_extent({pold, nullptr});
+        else
+            input_buffer_pool_.destroy(pold);
+    }
+    return p;
+}
+
+void reckless::basic_log::collect_retired_input_buffers(
+        std::vector<detail::thread_input_buffer*>* ptouched_input_buffers)
+{
+    using namespace detail;
+    if(likely(draining_input_buffers_.empty() and
+                not retired_input_buffers_.load(std::memory_order_relaxed)))
+    {
+        return;
+    }
+    thread_input_buffer* pretired = retired_input_buffers_.exchange(nullptr,
+            std::memory_order_acquire);
+    while(pretired) {
+        draining_input_buffers_.push_back(pretired);
+        pretired = pretired->pnext_retired;
+    }
+    for(std::size_t i=0; i!=draining_input_buffers_.size();) {
+        thread_input_buffer* pbuffer = draining_input_buffers_[i];
+        if(pbuffer->polled_flag.load(std::memory_order_acquire)
+                or not pbuffer->drained())
+        {
+            ++i;
+            continue;
+        }
+        if(ptouched_input_buffers) {
+            auto it = std::find(ptouched_input_buffers->begin(),
+                    ptouched_input_buffers->end(), pbuffer);
+            if(it != ptouched_input_buffers->end())
+                ptouched_input_buffers->erase(it);
+        }
+        // Its thread is gone and can't report its drops any more.
+        orphaned_dropped_messages_ += pbuffer->unreported_dropped_messages
+            .exchange(0, std::memory_order_acquire);
+        input_buffer_pool_.release(pbuffer);
+        draining_input_buffers_[i] = draining_input_buffers_.back();
+        draining_input_buffers_.pop_back();
+    }
+}
+
+bool reckless::basic_log::write_orphaned_drop_notice(bool sweep)
+{
+    using namespace detail;
+    if(sweep) {
+        input_buffer_pool_.for_each_buffer([this](thread_input_buffer* p)
+        {
+            orphaned_dropped_messages_ += p->unreported_dropped_messages
+                .exchange(0, std::memory_order_acquire);
+        });
+    }
+    if(likely(orphaned_dropped_messages_ == 0))
+        return false;
+    auto pformat = pformat_dropped_messages_.load(std::memory_order_relaxed);
+    std::size_t count = orphaned_dropped_messages_;
+    orphaned_dropped_messages_ = 0;
+    if(not pformat)
+        return false;
+    (*pformat)(&output_buffer_, count);
+    return true;
 }
 
 void reckless::basic_log::on_panic_flush_done()
@@ -217,3 +1391,1006 @@ void reckless::basic_log::on_panic_flush_done()
         sleep(3600);
     }
 }
+
+#ifdef UNIT_TEST
+#include "unit_test.hpp"
+#include <reckless/policy_log.hpp>
+#include <reckless/severity_log.hpp>
+
+#include <condition_variable>
+#include <sstream>
+#include <cstdio>       // sscanf
+
+namespace reckless {
+
+class basic_log_suite {
+public:
+    void new_log_does_not_adopt_buffers()
+    {
+        counting_memory_provider provider;
+        std::size_t id;
+        {
+            string_writer writer;
+            policy_log<> log;
+            log.set_memory_provider(&provider);
+            log.open(&writer, 0, 0, 2048);
+            log.write("first %d", 1);
+            log.close();
+            TEST(writer.str() == "first 1\n");
+            TEST(provider.allocations() != 0);
+            id = log.instance_id_;
+        }
+        // The buffer that this thread still has in the slot went away with
+        // the log, and the memory provider can go away now too.
+        TEST(provider.allocations() == 0);
+
+        string_writer writer;
+        policy_log<> log(&writer);
+        TEST(log.instance_id_ == id);
+        log.write("second %d", 2);
+        log.close();
+        TEST(writer.str() == "second 2\n");
+        TEST(log.input_buffer_statistics().misses == 1);
+        TEST(provider.allocations() == 0);
+    }
+
+    void handle_commits_in_batches()
+    {
+        string_writer writer;
+        policy_log<> log(&writer);
+        {
+            policy_log<>::handle h(log);
+            h.write("line %d", 0);
+            h.write("line %d", 1);
+            // Nothing has been committed, so the output thread can't know
+            // about the entries yet.
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            TEST(writer.str().empty());
+            h.commit();
+            TEST(writer.wait_for_size(numbered_lines(0, 2).size()));
+            // An entry written directly to the log commits the pending
+            // entries of the handle too, in order.
+            h.write("line %d", 2);
+            log.write("line %d", 3);
+            h.write("line %d", 4);
+            // The destructor commits the last one.
+        }
+        log.close();
+        TEST(writer.str() == numbered_lines(0, 5));
+    }
+
+    void handle_commits_when_buffer_is_full()
+    {
+        string_writer writer;
+        policy_log<> log;
+        log.open(&writer, 0, 0, 1024);
+        log.set_input_buffer_growth_limit(0);
+        {
+            // Far more than fits in the input buffer without a commit.
+            policy_log<>::handle h(log);
+            for(unsigned i=0; i!=1000; ++i)
+                h.write("line %d", i);
+        }
+        log.close();
+        TEST(writer.str() == numbered_lines(0, 1000));
+        TEST(log.dropped_messages() == 0);
+    }
+
+    void drop_policy()
+    {
+        gated_writer writer;
+        policy_log<> log;
+        gate_guard guard(writer);
+        log.open(&writer, 0, 0, 1024);
+        log.set_input_buffer_growth_limit(0);
+        // The log's policy is to block, but this thread drops.
+        log.set_thread_overflow_policy(overflow_policy::drop);
+        log.write("line %d", 0);
+        writer.wait_until_blocked();
+        // The output thread is stuck in the writer, so the input buffer
+        // fills up and the rest is dropped instead of waiting.
+        for(unsigned i=1; i!=1000; ++i)
+            log.write("line %d", i);
+        std::size_t dropped = log.dropped_messages();
+        TEST(dropped != 0);
+        writer.open_gate();
+        // Waiting for room makes sure that the last entry, and the report
+        // of the drops before it, get through.
+        log.set_thread_overflow_policy(overflow_policy::block);
+        log.write("line %d", 1000);
+        log.close();
+        TEST(log.dropped_messages() == dropped);
+
+        // The entries that got through are in order, and all drops are
+        // reported in between.
+        std::string text = writer.str();
+        TEST(reported_drops(text) == dropped);
+        std::istringstream lines(text);
+        std::string line;
+        std::size_t kept = 0;
+        int last = -1;
+        while(std::getline(lines, line)) {
+            int number;
+            if(std::sscanf(line.c_str(), "line %d", &number) != 1)
+                continue;
+            TEST(number > last);
+            last = number;
+            ++kept;
+        }
+        TEST(last == 1000);
+        TEST(kept + dropped == 1001);
+    }
+
+    void orphaned_drops()
+    {
+        // A thread that drops and exits.
+        {
+            gated_writer writer;
+            policy_log<> log;
+            gate_guard guard(writer);
+            log.open(&writer, 0, 0, 1024);
+            log.set_input_buffer_growth_limit(0);
+            std::size_t dropped = 0;
+            std::thread([&]
+            {
+                dropped = drop_entries(log, writer);
+            }).join();
+            TEST(dropped != 0);
+            TEST(log.total_dropped_messages() == dropped);
+            writer.open_gate();
+            TEST(wait_for_reported_drops(writer, dropped));
+            log.close();
+            TEST(reported_drops(writer.str()) == dropped);
+            TEST(count_lines(writer.str(), "line ") == 1000 - dropped);
+        }
+        // A thread that drops and then stops writing.
+        {
+            gated_writer writer;
+            policy_log<> log;
+            gate_guard guard(writer);
+            log.open(&writer, 0, 0, 1024);
+            log.set_input_buffer_growth_limit(0);
+            std::size_t dropped = drop_entries(log, writer);
+            writer.open_gate();
+            TEST(wait_for_reported_drops(writer, dropped));
+            log.close();
+            TEST(reported_drops(writer.str()) == dropped);
+        }
+        // Drops that are still unreported when the log is closed.
+        {
+            gated_writer writer;
+            policy_log<> log;
+            gate_guard guard(writer);
+            log.open(&writer, 0, 0, 1024);
+            log.set_input_buffer_growth_limit(0);
+            std::size_t dropped = drop_entries(log, writer);
+            writer.open_gate();
+            log.close();
+            TEST(reported_drops(writer.str()) == dropped);
+            TEST(count_lines(writer.str(), "line ") == 1000 - dropped);
+            TEST(log.total_dropped_messages() == dropped);
+        }
+    }
+
+    void drop_low_severity_policy()
+    {
+        gated_writer writer;
+        severity_log<no_indent, ' ', severity_field> log;
+        gate_guard guard(writer);
+        log.open(&writer, 0, 0, 1024);
+        log.set_input_buffer_growth_limit(0);
+        log.set_overflow_policy(overflow_policy::drop_low_severity);
+        log.info("info %d", 0);
+        writer.wait_until_blocked();
+        for(unsigned i=1; i!=1000; ++i)
+            log.info("info %d", i);
+        std::size_t dropped = log.dropped_messages();
+        TEST(dropped != 0);
+        // An error is never dropped. There is usually room for it in the
+        // quarter of the buffer that info messages leave free, but the
+        // free space may not be contiguous, so it may have to wait.
+        std::thread opener([&]
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            writer.open_gate();
+        });
+        log.error("error");
+        opener.join();
+        TEST(log.dropped_messages() == dropped);
+        log.close();
+        std::string text = writer.str();
+        TEST(text.find("E error\n") != std::string::npos);
+        TEST(reported_drops(text) == dropped);
+    }
+
+    void segments_absorb_bursts()
+    {
+        gated_writer writer;
+        policy_log<> log;
+        gate_guard guard(writer);
+        // The shared queue must have room for a commit per entry.
+        log.open(&writer, 0, 1024, 1024);
+        log.set_input_buffer_growth_limit(64*1024);
+        // Dropping would show if the ring were all there is.
+        log.set_thread_overflow_policy(overflow_policy::drop);
+        log.write("line %d", 0);
+        writer.wait_until_blocked();
+        for(unsigned i=1; i!=500; ++i)
+            log.write("line %d", i);
+        TEST(log.dropped_messages() == 0);
+        writer.open_gate();
+        log.close();
+        TEST(writer.str() == numbered_lines(0, 500));
+    }
+
+    void oversized_entries()
+    {
+        string_writer writer;
+        policy_log<> log;
+        log.open(&writer, 0, 0, 1024);
+        log.set_input_buffer_growth_limit(0);
+        // Each entry is about three times the size of the ring, so it
+        // gets a segment of its own even though the growth limit is 0.
+        std::string expected;
+        for(unsigned round=0; round!=3; ++round) {
+            big_argument<> big;
+            std::memset(big.text, 'a' + round, sizeof(big.text));
+            log.write("line %d", 0);
+            log.write("%s", big);
+            log.write("line %d", 1);
+            expected += "line 0\n" + std::string(big.text, sizeof(big.text))
+                + "\nline 1\n";
+        }
+        log.close();
+        TEST(writer.str() == expected);
+        TEST(log.dropped_messages() == 0);
+    }
+
+    void mirrored_input_buffers()
+    {
+        string_writer writer;
+        policy_log<> log;
+        log.set_mirrored_input_buffers(true);
+        log.open(&writer, 0, 0, 4096);
+        log.set_input_buffer_growth_limit(0);
+        // Entries that nearly fill the ring, at shifting positions, so that
+        // most of them continue past its end.
+        std::string expected;
+        for(unsigned i=0; i!=20; ++i) {
+            big_argument<4000> big;
+            std::memset(big.text, 'a' + i, sizeof(big.text));
+            log.write("line %d", i);
+            log.write("%s", big);
+            expected += "line " + std::to_string(i) + "\n"
+                + std::string(big.text, sizeof(big.text)) + "\n";
+        }
+        TEST(log.current_input_buffer()->is_mirrored());
+        TEST(log.current_input_buffer()->capacity() == 4096);
+        log.close();
+        TEST(writer.str() == expected);
+    }
+
+    void thread_input_buffer_size()
+    {
+        string_writer writer;
+        policy_log<> log(&writer, 0, 0, 1024);
+        log.set_thread_input_buffer_size(4096);
+        TEST(log.current_input_buffer()->capacity() == 4096);
+        log.write("line %d", 0);
+        {
+            // The buffer is kept while a handle refers to it.
+            policy_log<>::handle h(log);
+            log.set_thread_input_buffer_size(2048);
+            h.write("line %d", 1);
+            TEST(log.current_input_buffer()->capacity() == 4096);
+        }
+        log.write("line %d", 2);
+        TEST(log.current_input_buffer()->capacity() == 2048);
+        log.close();
+        TEST(writer.str() == numbered_lines(0, 3));
+    }
+
+    void input_buffer_auto_sizing()
+    {
+        slow_writer writer;
+        policy_log<> log(&writer, 256, 0, 1024);
+        log.set_input_buffer_growth_limit(0);
+        log.set_input_buffer_auto_sizing(8192);
+        for(unsigned i=0; i!=2000; ++i)
+            log.write("line %d", i);
+        std::size_t capacity = log.current_input_buffer()->capacity();
+        log.close();
+        TEST(capacity > 1024);
+        TEST(capacity <= 8192);
+        TEST(writer.str() == numbered_lines(0, 2000));
+    }
+
+    void queries_do_not_allocate()
+    {
+        string_writer writer;
+        policy_log<> log(&writer);
+        // A thread that hasn't written has no buffer, and doesn't get one.
+        std::thread thread([&]
+        {
+            TEST(log.dropped_messages() == 0);
+            TEST(log.current_input_buffer() == nullptr);
+        });
+        thread.join();
+        // Nor is a pending resize carried out.
+        log.write("line %d", 0);
+        {
+            policy_log<>::handle h(log);
+            log.set_thread_input_buffer_size(2048);
+        }
+        detail::thread_input_buffer* pbuffer = log.current_input_buffer();
+        TEST(log.dropped_messages() == 0);
+        TEST(log.current_input_buffer() == pbuffer);
+        TEST(pbuffer->requested_capacity == 2048);
+        log.close();
+    }
+
+    void polled_buffers()
+    {
+        unsigned const THREADS = 4;
+        unsigned const COUNT = 5000;
+        string_writer writer;
+        policy_log<> log;
+        log.set_commit_mode(commit_mode::polled_buffers);
+        // Small buffers make the threads wrap around and wait for the output
+        // thread many times.
+        log.open(&writer, 0, 0, 1024);
+        std::vector<std::thread> threads;
+        for(unsigned t=0; t!=THREADS; ++t) {
+            threads.emplace_back([&log, t]
+            {
+                for(unsigned i=0; i!=COUNT; ++i)
+                    log.write("%d %d", t, i);
+            });
+        }
+        for(auto& thread : threads)
+            thread.join();
+        // This thread's buffer is still polled when the log is closed.
+        log.write("%d %d", THREADS, 0);
+        log.close();
+        TEST(in_thread_order(writer.str(), THREADS, COUNT));
+    }
+
+    void merged_buffers()
+    {
+        unsigned const THREADS = 4;
+        unsigned const COUNT = 2000;
+        string_writer writer;
+        policy_log<> log;
+        log.set_commit_mode(commit_mode::merged_buffers);
+        // Much longer than any delay between committing an entry and the
+        // output thread seeing it, even on a busy machine.
+        log.set_merge_window(200000);
+        log.open(&writer, 0, 0, 1024);
+        // Let the output thread get an estimate of the stamp frequency.
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        // Entries are numbered in the order they are stamped, across all
+        // threads.
+        std::mutex mutex;
+        unsigned next = 0;
+        std::vector<std::thread> threads;
+        for(unsigned t=0; t!=THREADS; ++t) {
+            threads.emplace_back([&, t]
+            {
+                for(unsigned i=0; i!=COUNT; ++i) {
+                    std::lock_guard<std::mutex> lk(mutex);
+                    log.write("%d %d", t, next++);
+                }
+            });
+        }
+        for(auto& thread : threads)
+            thread.join();
+        log.close();
+
+        std::istringstream is(writer.str());
+        unsigned t, n, expected = 0;
+        while(is >> t >> n and n == expected)
+            ++expected;
+        TEST(is.eof());
+        TEST(expected == THREADS*COUNT);
+    }
+
+    void merge_clock_calibration()
+    {
+        using detail::read_frame_stamp_counter;
+        std::uint64_t start_stamp = read_frame_stamp_counter();
+        std::uint64_t start_ns = now_ns();
+        // Without a window, the horizon is the present.
+        merge_clock unwindowed(0);
+        std::uint64_t horizon = unwindowed.horizon();
+        TEST(start_stamp <= horizon and horizon <= read_frame_stamp_counter());
+        // Until the frequency has been measured there is no window either.
+        merge_clock clock(1000);
+        TEST(start_stamp <= clock.horizon());
+
+        std::this_thread::sleep_for(std::chrono::milliseconds(200));
+        std::uint64_t stamp = read_frame_stamp_counter();
+        double ticks_per_ns = static_cast<double>(stamp - start_stamp)
+            / static_cast<double>(now_ns() - start_ns);
+        double window = static_cast<double>(stamp - clock.horizon());
+        TEST(window > 0.5*1000000*ticks_per_ns);
+        TEST(window < 2.0*1000000*ticks_per_ns);
+    }
+
+    void formatter_threads()
+    {
+        std::string const expected = formatted_output(0, 0);
+        TEST(expected.size() > 4*500*20);
+        TEST(formatted_output(1, 0) == expected);
+        TEST(formatted_output(3, 0) == expected);
+        TEST(formatted_output(0, 2) == expected);
+    }
+
+    void wakeup_policies()
+    {
+        wakeup_policy const policies[] = {wakeup_policy::timed_wait,
+            wakeup_policy::spin_then_wait, wakeup_policy::busy_poll};
+        for(wakeup_policy policy : policies) {
+            string_writer writer;
+            policy_log<> log;
+            log.set_wakeup_policy(policy);
+            log.set_spin_budget(1000);
+            log.set_max_idle_wait(20);
+            log.open(&writer);
+            for(unsigned i=0; i!=3; ++i) {
+                // Let the output thread go idle first. Entries still go out
+                // within about the maximum idle wait.
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                auto start = std::chrono::steady_clock::now();
+                log.write("line %d", i);
+                TEST(writer.wait_for_size(numbered_lines(0, i+1).size()));
+                TEST(std::chrono::steady_clock::now() - start
+                        < std::chrono::milliseconds(500));
+            }
+            log.close();
+            TEST(writer.str() == numbered_lines(0, 3));
+        }
+    }
+
+    void idle_waiter_paces_checks()
+    {
+        spsc_event event;
+        // Spinning doesn't touch the event until the budget is spent.
+        idle_waiter spinner(&event, wakeup_policy::spin_then_wait, 3, 10);
+        event.signal();
+        for(unsigned i=0; i!=3; ++i)
+            spinner.wait();
+        TEST(event.wait(0));
+        event.signal();
+        spinner.wait();
+        TEST(not event.wait(0));
+
+        idle_waiter poller(&event, wakeup_policy::busy_poll, 3, 10);
+        event.signal();
+        for(unsigned i=0; i!=100; ++i)
+            poller.wait();
+        TEST(event.wait(0));
+
+        // The waits grow to the maximum and stay there.
+        idle_waiter sleeper(&event, wakeup_policy::timed_wait, 3, 2);
+        for(unsigned i=0; i!=10; ++i)
+            sleeper.wait();
+        auto start = std::chrono::steady_clock::now();
+        for(unsigned i=0; i!=20; ++i)
+            sleeper.wait();
+        auto elapsed = std::chrono::steady_clock::now() - start;
+        TEST(elapsed >= std::chrono::milliseconds(40));
+        TEST(elapsed < std::chrono::milliseconds(500));
+    }
+
+    void output_thread_settings()
+    {
+        cpu_set_t allowed;
+        TEST(0 == sched_getaffinity(0, sizeof(allowed), &allowed));
+        unsigned cpu = 0;
+        while(not CPU_ISSET(cpu, &allowed))
+            ++cpu;
+        // Raising the nice value is always allowed.
+        // 19 is the lowest priority there is, so stay there if we are already
+        // at it.
+        int nice = std::min(getpriority(PRIO_PROCESS, 0) + 1, 19);
+
+        char name[16] = {};
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        int output_nice = 0;
+        string_writer writer;
+        policy_log<> log;
+        log.set_output_thread_name("reckless output thread");
+        log.set_output_thread_affinity({cpu});
+        log.set_output_thread_nice(nice);
+        log.set_output_thread_start_hook([&]
+        {
+            pthread_getname_np(pthread_self(), name, sizeof(name));
+            sched_getaffinity(0, sizeof(cpus), &cpus);
+            output_nice = getpriority(PRIO_PROCESS,
+                    static_cast<id_t>(syscall(SYS_gettid)));
+        });
+        log.open(&writer);
+        // The hook has run by the time open() returns.
+        TEST(std::string(name) == "reckless output");
+        TEST(CPU_COUNT(&cpus) == 1 and CPU_ISSET(cpu, &cpus));
+        TEST(output_nice == nice);
+        log.write("line %d", 0);
+        log.close();
+        TEST(writer.str() == numbered_lines(0, 1));
+    }
+
+    void output_thread_start_errors()
+    {
+        string_writer writer;
+        policy_log<> log;
+        log.set_output_thread_start_hook([]
+        {
+            throw std::runtime_error("start hook");
+        });
+        bool thrown = false;
+        try {
+            log.open(&writer);
+        } catch(std::runtime_error const& e) {
+            thrown = std::string(e.what()) == "start hook";
+        }
+        TEST(thrown);
+        TEST(not log.is_open());
+
+        log.set_output_thread_start_hook(nullptr);
+        log.set_output_thread_affinity({CPU_SETSIZE});
+        thrown = false;
+        try {
+            log.open(&writer);
+        } catch(std::system_error const& e) {
+            thrown = e.code().value() == EINVAL;
+        }
+        TEST(thrown);
+        TEST(not log.is_open());
+
+        // Nothing is left behind that keeps the log from being opened.
+        log.set_output_thread_affinity({});
+        log.open(&writer);
+        log.write("line %d", 0);
+        log.close();
+        TEST(writer.str() == numbered_lines(0, 1));
+    }
+
+    void idle_log_takes_back_buffers()
+    {
+        struct {
+            commit_mode mode;
+            unsigned formatter_threads;
+        } const configs[] = {
+            {commit_mode::shared_queue, 0},
+            {commit_mode::shared_queue, 1},
+            {commit_mode::polled_buffers, 0}
+        };
+        for(auto const& config : configs) {
+            string_writer writer;
+            policy_log<> log;
+            log.set_commit_mode(config.mode);
+            log.set_formatter_threads(config.formatter_threads);
+            log.set_input_buffer_pool(4, 1000);
+            log.open(&writer);
+            // The thread exits after its entry has been written, so the
+            // output thread is idle when it gets the buffer, and stays idle.
+            std::thread([&]
+            {
+                log.write("line %d", 0);
+                writer.wait_for_size(numbered_lines(0, 1).size());
+            }).join();
+            bool pooled = false;
+            for(unsigned i=0; i!=5000 and not pooled; ++i) {
+                pooled = log.input_buffer_statistics().pooled_buffers == 1;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            TEST(pooled);
+            log.close();
+            TEST(writer.str() == numbered_lines(0, 1));
+        }
+    }
+
+    // Like idle_log_takes_back_buffers, but the output thread has a backlog
+    // of many batches to work through after the thread has exited, so the
+    // shared queue doesn't run empty until all of it has been written.
+    void busy_log_takes_back_buffers()
+    {
+        for(unsigned formatter_threads : {0u, 1u}) {
+            pool_watching_writer writer;
+            policy_log<> log;
+            gate_guard guard(writer);
+            writer.watch(&log);
+            log.set_formatter_threads(formatter_threads);
+            log.set_input_buffer_pool(4, 1000);
+            // Room for the whole backlog, so that writing it never waits for
+            // the output thread.
+            log.open(&writer, 4096, 1 << 16, 1 << 22);
+            log.write("line %d", 0);
+            writer.wait_until_blocked();
+            std::thread([&] { log.write("line %d", 1); }).join();
+            for(unsigned i=2; i!=10000; ++i)
+                log.write("line %d", i);
+            writer.open_gate();
+            log.close();
+            std::string output = writer.str();
+            TEST(output == numbered_lines(0, 10000));
+            TEST(writer.pooled_at() < output.size()/2);
+        }
+    }
+
+    void packed_arguments()
+    {
+        // point can't be default-constructed and tag is empty, which are
+        // the two ways of loading a packed argument.
+        typedef detail::frame_layout<point, tag, int> layout;
+        static_assert(layout::trivial, "expected the packed layout");
+        static_assert(layout::frame_size == sizeof(void*) + sizeof(point)
+                + sizeof(int), "expected the tag to take no space");
+        std::uint64_t frame[(layout::frame_size + 7)/8];
+        char* pframe = reinterpret_cast<char*>(frame);
+        detail::construct_frame<point_formatter>(pframe, layout::frame_size,
+                point(3, 4), tag(), 5);
+        string_writer writer;
+        output_buffer output(&writer, 256);
+        auto pdispatch = *reinterpret_cast<
+            detail::formatter_dispatch_function_t**>(pframe);
+        TEST((*pdispatch)(&output, pframe) == layout::frame_size);
+        output.flush();
+        TEST(writer.str() == "3 4 tag 5");
+    }
+
+private:
+    // An argument of the given size, by default too large for a 1 KiB
+    // input buffer. (Captured strings that large would go on the heap
+    // instead.)
+    template <std::size_t Size = 3000>
+    struct big_argument {
+        char text[Size];
+
+        friend char const* format(output_buffer* pbuffer,
+                char const* pformat, big_argument const& v)
+        {
+            if(*pformat != 's')
+                return nullptr;
+            pbuffer->write(v.text, sizeof(v.text));
+            return pformat + 1;
+        }
+    };
+
+    struct point {
+        point(int x, int y) : x(x), y(y) {}
+        int x;
+        int y;
+    };
+    struct tag {
+    };
+    struct point_formatter {
+        static void format(output_buffer* pbuffer, point p, tag, int z)
+        {
+            std::string s = std::to_string(p.x) + " " + std::to_string(p.y)
+                + " tag " + std::to_string(z);
+            pbuffer->write(s.data(), s.size());
+        }
+    };
+
+    // May be read while the output thread writes to it.
+    class string_writer : public writer {
+    public:
+        Result write(void const* pbuffer, std::size_t count)
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            str_.append(static_cast<char const*>(pbuffer), count);
+            return SUCCESS;
+        }
+        std::string str()
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            return str_;
+        }
+        // Waits up to five seconds for the text to reach the given length.
+        bool wait_for_size(std::size_t size)
+        {
+            for(unsigned i=0; i!=5000; ++i) {
+                if(str().size() >= size)
+                    return true;
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+            return false;
+        }
+    private:
+        std::mutex mutex_;
+        std::string str_;
+    };
+
+    // Takes a millisecond for every write, so that threads have to wait for
+    // the output thread.
+    class slow_writer : public string_writer {
+    public:
+        Result write(void const* pbuffer, std::size_t count)
+        {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            return string_writer::write(pbuffer, count);
+        }
+    };
+
+    // Blocks the output thread on the first write until open_gate() is
+    // called.
+    class gated_writer : public writer {
+    public:
+        gated_writer() :
+            blocked_(false),
+            open_(false)
+        {
+        }
+        Result write(void const* pbuffer, std::size_t count)
+        {
+            std::unique_lock<std::mutex> lk(mutex_);
+            blocked_ = true;
+            condition_.notify_all();
+            condition_.wait(lk, [this] { return open_; });
+            str_.append(static_cast<char const*>(pbuffer), count);
+            return SUCCESS;
+        }
+        void wait_until_blocked()
+        {
+            std::unique_lock<std::mutex> lk(mutex_);
+            condition_.wait(lk, [this] { return blocked_; });
+        }
+        void open_gate()
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            open_ = true;
+            condition_.notify_all();
+        }
+        std::string str()
+        {
+            std::lock_guard<std::mutex> lk(mutex_);
+            return str_;
+        }
+    private:
+        std::mutex mutex_;
+        std::condition_variable condition_;
+        bool blocked_;
+        bool open_;
+        std::string str_;
+    };
+
+    // Adds up the counts of all "<count> messages dropped" notices.
+    static std::size_t reported_drops(std::string const& text)
+    {
+        std::string const notice = " messages dropped\n";
+        std::size_t total = 0;
+        for(std::size_t pos = text.find(notice); pos != std::string::npos;
+                pos = text.find(notice, pos + 1))
+        {
+            std::size_t start = text.find_last_of(" \n", pos - 1) + 1;
+            total += std::stoul(text.substr(start, pos - start));
+        }
+        return total;
+    }
+
+    // Writes entries "line 0" to "line 999" from the calling thread, which
+    // drops them once its input buffer is full since the output thread is
+    // stuck in the writer. Returns the number of dropped entries.
+    static std::size_t drop_entries(policy_log<>& log, gated_writer& writer)
+    {
+        log.set_thread_overflow_policy(overflow_policy::drop);
+        log.write("line %d", 0);
+        writer.wait_until_blocked();
+        for(unsigned i=1; i!=1000; ++i)
+            log.write("line %d", i);
+        return log.dropped_messages();
+    }
+
+    // Waits up to five seconds for the output to report count drops.
+    static bool wait_for_reported_drops(gated_writer& writer,
+            std::size_t count)
+    {
+        for(unsigned i=0; i!=5000; ++i) {
+            if(reported_drops(writer.str()) == count)
+                return true;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return false;
+    }
+
+    // Counts the lines of the text that start with prefix.
+    static std::size_t count_lines(std::string const& text,
+            std::string const& prefix)
+    {
+        std::istringstream lines(text);
+        std::string line;
+        std::size_t count = 0;
+        while(std::getline(lines, line)) {
+            if(line.compare(0, prefix.size(), prefix) == 0)
+                ++count;
+        }
+        return count;
+    }
+
+    // Opens the gate when it goes out of scope. Declared after the log, it
+    // keeps a failed test from leaving the output thread blocked in the
+    // log's destructor.
+    class gate_guard {
+    public:
+        explicit gate_guard(gated_writer& writer) :
+            writer_(writer)
+        {
+        }
+        ~gate_guard()
+        {
+            writer_.open_gate();
+        }
+    private:
+        gated_writer& writer_;
+    };
+
+    // Notes how much had been written when a buffer first showed up in the
+    // input buffer pool of the watched log.
+    class pool_watching_writer : public gated_writer {
+    public:
+        pool_watching_writer() :
+            plog_(nullptr),
+            pooled_at_(std::string::npos)
+        {
+        }
+        void watch(basic_log* plog)
+        {
+            plog_ = plog;
+        }
+        Result write(void const* pbuffer, std::size_t count)
+        {
+            if(pooled_at_ == std::string::npos and
+                    plog_->input_buffer_statistics().pooled_buffers != 0)
+            {
+                pooled_at_ = str().size();
+            }
+            return gated_writer::write(pbuffer, count);
+        }
+        std::size_t pooled_at() const
+        {
+            return pooled_at_;
+        }
+    private:
+        basic_log* plog_;
+        std::size_t pooled_at_;
+    };
+
+    // The text that a policy_log writes for count entries "line %d",
+    // numbered from first.
+    static std::string numbered_lines(unsigned first, unsigned count)
+    {
+        std::string text;
+        for(unsigned i=first; i!=first+count; ++i)
+            text += "line " + std::to_string(i) + "\n";
+        return text;
+    }
+
+    // Checks that the text holds lines "<thread> <index>" with index 0 to
+    // count-1 for each of threads threads in order, and a single line
+    // "<threads> 0" from the testing thread.
+    static bool in_thread_order(std::string const& text, unsigned threads,
+            unsigned count)
+    {
+        std::vector<unsigned> next(threads + 1, 0);
+        std::istringstream is(text);
+        unsigned t, i;
+        while(is >> t >> i) {
+            if(t > threads or i != next[t])
+                return false;
+            ++next[t];
+        }
+        if(not is.eof())
+            return false;
+        for(unsigned t=0; t!=threads; ++t) {
+            if(next[t] != count)
+                return false;
+        }
+        return next[threads] == 1;
+    }
+
+    // Has four threads take turns writing a mix of entries to a log with the
+    // given number of formatter threads and cooperative draining helpers,
+    // and returns the output. Since the threads write in a fixed order, the
+    // entries are committed in the same order every time.
+    static std::string formatted_output(unsigned formatter_threads,
+            unsigned helpers)
+    {
+        string_writer writer;
+        policy_log<> log;
+        log.set_formatter_threads(formatter_threads);
+        log.set_cooperative_draining(helpers);
+        log.open(&writer, 0, 0, 2048);
+        std::mutex mutex;
+        std::condition_variable turn_taken;
+        unsigned turn = 0;
+        std::vector<std::thread> threads;
+        for(unsigned t=0; t!=4; ++t) {
+            threads.emplace_back([&, t]
+            {
+                big_argument<600> big;
+                std::memset(big.text, 'a' + t, sizeof(big.text));
+                for(unsigned i=0; i!=500; ++i) {
+                    std::unique_lock<std::mutex> lk(mutex);
+                    turn_taken.wait(lk, [&] { return turn % 4 == t; });
+                    switch(i % 4) {
+                    case 0:
+                        log.write("%d line %d", t, i);
+                        break;
+                    case 1:
+                        log.write("%d %s %x", t, std::string(i % 50, 's'), i);
+                        break;
+                    case 2:
+                        log.write("%d %.3f %s", t, i/7.0, "text");
+                        break;
+                    default:
+                        log.write("%d %s", t, big);
+                    }
+                    ++turn;
+                    turn_taken.notify_all();
+                }
+            });
+        }
+        for(auto& thread : threads)
+            thread.join();
+        log.close();
+        return writer.str();
+    }
+
+    // Counts the allocations that haven't been given back.
+    class counting_memory_provider : public memory_provider {
+    public:
+        counting_memory_provider() :
+            allocations_(0)
+        {
+        }
+        void* allocate(std::size_t size, std::size_t alignment)
+        {
+            void* p = heap_.allocate(size, alignment);
+            allocations_.fetch_add(1, std::memory_order_relaxed);
+            return p;
+        }
+        void deallocate(void* p, std::size_t size)
+        {
+            allocations_.fetch_sub(1, std::memory_order_relaxed);
+            heap_.deallocate(p, size);
+        }
+        std::size_t allocations() const
+        {
+            return allocations_.load(std::memory_order_relaxed);
+        }
+    private:
+        heap_memory_provider heap_;
+        std::atomic<std::size_t> allocations_;
+    };
+};
+
+unit_test::suite<basic_log_suite> basic_log_tests = {
+    TESTCASE(basic_log_suite::handle_commits_in_batches),
+    TESTCASE(basic_log_suite::handle_commits_when_buffer_is_full),
+    TESTCASE(basic_log_suite::drop_policy),
+    TESTCASE(basic_log_suite::orphaned_drops),
+    TESTCASE(basic_log_suite::drop_low_severity_policy),
+    TESTCASE(basic_log_suite::segments_absorb_bursts),
+    TESTCASE(basic_log_suite::oversized_entries),
+    TESTCASE(basic_log_suite::mirrored_input_buffers),
+    TESTCASE(basic_log_suite::thread_input_buffer_size),
+    TESTCASE(basic_log_suite::input_buffer_auto_sizing),
+    TESTCASE(basic_log_suite::queries_do_not_allocate),
+    TESTCASE(basic_log_suite::polled_buffers),
+    TESTCASE(basic_log_suite::merged_buffers),
+    TESTCASE(basic_log_suite::merge_clock_calibration),
+    TESTCASE(basic_log_suite::formatter_threads),
+    TESTCASE(basic_log_suite::wakeup_policies),
+    TESTCASE(basic_log_suite::idle_waiter_paces_checks),
+    TESTCASE(basic_log_suite::output_thread_settings),
+    TESTCASE(basic_log_suite::output_thread_start_errors),
+    TESTCASE(basic_log_suite::idle_log_takes_back_buffers),
+    TESTCASE(basic_log_suite::busy_log_takes_back_buffers),
+    TESTCASE(basic_log_suite::packed_arguments),
+    TESTCASE(basic_log_suite::new_log_does_not_adopt_buffers),
+};
+
+}   // namespace reckless
+#endif
@@ -0,0 +1,614 @@
+#include <reckless/binary_log.hpp>
+#include <reckless/template_formatter.hpp>
+#include <reckless/writer.hpp>
+
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include <algorithm>    // min, max
+#include <ciso646>
+
+#include <stdio.h>      // sprintf
+
+namespace reckless {
+namespace {
+
+std::atomic<std::uint32_t> g_next_binary_call_site_id(1);
+
+// Dictionary state for the calling thread, which is always the output thread
+// of a log, since binary_log doesn't allow formatter threads or cooperative
+// draining. Every open() starts a new output thread, so each binary stream
+// gets its own header and dictionary even if the writer appends to an
+// existing file.
+__thread bool t_binary_header_written;
+thread_local std::vector<bool> t_binary_call_sites_written;
+
+template <class T>
+void append(output_buffer* pbuffer, T const& v)
+{
+    char* p = pbuffer->reserve(sizeof(T));
+    std::memcpy(p, &v, sizeof(T));
+    pbuffer->commit(sizeof(T));
+}
+
+void write_dictionary_entry(output_buffer* pbuffer,
+        detail::binary_call_site const& call_site)
+{
+    std::uint32_t format_length = static_cast<std::uint32_t>(
+        std::strlen(call_site.format));
+    append(pbuffer, binary_dictionary_tag);
+    append(pbuffer, call_site.id);
+    append(pbuffer, call_site.argument_count);
+    append(pbuffer, format_length);
+    pbuffer->write(call_site.argument_types,
+            call_site.argument_count*sizeof(binary_type));
+    pbuffer->write(call_site.format, format_length);
+}
+
+struct dictionary_entry {
+    std::string format;
+    std::vector<binary_type> argument_types;
+};
+
+// A log line found while scanning the data. pdata points to the timestamp.
+struct binary_record {
+    char const* pdata;
+    char const* pend;
+    dictionary_entry const* pentry;
+};
+
+template <class T>
+bool read(char const*& p, char const* pend, T* pvalue)
+{
+    if(static_cast<std::size_t>(pend - p) < sizeof(T))
+        return false;
+    std::memcpy(pvalue, p, sizeof(T));
+    p += sizeof(T);
+    return true;
+}
+
+bool is_valid_type(binary_type type)
+{
+    return type >= binary_type::type_char and type <= binary_type::type_c_string;
+}
+
+template <class T>
+bool decode_value(char const*& p, char const* pend, output_buffer* pbuffer,
+        char const*& pformat)
+{
+    T v;
+    if(not read(p, pend, &v))
+        return false;
+    if(pbuffer and pformat)
+        pformat = template_formatter::format_argument(pbuffer, pformat, v);
+    return true;
+}
+
+bool decode_string(char const*& p, char const* pend, output_buffer* pbuffer,
+        char const*& pformat, std::uint64_t const* ppointer)
+{
+    std::uint32_t size;
+    if(not read(p, pend, &size))
+        return false;
+    if(static_cast<std::size_t>(pend - p) < size)
+        return false;
+    char const* pchars = p;
+    p += size;
+    if(not pbuffer or not pformat)
+        return true;
+    if(ppointer) {
+        void const* pointer = reinterpret_cast<void const*>(
+            static_cast<std::uintptr_t>(*ppointer));
+        inline_c_string s(pchars, size, false, pointer);
+        pformat = template_formatter::format_argument(pbuffer, pformat, s);
+    } else {
+        inline_string s(pchars, size, false);
+        pformat = template_formatter::format_argument(pbuffer, pformat, s);
+    }
+    return true;
+}
+
+// Steps past the arguments of a log line starting at p, formatting them if
+// pbuffer is not null. Returns false if the data ends before the last
+// argument.
+bool decode_arguments(char const*& p, char const* pend,
+        dictionary_entry const& entry, output_buffer* pbuffer)
+{
+    char const* pformat = entry.format.c_str();
+    for(binary_type type : entry.argument_types) {
+        bool complete;
+        switch(type) {
+        case binary_type::type_char:
+            complete = decode_value<char>(p, pend, pbuffer, pformat);
+            break;
+        case binary_type::type_signed_char:
+            complete = decode_value<signed char>(p, pend, pbuffer, pformat);
+            break;
+        case binary_type::type_unsigned_char:
+            complete = decode_value<unsigned char>(p, pend, pbuffer, pformat);
+            break;
+        case binary_type::type_short:
+            complete = decode_value<short>(p, pend, pbuffer, pformat);
+            break;
+        case binary_type::type_unsigned_short:
+            complete = decode_value<unsigned short>(p, pend, pbuffer, pformat);
+            break;
+        case binary_type::type_int:
+            complete = decode_value<int>(p, pend, pbuffer, pformat);
+            break;
+        case binary_type::type_unsigned_int:
+            complete = decode_value<unsigned int>(p, pend, pbuffer, pformat);
+            break;
+        case binary_type::type_long:
+            complete = decode_value<long>(p, pend, pbuffer, pformat);
+            break;
+        case binary_type::type_unsigned_long:
+            complete = decode_value<unsigned long>(p, pend, pbuffer, pformat);
+            break;
+        case binary_type::type_long_long:
+            complete = decode_value<long long>(p, pend, pbuffer, pformat);
+            break;
+        case binary_type::type_unsigned_long_long:
+            complete = decode_value<unsigned long long>(p, pend, pbuffer, pformat);
+            break;
+        case binary_type::type_float:
+            complete = decode_value<float>(p, pend, pbuffer, pformat);
+            break;
+        case binary_type::type_double:
+            complete = decode_value<double>(p, pend, pbuffer, pformat);
+            break;
+        case binary_type::type_long_double:
+            complete = decode_value<long double>(p, pend, pbuffer, pformat);
+            break;
+        case binary_type::type_pointer: {
+            std::uint64_t pointer;
+            complete = read(p, pend, &pointer);
+            if(complete and pbuffer and pformat) {
+                pformat = template_formatter::format_argument(pbuffer, pformat,
+                    reinterpret_cast<void const*>(static_cast<std::uintptr_t>(pointer)));
+            }
+            break;
+        }
+        case binary_type::type_string:
+            complete = decode_string(p, pend, pbuffer, pformat, nullptr);
+            break;
+        case binary_type::type_c_string: {
+            std::uint64_t pointer;
+            complete = read(p, pend, &pointer) and
+                decode_string(p, pend, pbuffer, pformat, &pointer);
+            break;
+        }
+        default:
+            // Types are validated when the dictionary is read.
+            complete = false;
+            break;
+        }
+        if(not complete)
+            return false;
+    }
+    if(pbuffer and pformat)
+        template_formatter::format(pbuffer, pformat);
+    return true;
+}
+
+// Same format as timestamp_field.
+void format_timestamp(output_buffer* pbuffer, std::uint64_t nanoseconds)
+{
+    time_t seconds = static_cast<time_t>(nanoseconds/1000000000u);
+    unsigned milliseconds = static_cast<unsigned>(nanoseconds%1000000000u/1000000u);
+    char* p = pbuffer->reserve(25);
+    struct tm tm;
+    localtime_r(&seconds, &tm);
+    strftime(p, 25, "%Y-%m-%d %H:%M:%S.", &tm);
+    sprintf(p+20, "%03u ", milliseconds);
+    pbuffer->commit(24);
+}
+
+void format_record(output_buffer* pbuffer, binary_record const& record)
+{
+    char const* p = record.pdata;
+    std::uint64_t timestamp;
+    std::memcpy(&timestamp, p, sizeof(timestamp));
+    p += sizeof(timestamp);
+    format_timestamp(pbuffer, timestamp);
+    decode_arguments(p, record.pend, *record.pentry, pbuffer);
+    char* pnewline = pbuffer->reserve(1);
+    *pnewline = '\n';
+    pbuffer->commit(1);
+}
+
+class memory_writer : public writer {
+public:
+    Result write(void const* pbuffer, std::size_t count) override
+    {
+        auto pc = static_cast<char const*>(pbuffer);
+        data_.insert(data_.end(), pc, pc + count);
+        return SUCCESS;
+    }
+
+    std::vector<char> const& data() const
+    {
+        return data_;
+    }
+
+    void clear()
+    {
+        data_.clear();
+    }
+
+private:
+    std::vector<char> data_;
+};
+
+// Formats a contiguous range of records into memory, so that the results of
+// several ranges can be written in order afterwards.
+class decode_task {
+public:
+    decode_task() :
+        output_buffer_(&writer_, 64*1024)
+    {
+    }
+
+    void run(binary_record const* pbegin, binary_record const* pend)
+    {
+        try {
+            writer_.clear();
+            for(auto p = pbegin; p != pend; ++p)
+                format_record(&output_buffer_, *p);
+            output_buffer_.flush();
+        } catch(...) {
+            exception_ = std::current_exception();
+        }
+    }
+
+    void write_to(writer* pwriter)
+    {
+        if(exception_)
+            std::rethrow_exception(exception_);
+        auto const& data = writer_.data();
+        if(not data.empty())
+            pwriter->write(data.data(), data.size());
+    }
+
+private:
+    memory_writer writer_;
+    output_buffer output_buffer_;
+    std::exception_ptr exception_;
+};
+
+// Number of records that each thread formats before the results are written.
+std::size_t const records_per_task = 16384;
+
+}   // anonymous namespace
+
+namespace detail {
+
+std::uint32_t allocate_binary_call_site_id()
+{
+    return g_next_binary_call_site_id.fetch_add(1, std::memory_order_relaxed);
+}
+
+void write_binary_record_header(output_buffer* pbuffer,
+        binary_call_site const& call_site, std::uint64_t timestamp)
+{
+    if(unlikely(not t_binary_header_written)) {
+        append(pbuffer, binary_header_tag);
+        append(pbuffer, binary_log_version);
+        t_binary_header_written = true;
+    }
+    std::vector<bool>& written = t_binary_call_sites_written;
+    if(unlikely(written.size() <= call_site.id or not written[call_site.id])) {
+        if(written.size() <= call_site.id)
+            written.resize(std::max<std::size_t>(2*written.size(), call_site.id + 1));
+        write_dictionary_entry(pbuffer, call_site);
+        written[call_site.id] = true;
+    }
+    append(pbuffer, call_site.id);
+    append(pbuffer, timestamp);
+}
+
+}   // namespace detail
+
+std::size_t decode_binary_log(void const* pdata, std::size_t size,
+        writer* pwriter, unsigned thread_count)
+{
+    char const* const pbegin = static_cast<char const*>(pdata);
+    char const* const pend = pbegin + size;
+
+    // Find all the log lines first. This is cheap compared to formatting
+    // them, and it is what makes it possible to split the formatting work.
+    std::deque<dictionary_entry> entries;
+    std::unordered_map<std::uint32_t, dictionary_entry const*> dictionary;
+    std::vector<binary_record> records;
+    bool header_seen = false;
+    char const* p = pbegin;
+    while(p != pend) {
+        char const* precord = p;
+        std::uint32_t tag;
+        bool complete = read(p, pend, &tag);
+        if(complete and tag == binary_header_tag) {
+            std::uint32_t version;
+            complete = read(p, pend, &version);
+            if(complete and version != binary_log_version)
+                throw std::runtime_error("unsupported binary log version");
+            dictionary.clear();
+            header_seen = true;
+        } else if(complete and not header_seen) {
+            throw std::runtime_error("not a binary log");
+        } else if(complete and tag == binary_dictionary_tag) {
+            std::uint32_t id, argument_count, format_length;
+            complete = read(p, pend, &id) and read(p, pend, &argument_count)
+                and read(p, pend, &format_length)
+                and static_cast<std::size_t>(pend - p) >=
+                    static_cast<std::size_t>(argument_count) + format_length;
+            if(complete) {
+                dictionary_entry entry;
+                auto ptypes = reinterpret_cast<binary_type const*>(p);
+                entry.argument_types.assign(ptypes, ptypes + argument_count);
+                p += argument_count;
+                entry.format.assign(p, format_length);
+                p += format_length;
+                for(binary_type type : entry.argument_types) {
+                    if(not is_valid_type(type))
+                        throw std::runtime_error("invalid argument type in binary log");
+                }
+                entries.push_back(std::move(entry));
+                dictionary[id] = &entries.back();
+            }
+        } else if(complete) {
+            auto it = dictionary.find(tag);
+            if(it == dictionary.end())
+                throw std::runtime_error("unknown call site in binary log");
+            char const* pdata = p;
+            std::uint64_t timestamp;
+            complete = read(p, pend, &timestamp)
+                and decode_arguments(p, pend, *it->second, nullptr);
+            if(complete)
+                records.push_back({pdata, p, it->second});
+        }
+        if(not complete) {
+            p = precord;
+            break;
+        }
+    }
+
+    if(thread_count == 0)
+        thread_count = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<decode_task> tasks(thread_count);
+    std::size_t next = 0;
+    while(next != records.size()) {
+        // Hand out one range of records to each thread. The calling thread
+        // takes the first range itself.
+        std::vector<std::thread> threads;
+        binary_record const* pfirst_begin = nullptr;
+        binary_record const* pfirst_end = nullptr;
+        std::size_t task_count = 0;
+        try {
+            for(; task_count != thread_count and next != records.size(); ++task_count) {
+                std::size_t count = std::min(records_per_task, records.size() - next);
+                binary_record const* prange = records.data() + next;
+                next += count;
+                if(task_count == 0) {
+                    pfirst_begin = prange;
+                    pfirst_end = prange + count;
+                } else {
+                    threads.emplace_back(&decode_task::run, &tasks[task_count],
+                            prange, prange + count);
+                }
+            }
+        } catch(...) {
+            for(std::thread& thread : threads)
+                thread.join();
+            throw;
+        }
+        tasks[0].run(pfirst_begin, pfirst_end);
+        for(std::thread& thread : threads)
+            thread.join();
+        for(std::size_t i=0; i!=task_count; ++i)
+            tasks[i].write_to(pwriter);
+    }
+    return static_cast<std::size_t>(p - pbegin);
+}
+
+}   // namespace reckless
+
+#ifdef UNIT_TEST
+#include "unit_test.hpp"
+
+namespace reckless {
+namespace detail {
+
+class binary_log_suite {
+public:
+    void round_trip()
+    {
+        std::string s("text");
+        char const* p = "chars";
+        inline_string is(s.data(), s.size(), false);
+        inline_c_string ics(p, std::strlen(p), false, p);
+        std::string binary = encode([&](output_buffer* pbuffer) {
+            format(pbuffer, RECKLESS_FORMAT("Hello World!"));
+            format(pbuffer, RECKLESS_FORMAT("%d %d %x"), -17, 42u, 0xbeefLL);
+            format(pbuffer, RECKLESS_FORMAT("%s%s %.2f %f"), 'a', 'b', 2.5f, -1.0);
+            format(pbuffer, RECKLESS_FORMAT("<%s> <%s> %p"), is, ics, ics);
+            format(pbuffer, RECKLESS_FORMAT("%d %d"), 1, 2);
+        });
+        TEST(decode(binary) ==
+            "Hello World!\n"
+            "-17 42 beef\n"
+            "ab 2.50 -1.000000\n"
+            "<text> <chars> " + text("%p", static_cast<void const*>(p)) + "\n"
+            "1 2\n");
+    }
+
+    void dictionary_per_stream()
+    {
+        // Each output thread writes its own header and dictionary, so two
+        // streams appended to the same file decode as one.
+        std::string first = encode([](output_buffer* pbuffer) {
+            format(pbuffer, RECKLESS_FORMAT("first %d"), 1);
+        });
+        std::string second = encode([](output_buffer* pbuffer) {
+            format(pbuffer, RECKLESS_FORMAT("first %d"), 2);
+            format(pbuffer, RECKLESS_FORMAT("second %s"), 'x');
+        });
+        TEST(decode(first + second) == "first 1\nfirst 2\nsecond x\n");
+    }
+
+    void truncated()
+    {
+        std::string binary = encode([](output_buffer* pbuffer) {
+            format(pbuffer, RECKLESS_FORMAT("%d"), 1);
+            format(pbuffer, RECKLESS_FORMAT("%d"), 2);
+        });
+        std::size_t decoded;
+        TEST(decode(binary.substr(0, binary.size() - 1), &decoded) == "1\n");
+        TEST(decoded == binary.size() - sizeof(std::uint32_t)
+                - sizeof(std::uint64_t) - sizeof(int));
+        TEST(decode(std::string()) == "");
+    }
+
+    void invalid()
+    {
+        std::string binary = encode([](output_buffer* pbuffer) {
+            format(pbuffer, RECKLESS_FORMAT("%d"), 1);
+        });
+        TEST(throws(binary.substr(2 * sizeof(std::uint32_t))));
+        binary[2 * sizeof(std::uint32_t) + sizeof(std::uint32_t)] = 'x';
+        TEST(throws(binary));
+    }
+
+    void threads()
+    {
+        std::size_t const count = 3*records_per_task + 17;
+        std::string expected;
+        std::string binary = encode([&](output_buffer* pbuffer) {
+            for(std::size_t i=0; i!=count; ++i)
+                format(pbuffer, RECKLESS_FORMAT("line %d"), static_cast<int>(i));
+        });
+        for(std::size_t i=0; i!=count; ++i)
+            expected += "line " + std::to_string(i) + "\n";
+        TEST(decode(binary, nullptr, 2) == expected);
+        TEST(decode(binary, nullptr, 8) == expected);
+    }
+
+    void output_thread_only()
+    {
+        binary_log log;
+        TEST(throws_logic_error([&] { log.set_formatter_threads(2); }));
+        TEST(throws_logic_error([&] { log.set_cooperative_draining(1); }));
+        log.set_formatter_threads(0);
+        log.set_cooperative_draining(0);
+    }
+
+private:
+    template <class Function>
+    static bool throws_logic_error(Function function)
+    {
+        try {
+            function();
+        } catch(std::logic_error const&) {
+            return true;
+        }
+        return false;
+    }
+
+    class string_writer : public writer {
+    public:
+        Result write(void const* pbuffer, std::size_t count) override
+        {
+            auto pc = static_cast<char const*>(pbuffer);
+            buffer_.insert(buffer_.end(), pc, pc + count);
+            return SUCCESS;
+        }
+
+        std::string const& str() const
+        {
+            return buffer_;
+        }
+
+    private:
+        std::string buffer_;
+    };
+
+    template <class Format, typename... Args>
+    static void format(output_buffer* pbuffer, Format fmt, Args const&... args)
+    {
+        binary_formatter::format(pbuffer, binary_timestamp(), fmt, args...);
+    }
+
+    // Runs encoder on a new thread, since the dictionary state belongs to
+    // the output thread.
+    template <class Encoder>
+    static std::string encode(Encoder encoder)
+    {
+        string_writer writer;
+        std::thread thread([&] {
+            output_buffer buffer(&writer, 1024);
+            encoder(&buffer);
+            buffer.flush();
+        });
+        thread.join();
+        return writer.str();
+    }
+
+    // Decodes and strips the timestamps.
+    static std::string decode(std::string const& binary,
+            std::size_t* pdecoded = nullptr, unsigned thread_count = 1)
+    {
+        string_writer writer;
+        std::size_t decoded = decode_binary_log(binary.data(), binary.size(),
+                &writer, thread_count);
+        if(pdecoded)
+            *pdecoded = decoded;
+        std::string result;
+        std::string const& text = writer.str();
+        std::size_t pos = 0;
+        while(pos != text.size()) {
+            std::size_t end = text.find('\n', pos) + 1;
+            result += text.substr(pos + 24, end - pos - 24);
+            pos = end;
+        }
+        return result;
+    }
+
+    static bool throws(std::string const& binary)
+    {
+        try {
+            decode(binary);
+        } catch(std::runtime_error const&) {
+            return true;
+        }
+        return false;
+    }
+
+    template <typename T>
+    static std::string text(char const* fmt, T const& v)
+    {
+        string_writer writer;
+        {
+            output_buffer buffer(&writer, 1024);
+            template_formatter::format(&buffer, fmt, v);
+            buffer.flush();
+        }
+        return writer.str();
+    }
+};
+
+unit_test::suite<binary_log_suite> binary_log_tests = {
+    TESTCASE(binary_log_suite::round_trip),
+    TESTCASE(binary_log_suite::dictionary_per_stream),
+    TESTCASE(binary_log_suite::truncated),
+    TESTCASE(binary_log_suite::invalid),
+    TESTCASE(binary_log_suite::threads),
+    TESTCASE(binary_log_suite::output_thread_only),
+};
+
+}   // namespace detail
+}   // namespace reckless
+#endif
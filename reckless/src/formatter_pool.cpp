@@ -0,0 +1,230 @@
+#include <reckless/detail/formatter_pool.hpp>
+
+#include <algorithm>    // sort, min
+#include <ciso646>
+
+reckless::writer::Result
+reckless::detail::formatter_pool::chunk_writer::write(void const* pbuffer,
+        std::size_t count)
+{
+    char const* p = static_cast<char const*>(pbuffer);
+    pchunk->insert(pchunk->end(), p, p + count);
+    return SUCCESS;
+}
+
+reckless::detail::formatter_pool::formatter_pool(unsigned thread_count,
+        unsigned guest_count, std::size_t output_buffer_capacity,
+        numa_node_counters* pnuma_counters, memory_provider* pprovider) :
+    thread_count_(thread_count),
+    claim_(0),
+    stop_(false),
+    pending_(false),
+    formatted_(false)
+{
+    for(std::size_t slot=0; slot!=2; ++slot) {
+        batches_[slot].group_count.store(0, std::memory_order_relaxed);
+        batches_[slot].finished_groups.store(0, std::memory_order_relaxed);
+    }
+    for(unsigned i=0; i!=1+thread_count+guest_count; ++i) {
+        std::unique_ptr<formatter> pformatter(new formatter);
+        pformatter->guest_flag.store(false, std::memory_order_relaxed);
+        pformatter->numa_counter = numa_input_counter(pnuma_counters);
+        pformatter->buffer.reset(&pformatter->chunk_output,
+                output_buffer_capacity, pprovider);
+        formatters_.push_back(std::move(pformatter));
+    }
+    try {
+        for(std::size_t i=1; i!=1+thread_count_; ++i) {
+            formatters_[i]->thread = std::thread(&formatter_pool::run, this,
+                    i);
+        }
+    } catch(...) {
+        stop();
+        throw;
+    }
+}
+
+reckless::detail::formatter_pool::~formatter_pool()
+{
+    stop();
+}
+
+void reckless::detail::formatter_pool::format(commit_extent const* pbatch,
+        std::size_t count, output_buffer* poutput,
+        std::vector<thread_input_buffer*>* ptouched_input_buffers)
+{
+    if(pending_ and not formatted_)
+        wait_formatted(ptouched_input_buffers);
+
+    std::uint64_t number = (claim_.load(std::memory_order_relaxed) >> 32) + 1;
+    std::size_t slot = number & 1;
+    batch& b = batches_[slot];
+    b.extents.assign(pbatch, pbatch + count);
+    b.order.clear();
+    for(std::size_t i=0; i!=count; ++i)
+        b.order.emplace_back(pbatch[i].pinput_buffer, i);
+    std::sort(b.order.begin(), b.order.end());
+    b.group_starts.clear();
+    for(std::size_t pos=0; pos!=count; ++pos) {
+        if(pos == 0 or b.order[pos].first != b.order[pos-1].first)
+            b.group_starts.push_back(pos);
+    }
+    b.group_starts.push_back(count);
+    b.outputs.resize(count);
+    for(auto& pformatter : formatters_)
+        pformatter->chunks[slot].clear();
+    std::size_t group_count = b.group_starts.size() - 1;
+    b.group_count.store(group_count, std::memory_order_relaxed);
+    b.finished_groups.store(0, std::memory_order_relaxed);
+    claim_.store(number << 32, std::memory_order_release);
+
+    // We take a group ourselves, so there is no need to wake up more
+    // threads than there are other groups.
+    std::size_t wake_count = std::min(thread_count_, group_count - 1);
+    for(std::size_t i=1; i!=wake_count+1; ++i)
+        formatters_[i]->wake_event.signal();
+    // Threads that are blocked on a full input buffer are likely waiting
+    // for input in this batch, and can only lend a hand if they wake up.
+    if(formatters_.size() != 1 + thread_count_) {
+        for(std::size_t group=wake_count+1; group<group_count; ++group)
+            b.order[b.group_starts[group]].first->signal_input_consumed();
+    }
+
+    if(pending_)
+        write_output(1 - slot, poutput);
+    pending_ = true;
+    formatted_ = false;
+    format_groups(0);
+}
+
+void reckless::detail::formatter_pool::finish(output_buffer* poutput,
+        std::vector<thread_input_buffer*>* ptouched_input_buffers)
+{
+    if(not pending_)
+        return;
+    if(not formatted_)
+        wait_formatted(ptouched_input_buffers);
+    write_output((claim_.load(std::memory_order_relaxed) >> 32) & 1, poutput);
+    pending_ = false;
+}
+
+bool reckless::detail::formatter_pool::help()
+{
+    for(std::size_t i=1+thread_count_; i!=formatters_.size(); ++i) {
+        formatter& f = *formatters_[i];
+        if(f.guest_flag.load(std::memory_order_relaxed)
+                or f.guest_flag.exchange(true, std::memory_order_acquire))
+        {
+            continue;
+        }
+        bool formatted = format_groups(i);
+        f.guest_flag.store(false, std::memory_order_release);
+        return formatted;
+    }
+    return false;
+}
+
+void reckless::detail::formatter_pool::run(std::size_t formatter_index)
+{
+    formatter& f = *formatters_[formatter_index];
+    while(true) {
+        f.wake_event.wait();
+        if(stop_.load(std::memory_order_acquire))
+            return;
+        format_groups(formatter_index);
+    }
+}
+
+bool reckless::detail::formatter_pool::format_groups(
+        std::size_t formatter_index)
+{
+    bool formatted = false;
+    formatters_[formatter_index]->numa_counter.update_node();
+    std::uint64_t claim = claim_.load(std::memory_order_acquire);
+    while(true) {
+        std::size_t slot = (claim >> 32) & 1;
+        std::size_t group = claim & 0xffffffffu;
+        batch& b = batches_[slot];
+        if(group >= b.group_count.load(std::memory_order_relaxed))
+            return formatted;
+        if(claim_.compare_exchange_weak(claim, claim + 1,
+                    std::memory_order_acq_rel, std::memory_order_acquire))
+        {
+            format_group(formatter_index, slot, group);
+            formatted = true;
+            std::size_t finished = b.finished_groups.fetch_add(1,
+                    std::memory_order_acq_rel) + 1;
+            if(finished == b.group_count.load(std::memory_order_relaxed))
+                batch_done_event_.signal();
+            claim = claim_.load(std::memory_order_acquire);
+        }
+    }
+}
+
+void reckless::detail::formatter_pool::format_group(
+        std::size_t formatter_index, std::size_t slot, std::size_t group)
+{
+    formatter& f = *formatters_[formatter_index];
+    batch& b = batches_[slot];
+    std::vector<char>& chunk = f.chunks[slot];
+    f.chunk_output.pchunk = &chunk;
+    for(std::size_t pos = b.group_starts[group];
+            pos != b.group_starts[group + 1]; ++pos)
+    {
+        std::size_t i = b.order[pos].second;
+        std::size_t offset = chunk.size();
+        thread_input_buffer* pinput_buffer = b.extents[i].pinput_buffer;
+        f.numa_counter.count(pinput_buffer->numa_node,
+                consume_input(&f.buffer, pinput_buffer,
+                    b.extents[i].pcommit_end,
+                    &f.touched_input_buffers[slot]));
+        if(not f.buffer.empty())
+            f.buffer.flush();
+        b.outputs[i] = {formatter_index, offset, chunk.size() - offset};
+    }
+}
+
+void reckless::detail::formatter_pool::wait_formatted(
+        std::vector<thread_input_buffer*>* ptouched_input_buffers)
+{
+    std::size_t slot = (claim_.load(std::memory_order_relaxed) >> 32) & 1;
+    batch& b = batches_[slot];
+    format_groups(0);
+    while(b.finished_groups.load(std::memory_order_acquire)
+            != b.group_count.load(std::memory_order_relaxed))
+    {
+        batch_done_event_.wait();
+    }
+    for(auto& pformatter : formatters_) {
+        auto& touched = pformatter->touched_input_buffers[slot];
+        if(ptouched_input_buffers) {
+            ptouched_input_buffers->insert(ptouched_input_buffers->end(),
+                    touched.begin(), touched.end());
+        }
+        touched.clear();
+    }
+    formatted_ = true;
+}
+
+void reckless::detail::formatter_pool::write_output(std::size_t slot,
+        output_buffer* poutput)
+{
+    batch const& b = batches_[slot];
+    for(extent_output const& output : b.outputs) {
+        if(output.size != 0) {
+            poutput->write(formatters_[output.formatter_index]->chunks[slot].data()
+                    + output.offset, output.size);
+        }
+    }
+}
+
+void reckless::detail::formatter_pool::stop()
+{
+    stop_.store(true, std::memory_order_release);
+    for(auto& pformatter : formatters_) {
+        if(pformatter->thread.joinable()) {
+            pformatter->wake_event.signal();
+            pformatter->thread.join();
+        }
+    }
+}
@@ -0,0 +1,299 @@
+#include <reckless/detail/input_buffer_pool.hpp>
+#include <reckless/detail/utility.hpp>  // get_page_size
+
+#include <algorithm>    // find, min
+#include <limits>
+#include <new>          // bad_alloc
+#include <ciso646>
+
+namespace {
+std::atomic<std::uint64_t> g_next_pool_id(1);
+}
+
+reckless::detail::input_buffer_pool::input_buffer_pool() :
+    id_(g_next_pool_id.fetch_add(1, std::memory_order_relaxed)),
+    max_buffers_(0),
+    idle_release_time_(std::chrono::seconds(1)),
+    memory_budget_(0),
+    ring_bytes_(0),
+    resident_bytes_(0),
+    hits_(0),
+    misses_(0),
+    next_release_time_(std::numeric_limits<clock::rep>::max())
+{
+}
+
+reckless::detail::input_buffer_pool::~input_buffer_pool()
+{
+    for(pooled_buffer const& pooled : pooled_)
+        thread_input_buffer::destroy(pooled.pbuffer);
+}
+
+void reckless::detail::input_buffer_pool::destroy_all()
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    for(thread_input_buffer* pbuffer : buffers_)
+        thread_input_buffer::destroy(pbuffer);
+    buffers_.clear();
+    pooled_.clear();
+    ring_bytes_ = 0;
+    resident_bytes_ = 0;
+}
+
+void reckless::detail::input_buffer_pool::set_limits(std::size_t max_buffers,
+        unsigned idle_release_ms)
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    max_buffers_ = max_buffers;
+    idle_release_time_ = std::chrono::milliseconds(idle_release_ms);
+    while(pooled_.size() > max_buffers_)
+        destroy_pooled(0);
+    // Have release_idle_memory() work out when the pooled buffers are due.
+    next_release_time_.store(0, std::memory_order_relaxed);
+}
+
+void reckless::detail::input_buffer_pool::set_memory_budget(
+        std::size_t bytes)
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    memory_budget_ = bytes;
+    while(memory_budget_ != 0 and ring_bytes_ > memory_budget_
+            and not pooled_.empty())
+    {
+        destroy_pooled(0);
+    }
+}
+
+reckless::detail::thread_input_buffer*
+reckless::detail::input_buffer_pool::acquire(std::size_t size, bool mirrored,
+        int numa_node, memory_provider* pprovider)
+{
+    if(not pprovider)
+        pprovider = default_memory_provider();
+    std::lock_guard<std::mutex> lk(mutex_);
+    std::size_t capacity = ring_size(size, mirrored);
+    // The most recently pooled buffers are the most likely to still be in
+    // the cache.
+    for(std::size_t i=pooled_.size(); i!=0; --i) {
+        pooled_buffer const& pooled = pooled_[i-1];
+        thread_input_buffer* pbuffer = pooled.pbuffer;
+        if(pbuffer->capacity() != capacity
+                or pbuffer->is_mirrored() != mirrored
+                or pbuffer->numa_node != numa_node
+                or pbuffer->provider() != pprovider)
+        {
+            continue;
+        }
+        if(pooled.released)
+            resident_bytes_ += capacity;
+        pooled_.erase(pooled_.begin() + (i-1));
+        ++hits_;
+        return pbuffer;
+    }
+
+    if(memory_budget_ != 0) {
+        while(ring_bytes_ + capacity > memory_budget_ and not pooled_.empty())
+            destroy_pooled(0);
+        if(ring_bytes_ + capacity > memory_budget_)
+            throw std::bad_alloc();
+    }
+    buffers_.reserve(buffers_.size() + 1);
+    thread_input_buffer* pbuffer = thread_input_buffer::create(size, mirrored,
+            numa_node, pprovider);
+    pbuffer->pool_id = id_;
+    buffers_.push_back(pbuffer);
+    ring_bytes_ += pbuffer->capacity();
+    resident_bytes_ += pbuffer->capacity();
+    ++misses_;
+    return pbuffer;
+}
+
+void reckless::detail::input_buffer_pool::release(
+        thread_input_buffer* pbuffer)
+{
+    if(pbuffer->pool_id != id_) {
+        thread_input_buffer::destroy(pbuffer);
+        return;
+    }
+    std::unique_lock<std::mutex> lk(mutex_);
+    if(pooled_.size() >= max_buffers_
+            or (memory_budget_ != 0 and ring_bytes_ > memory_budget_))
+    {
+        lk.unlock();
+        destroy(pbuffer);
+        return;
+    }
+    pbuffer->recycle();
+    clock::time_point now = clock::now();
+    pooled_.push_back({pbuffer, now, false});
+    clock::rep release_time = (now + idle_release_time_).time_since_epoch()
+        .count();
+    if(release_time < next_release_time_.load(std::memory_order_relaxed))
+        next_release_time_.store(release_time, std::memory_order_relaxed);
+}
+
+void reckless::detail::input_buffer_pool::destroy(
+        thread_input_buffer* pbuffer)
+{
+    if(pbuffer->pool_id == id_) {
+        std::lock_guard<std::mutex> lk(mutex_);
+        ring_bytes_ -= pbuffer->capacity();
+        resident_bytes_ -= pbuffer->capacity();
+        forget(pbuffer);
+    }
+    thread_input_buffer::destroy(pbuffer);
+}
+
+void reckless::detail::input_buffer_pool::release_idle_memory()
+{
+    clock::time_point now = clock::now();
+    if(now.time_since_epoch().count()
+            < next_release_time_.load(std::memory_order_relaxed))
+    {
+        return;
+    }
+    std::lock_guard<std::mutex> lk(mutex_);
+    clock::rep next_release_time = std::numeric_limits<clock::rep>::max();
+    for(pooled_buffer& pooled : pooled_) {
+        if(pooled.released)
+            continue;
+        clock::time_point release_time = pooled.pooled_time
+            + idle_release_time_;
+        if(now < release_time) {
+            next_release_time = std::min(next_release_time,
+                    release_time.time_since_epoch().count());
+            continue;
+        }
+        pooled.pbuffer->release_ring_memory();
+        pooled.released = true;
+        resident_bytes_ -= pooled.pbuffer->capacity();
+    }
+    next_release_time_.store(next_release_time, std::memory_order_relaxed);
+}
+
+reckless::input_buffer_pool_statistics
+reckless::detail::input_buffer_pool::statistics()
+{
+    std::lock_guard<std::mutex> lk(mutex_);
+    return {hits_, misses_, pooled_.size(), resident_bytes_};
+}
+
+std::size_t reckless::detail::input_buffer_pool::ring_size(std::size_t size,
+        bool mirrored)
+{
+    if(not mirrored)
+        return size;
+    std::size_t page_size = get_page_size();
+    return (size + page_size - 1)/page_size*page_size;
+}
+
+void reckless::detail::input_buffer_pool::destroy_pooled(std::size_t index)
+{
+    pooled_buffer pooled = pooled_[index];
+    pooled_.erase(pooled_.begin() + index);
+    ring_bytes_ -= pooled.pbuffer->capacity();
+    if(not pooled.released)
+        resident_bytes_ -= pooled.pbuffer->capacity();
+    forget(pooled.pbuffer);
+    thread_input_buffer::destroy(pooled.pbuffer);
+}
+
+void reckless::detail::input_buffer_pool::forget(thread_input_buffer* pbuffer)
+{
+    auto it = std::find(buffers_.begin(), buffers_.end(), pbuffer);
+    *it = buffers_.back();
+    buffers_.pop_back();
+}
+
+#ifdef UNIT_TEST
+#include "unit_test.hpp"
+
+namespace reckless {
+namespace detail {
+
+class input_buffer_pool_suite {
+public:
+    void recycles_drained_buffers()
+    {
+        input_buffer_pool pool;
+        pool.set_limits(4, 1000);
+        thread_input_buffer* p = pool.acquire(4096, false, -1);
+        pool.release(p);
+        TEST(pool.statistics().pooled_buffers == 1);
+        TEST(pool.acquire(4096, false, -1) == p);
+        thread_input_buffer* q = pool.acquire(8192, false, -1);
+        TEST(q != p);
+        input_buffer_pool_statistics s = pool.statistics();
+        TEST(s.hits == 1);
+        TEST(s.misses == 2);
+        TEST(s.resident_bytes == 4096 + 8192);
+        pool.destroy(p);
+        pool.destroy(q);
+        TEST(pool.statistics().resident_bytes == 0);
+    }
+
+    void pooling_is_off_by_default()
+    {
+        input_buffer_pool pool;
+        pool.release(pool.acquire(4096, false, -1));
+        TEST(pool.statistics().pooled_buffers == 0);
+        TEST(pool.statistics().resident_bytes == 0);
+    }
+
+    void memory_budget()
+    {
+        input_buffer_pool pool;
+        pool.set_limits(4, 1000);
+        pool.set_memory_budget(10000);
+        thread_input_buffer* a = pool.acquire(4096, false, -1);
+        thread_input_buffer* b = pool.acquire(4096, false, -1);
+        bool thrown = false;
+        try {
+            pool.acquire(4096, false, -1);
+        } catch(std::bad_alloc const&) {
+            thrown = true;
+        }
+        TEST(thrown);
+        // The pooled buffer has to go to make room for one of another size.
+        pool.release(b);
+        thread_input_buffer* c = pool.acquire(2048, false, -1);
+        input_buffer_pool_statistics s = pool.statistics();
+        TEST(s.pooled_buffers == 0);
+        TEST(s.resident_bytes == 4096 + 2048);
+        pool.destroy(a);
+        pool.destroy(c);
+    }
+
+    void releases_idle_memory()
+    {
+        input_buffer_pool pool;
+        pool.set_limits(4, 0);
+        thread_input_buffer* p = pool.acquire(64*1024, false, -1);
+        pool.release(p);
+        pool.release_idle_memory();
+        TEST(pool.statistics().resident_bytes == 0);
+        TEST(pool.acquire(64*1024, false, -1) == p);
+        TEST(pool.statistics().resident_bytes == 64*1024);
+        pool.destroy(p);
+    }
+
+    void foreign_buffers_are_not_pooled()
+    {
+        input_buffer_pool pool;
+        pool.set_limits(4, 1000);
+        pool.release(thread_input_buffer::create(4096));
+        TEST(pool.statistics().pooled_buffers == 0);
+    }
+};
+
+unit_test::suite<input_buffer_pool_suite> input_buffer_pool_tests = {
+    TESTCASE(input_buffer_pool_suite::recycles_drained_buffers),
+    TESTCASE(input_buffer_pool_suite::pooling_is_off_by_default),
+    TESTCASE(input_buffer_pool_suite::memory_budget),
+    TESTCASE(input_buffer_pool_suite::releases_idle_memory),
+    TESTCASE(input_buffer_pool_suite::foreign_buffers_are_not_pooled),
+};
+
+}   // namespace detail
+}   // namespace reckless
+#endif
@@ -0,0 +1,152 @@
+#include <reckless/memory_provider.hpp>
+#include <reckless/detail/utility.hpp>  // get_page_size
+
+#include <fstream>
+#include <string>
+#include <cstdlib>      // posix_memalign, free, strtoul
+#include <ciso646>
+
+#include <sys/mman.h>   // mmap, munmap, madvise, mlock
+
+namespace {
+// Reads the default huge page size from /proc/meminfo, or returns 0 if it
+// isn't there.
+std::size_t read_huge_page_size()
+{
+    std::ifstream in("/proc/meminfo");
+    std::string line;
+    while(std::getline(in, line)) {
+        if(line.compare(0, 13, "Hugepagesize:") == 0)
+            return 1024*std::strtoul(line.c_str() + 13, nullptr, 10);
+    }
+    return 0;
+}
+
+std::size_t huge_page_size()
+{
+    static std::size_t const size = read_huge_page_size();
+    return size;
+}
+}
+
+reckless::memory_provider::~memory_provider()
+{
+}
+
+void* reckless::heap_memory_provider::allocate(std::size_t size,
+        std::size_t alignment)
+{
+    if(alignment < sizeof(void*))
+        alignment = sizeof(void*);
+    void* p;
+    if(0 != posix_memalign(&p, alignment, size))
+        return nullptr;
+    return p;
+}
+
+void reckless::heap_memory_provider::deallocate(void* p, std::size_t)
+{
+    std::free(p);
+}
+
+reckless::mapped_memory_provider::mapped_memory_provider(unsigned options) :
+    options_(options),
+    page_size_(detail::get_page_size())
+{
+    if((options_ & explicit_hugepages) and huge_page_size() > page_size_)
+        page_size_ = huge_page_size();
+}
+
+void* reckless::mapped_memory_provider::allocate(std::size_t size,
+        std::size_t)
+{
+    std::size_t length = mapped_size(size);
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+    if(options_ & prefault)
+        flags |= MAP_POPULATE;
+    void* p = MAP_FAILED;
+    if(options_ & explicit_hugepages)
+        p = mmap(nullptr, length, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB,
+                -1, 0);
+    if(p == MAP_FAILED) {
+        p = mmap(nullptr, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+        if(p == MAP_FAILED)
+            return nullptr;
+        if(options_ & transparent_hugepages)
+            madvise(p, length, MADV_HUGEPAGE);
+    }
+    if((options_ & lock) and 0 != mlock(p, length)) {
+        munmap(p, length);
+        return nullptr;
+    }
+    return p;
+}
+
+void reckless::mapped_memory_provider::deallocate(void* p, std::size_t size)
+{
+    munmap(p, mapped_size(size));
+}
+
+std::size_t reckless::mapped_memory_provider::mapped_size(
+        std::size_t size) const
+{
+    return (size + page_size_ - 1)/page_size_*page_size_;
+}
+
+reckless::memory_provider* reckless::detail::default_memory_provider()
+{
+    static heap_memory_provider provider;
+    return &provider;
+}
+
+#ifdef UNIT_TEST
+#include "unit_test.hpp"
+
+#include <cstdint>  // uintptr_t
+#include <cstring>  // memset
+
+namespace reckless {
+
+class memory_provider_suite {
+public:
+    void heap_alignment()
+    {
+        heap_memory_provider provider;
+        void* p = provider.allocate(100, 4096);
+        TEST(p != nullptr);
+        TEST(reinterpret_cast<std::uintptr_t>(p) % 4096 == 0);
+        provider.deallocate(p, 100);
+    }
+
+    void mapped_options()
+    {
+        using options = mapped_memory_provider::options;
+        unsigned const option_sets[] = {
+            0,
+            options::prefault,
+            options::transparent_hugepages | options::prefault,
+            // Falls back to ordinary pages if no huge pages are reserved.
+            options::explicit_hugepages,
+        };
+        for(unsigned option_set : option_sets) {
+            mapped_memory_provider provider(option_set);
+            std::size_t const size = 3*detail::get_page_size() + 1;
+            void* p = provider.allocate(size, 64);
+            TEST(p != nullptr);
+            if(not p)
+                continue;
+            TEST(reinterpret_cast<std::uintptr_t>(p)
+                    % detail::get_page_size() == 0);
+            std::memset(p, 1, size);
+            provider.deallocate(p, size);
+        }
+    }
+};
+
+unit_test::suite<memory_provider_suite> memory_provider_tests = {
+    TESTCASE(memory_provider_suite::heap_alignment),
+    TESTCASE(memory_provider_suite::mapped_options),
+};
+
+}   // namespace reckless
+#endif
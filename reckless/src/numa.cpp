@@ -0,0 +1,173 @@
+#include <reckless/detail/numa.hpp>
+
+#include <fstream>
+#include <string>
+#include <cstdlib>      // strtoul
+#include <ciso646>
+
+#include <sched.h>          // sched_getcpu
+#include <unistd.h>         // syscall
+#include <sys/syscall.h>    // SYS_mbind
+#include <linux/mempolicy.h>    // MPOL_PREFERRED, MPOL_MF_MOVE
+
+namespace reckless {
+namespace detail {
+namespace {
+
+// Node numbers above this are not supported by place_on_numa_node.
+unsigned const MAX_NUMA_NODES = 1024;
+
+struct numa_topology {
+    numa_topology() :
+        node_count(1)
+    {
+        std::vector<unsigned> nodes = read_list(
+                "/sys/devices/system/node/online");
+        for(unsigned node : nodes) {
+            std::vector<unsigned> cpus = read_list(
+                    "/sys/devices/system/node/node" + std::to_string(node)
+                    + "/cpulist");
+            for(unsigned cpu : cpus) {
+                if(cpu >= cpu_nodes.size())
+                    cpu_nodes.resize(cpu + 1, 0);
+                cpu_nodes[cpu] = node;
+            }
+            if(node >= node_count)
+                node_count = node + 1;
+        }
+    }
+
+    static std::vector<unsigned> read_list(std::string const& path)
+    {
+        std::ifstream in(path);
+        std::string line;
+        if(not std::getline(in, line))
+            return std::vector<unsigned>();
+        return parse_numa_list(line.c_str());
+    }
+
+    // Node of each CPU, indexed by CPU number.
+    std::vector<unsigned> cpu_nodes;
+    unsigned node_count;
+};
+
+numa_topology const& topology()
+{
+    static numa_topology const instance;
+    return instance;
+}
+
+}   // anonymous namespace
+
+unsigned numa_node_count()
+{
+    return topology().node_count;
+}
+
+unsigned current_numa_node()
+{
+    numa_topology const& t = topology();
+    if(t.node_count == 1)
+        return 0;
+    int cpu = sched_getcpu();
+    if(cpu < 0 or static_cast<unsigned>(cpu) >= t.cpu_nodes.size())
+        return 0;
+    return t.cpu_nodes[cpu];
+}
+
+std::vector<unsigned> numa_node_cpus(unsigned node)
+{
+    numa_topology const& t = topology();
+    std::vector<unsigned> cpus;
+    for(unsigned cpu=0; cpu!=t.cpu_nodes.size(); ++cpu) {
+        if(t.cpu_nodes[cpu] == node)
+            cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+bool place_on_numa_node(void* p, std::size_t size, unsigned node)
+{
+    if(numa_node_count() == 1 or node >= MAX_NUMA_NODES)
+        return false;
+    std::size_t const BITS = 8*sizeof(unsigned long);
+    unsigned long mask[MAX_NUMA_NODES/BITS] = {};
+    mask[node/BITS] = 1ul << (node % BITS);
+    // The kernel only looks at the first maxnode - 1 bits.
+    return 0 == syscall(SYS_mbind, p, size, MPOL_PREFERRED, mask,
+            MAX_NUMA_NODES + 1, MPOL_MF_MOVE);
+}
+
+std::vector<unsigned> parse_numa_list(char const* s)
+{
+    std::vector<unsigned> numbers;
+    while(*s >= '0' and *s <= '9') {
+        char* pend;
+        unsigned first = static_cast<unsigned>(std::strtoul(s, &pend, 10));
+        unsigned last = first;
+        s = pend;
+        if(*s == '-') {
+            last = static_cast<unsigned>(std::strtoul(s + 1, &pend, 10));
+            s = pend;
+        }
+        for(unsigned n=first; n<=last; ++n)
+            numbers.push_back(n);
+        if(*s == ',')
+            ++s;
+    }
+    return numbers;
+}
+
+}   // namespace detail
+}   // namespace reckless
+
+#ifdef UNIT_TEST
+#include "unit_test.hpp"
+
+#include <algorithm>  // find
+
+namespace reckless {
+namespace detail {
+
+class numa_suite {
+public:
+    void single()
+    {
+        TEST(parse_numa_list("0\n") == std::vector<unsigned>({0}));
+    }
+
+    void ranges()
+    {
+        TEST(parse_numa_list("0-3,8-9,12") ==
+                std::vector<unsigned>({0, 1, 2, 3, 8, 9, 12}));
+    }
+
+    void empty()
+    {
+        TEST(parse_numa_list("").empty());
+        TEST(parse_numa_list("\n").empty());
+    }
+
+    void topology_is_consistent()
+    {
+        TEST(numa_node_count() >= 1);
+        unsigned node = current_numa_node();
+        TEST(node < numa_node_count());
+        // Without sysfs there are no known CPUs at all.
+        std::vector<unsigned> cpus = numa_node_cpus(node);
+        unsigned cpu = static_cast<unsigned>(sched_getcpu());
+        TEST(cpus.empty()
+                or std::find(cpus.begin(), cpus.end(), cpu) != cpus.end());
+    }
+};
+
+unit_test::suite<numa_suite> numa_tests = {
+    TESTCASE(numa_suite::single),
+    TESTCASE(numa_suite::ranges),
+    TESTCASE(numa_suite::empty),
+    TESTCASE(numa_suite::topology_is_consistent),
+};
+
+}   // namespace detail
+}   // namespace reckless
+#endif
@@ -1,35 +1,42 @@
 #include <reckless/output_buffer.hpp>
 #include <reckless/writer.hpp>
+#include <reckless/memory_provider.hpp>
 #include <reckless/detail/utility.hpp>
 
 #include <cstdlib>      // malloc, free
+#include <ciso646>
 #include <sys/mman.h>   // madvise()
 
 reckless::output_buffer::output_buffer() :
     pwriter_(nullptr),
+    pprovider_(nullptr),
     pbuffer_(nullptr),
     pcommit_end_(nullptr),
     pbuffer_end_(nullptr)
 {
 }
 
-reckless::output_buffer::output_buffer(writer* pwriter, std::size_t max_capacity) :
+reckless::output_buffer::output_buffer(writer* pwriter, std::size_t max_capacity,
+        memory_provider* pprovider) :
     pwriter_(nullptr),
+    pprovider_(nullptr),
     pbuffer_(nullptr),
     pcommit_end_(nullptr),
     pbuffer_end_(nullptr)
 {
-    reset(pwriter, max_capacity);
+    reset(pwriter, max_capacity, pprovider);
 }
 
 reckless::output_buffer::output_buffer(output_buffer&& other)
 {
     pwriter_ = other.pwriter_;
+    pprovider_ = other.pprovider_;
     pbuffer_ = other.pbuffer_;
     pcommit_end_ = other.pcommit_end_;
     pbuffer_end_ = other.pbuffer_end_;
 
     other.pwriter_ = nullptr;
+    other.pprovider_ = nullptr;
     other.pbuffer_ = nullptr;
     other.pcommit_end_ = nullptr;
     other.pbuffer_end_ = nullptr;
@@ -37,14 +44,16 @@ reckless::output_buffer::output_buffer(output_buffer&& other)
 
 reckless::output_buffer& reckless::output_buffer::operator=(output_buffer&& other)
 {
-    std::free(pbuffer_);
+    free_buffer();
 
     pwriter_ = other.pwriter_;
+    pprovider_ = other.pprovider_;
     pbuffer_ = other.pbuffer_;
     pcommit_end_ = other.pcommit_end_;
     pbuffer_end_ = other.pbuffer_end_;
 
     other.pwriter_ = nullptr;
+    other.pprovider_ = nullptr;
     other.pbuffer_ = nullptr;
     other.pcommit_end_ = nullptr;
     other.pbuffer_end_ = nullptr;
@@ -52,23 +61,50 @@ reckless::output_buffer& reckless::output_buffer::operator=(output_buffer&& othe
     return *this;
 }
 
-void reckless::output_buffer::reset(writer* pwriter, std::size_t max_capacity)
+void reckless::output_buffer::reset(writer* pwriter, std::size_t max_capacity,
+        memory_provider* pprovider)
 {
     using namespace detail;
-    std::free(pbuffer_);
+    free_buffer();
+
+    char* pbuffer;
+    if(pprovider) {
+        pbuffer = static_cast<char*>(pprovider->allocate(max_capacity,
+                    get_page_size()));
+    } else {
+        pbuffer = static_cast<char*>(std::malloc(max_capacity));
+        if(pbuffer) {
+            auto page = get_page_size();
+            if(max_capacity > page)
+                madvise(pbuffer + page, max_capacity - page, MADV_DONTNEED);
+        }
+    }
+    if(not pbuffer)
+        throw std::bad_alloc();
 
     pwriter_ = pwriter;
-    pbuffer_ = static_cast<char*>(std::malloc(max_capacity));
-    // FIXME check return value of malloc here 
+    pprovider_ = pprovider;
+    pbuffer_ = pbuffer;
     pcommit_end_ = pbuffer_;
     pbuffer_end_ = pbuffer_ + max_capacity;
-    auto page = detail::get_page_size();
-    madvise(pbuffer_ + page, max_capacity - page, MADV_DONTNEED);
 }
 
 reckless::output_buffer::~output_buffer()
 {
-    std::free(pbuffer_);
+    free_buffer();
+}
+
+void reckless::output_buffer::free_buffer()
+{
+    if(pprovider_)
+        pprovider_->deallocate(pbuffer_, pbuffer_end_ - pbuffer_);
+    else
+        std::free(pbuffer_);
+    pwriter_ = nullptr;
+    pprovider_ = nullptr;
+    pbuffer_ = nullptr;
+    pcommit_end_ = nullptr;
+    pbuffer_end_ = nullptr;
 }
 
 void reckless::output_buffer::write(void const* buf, std::size_t count)
@@ -0,0 +1,295 @@
+#include <reckless/sharded_log.hpp>
+#include <reckless/output_buffer.hpp>
+
+#include <algorithm>    // make_heap, min
+#include <mutex>
+#include <new>          // bad_alloc
+#include <stdexcept>    // invalid_argument
+#include <cstring>      // memcmp, memchr
+#include <ciso646>
+
+__thread unsigned
+    reckless::detail::thread_log_shards[max_log_instances];
+
+namespace reckless {
+namespace {
+
+std::mutex g_sharded_log_ids_mutex;
+bool g_sharded_log_ids_used[detail::max_log_instances];
+// Only the low 24 bits are used, since the generation shares
+// thread_log_shards with the shard index.
+unsigned g_sharded_log_generations[detail::max_log_instances];
+
+// Length of "YYYY-mm-dd HH:MM:SS.FFF", as written by timestamp_field.
+std::size_t const TIMESTAMP_LENGTH = 23;
+// How far into a line we look for the timestamp, to leave room for other
+// header fields before it.
+std::size_t const TIMESTAMP_SEARCH_LENGTH = 64;
+
+bool is_digit(char c)
+{
+    return c >= '0' and c <= '9';
+}
+
+bool is_timestamp(char const* p)
+{
+    char const pattern[] = "0000-00-00 00:00:00.000";
+    for(std::size_t i=0; i!=TIMESTAMP_LENGTH; ++i) {
+        if(pattern[i] == '0'? not is_digit(p[i]) : p[i] != pattern[i])
+            return false;
+    }
+    return true;
+}
+
+// Returns the timestamp near the start of the line [p, pend), or nullptr if
+// there is none.
+char const* find_timestamp(char const* p, char const* pend)
+{
+    std::size_t length = std::min<std::size_t>(pend - p,
+            TIMESTAMP_SEARCH_LENGTH);
+    for(std::size_t i=0; i + TIMESTAMP_LENGTH <= length; ++i) {
+        if(is_digit(p[i]) and is_timestamp(p + i))
+            return p + i;
+    }
+    return nullptr;
+}
+
+char const* line_end(char const* p, char const* pend)
+{
+    auto pnewline = static_cast<char const*>(std::memchr(p, '\n', pend - p));
+    return pnewline? pnewline + 1 : pend;
+}
+
+// The lines of one shard that are yet to be merged. An entry is a line with
+// a timestamp and the lines without one that follow it.
+struct shard_cursor {
+    std::size_t index;
+    char const* pentry;
+    char const* pentry_end;
+    char const* ptimestamp;     // nullptr for lines before the first timestamp
+    char const* pend;
+
+    // Moves to the next entry. Returns false if there is none.
+    bool next()
+    {
+        pentry = pentry_end;
+        if(pentry == pend)
+            return false;
+        char const* p = line_end(pentry, pend);
+        ptimestamp = find_timestamp(pentry, p);
+        while(p != pend) {
+            char const* pline_end = line_end(p, pend);
+            if(find_timestamp(p, pline_end))
+                break;
+            p = pline_end;
+        }
+        pentry_end = p;
+        return true;
+    }
+};
+
+// Heap order: the cursor with the earliest entry (and then the lowest shard
+// index) goes to the front.
+bool later_entry(shard_cursor const& a, shard_cursor const& b)
+{
+    if(not a.ptimestamp or not b.ptimestamp) {
+        if(a.ptimestamp != b.ptimestamp)
+            return a.ptimestamp != nullptr;
+    } else {
+        int order = std::memcmp(a.ptimestamp, b.ptimestamp, TIMESTAMP_LENGTH);
+        if(order != 0)
+            return order > 0;
+    }
+    return a.index > b.index;
+}
+
+}   // anonymous namespace
+
+std::size_t detail::acquire_sharded_log_id(std::size_t shard_count)
+{
+    if(shard_count == 0 or shard_count > max_log_shards)
+        throw std::invalid_argument("sharded_log needs 1 to 255 shards");
+    std::lock_guard<std::mutex> lk(g_sharded_log_ids_mutex);
+    for(std::size_t id=0; id!=max_log_instances; ++id) {
+        if(not g_sharded_log_ids_used[id]) {
+            g_sharded_log_ids_used[id] = true;
+            unsigned& generation = g_sharded_log_generations[id];
+            generation = (generation + 1) & 0xffffff;
+            if(generation == 0)
+                generation = 1;
+            return id;
+        }
+    }
+    throw std::bad_alloc();
+}
+
+void detail::release_sharded_log_id(std::size_t id)
+{
+    std::lock_guard<std::mutex> lk(g_sharded_log_ids_mutex);
+    g_sharded_log_ids_used[id] = false;
+}
+
+unsigned detail::sharded_log_generation(std::size_t id)
+{
+    std::lock_guard<std::mutex> lk(g_sharded_log_ids_mutex);
+    return g_sharded_log_generations[id];
+}
+
+void merge_log_shards(
+        std::vector<std::pair<char const*, std::size_t>> const& shards,
+        writer* pwriter)
+{
+    std::vector<shard_cursor> cursors;
+    for(std::size_t i=0; i!=shards.size(); ++i) {
+        shard_cursor cursor;
+        cursor.index = i;
+        cursor.pentry_end = shards[i].first;
+        cursor.pend = shards[i].first + shards[i].second;
+        if(cursor.next())
+            cursors.push_back(cursor);
+    }
+    std::make_heap(cursors.begin(), cursors.end(), later_entry);
+
+    output_buffer buffer(pwriter, 64*1024);
+    while(not cursors.empty()) {
+        std::pop_heap(cursors.begin(), cursors.end(), later_entry);
+        shard_cursor& cursor = cursors.back();
+        buffer.write(cursor.pentry, cursor.pentry_end - cursor.pentry);
+        // Make sure that the last line of one shard doesn't run into the
+        // first line of the next.
+        if(cursor.pentry_end[-1] != '\n')
+            buffer.write('\n');
+        if(cursor.next())
+            std::push_heap(cursors.begin(), cursors.end(), later_entry);
+        else
+            cursors.pop_back();
+    }
+    buffer.flush();
+}
+
+}   // namespace reckless
+
+#ifdef UNIT_TEST
+#include "unit_test.hpp"
+#include <reckless/policy_log.hpp>
+
+namespace reckless {
+
+class sharded_log_suite {
+public:
+    void merge_by_timestamp()
+    {
+        TEST(merge({
+                "I 2024-01-02 10:00:00.001 a1\n"
+                "I 2024-01-02 10:00:00.003 a2\n",
+                "W 2024-01-02 10:00:00.002 b1\n"
+                "W 2024-01-02 10:00:00.004 b2\n"}) ==
+            "I 2024-01-02 10:00:00.001 a1\n"
+            "W 2024-01-02 10:00:00.002 b1\n"
+            "I 2024-01-02 10:00:00.003 a2\n"
+            "W 2024-01-02 10:00:00.004 b2\n");
+    }
+
+    void continuation_lines()
+    {
+        TEST(merge({
+                "2024-01-02 10:00:00.001 a1\n"
+                "  more a1\n"
+                "2024-01-02 10:00:00.003 a2\n",
+                "prefix\n"
+                "2024-01-02 10:00:00.002 b1\n"
+                "  more b1"}) ==
+            "prefix\n"
+            "2024-01-02 10:00:00.001 a1\n"
+            "  more a1\n"
+            "2024-01-02 10:00:00.002 b1\n"
+            "  more b1\n"
+            "2024-01-02 10:00:00.003 a2\n");
+    }
+
+    void ties_in_shard_order()
+    {
+        TEST(merge({
+                "2024-01-02 10:00:00.001 a1\n",
+                "2024-01-02 10:00:00.001 b1\n",
+                "",
+                "2024-01-02 10:00:00.000 c1\n"
+                "2024-01-02 10:00:00.001 c2\n"}) ==
+            "2024-01-02 10:00:00.000 c1\n"
+            "2024-01-02 10:00:00.001 a1\n"
+            "2024-01-02 10:00:00.001 b1\n"
+            "2024-01-02 10:00:00.001 c2\n");
+    }
+
+    void shard_count_limits()
+    {
+        TEST(rejects_shard_count(0));
+        TEST(rejects_shard_count(detail::max_log_shards + 1));
+        sharded_log<policy_log<>> log(3);
+        TEST(log.shard_count() == 3);
+    }
+
+    void new_log_does_not_inherit_shards()
+    {
+        std::size_t id;
+        {
+            sharded_log<policy_log<>> log(2);
+            log.set_thread_shard(1);
+            TEST(&log.shard() == &log.shard(1));
+            id = log.id_;
+        }
+        // The thread was given shard 1 by the old log, but the new one
+        // starts over with shard 0.
+        sharded_log<policy_log<>> log(2);
+        TEST(log.id_ == id);
+        TEST(&log.shard() == &log.shard(0));
+        TEST(&log.shard() == &log.shard(0));
+    }
+
+private:
+    static bool rejects_shard_count(std::size_t shard_count)
+    {
+        try {
+            sharded_log<policy_log<>> log(shard_count);
+        } catch(std::invalid_argument const&) {
+            return true;
+        }
+        return false;
+    }
+
+    class string_writer : public writer {
+    public:
+        Result write(void const* pbuffer, std::size_t count)
+        {
+            str_.append(static_cast<char const*>(pbuffer), count);
+            return SUCCESS;
+        }
+        std::string const& str() const
+        {
+            return str_;
+        }
+    private:
+        std::string str_;
+    };
+
+    static std::string merge(std::vector<std::string> const& texts)
+    {
+        std::vector<std::pair<char const*, std::size_t>> shards;
+        for(std::string const& text : texts)
+            shards.emplace_back(text.data(), text.size());
+        string_writer writer;
+        merge_log_shards(shards, &writer);
+        return writer.str();
+    }
+};
+
+unit_test::suite<sharded_log_suite> sharded_log_tests = {
+    TESTCASE(sharded_log_suite::merge_by_timestamp),
+    TESTCASE(sharded_log_suite::continuation_lines),
+    TESTCASE(sharded_log_suite::ties_in_shard_order),
+    TESTCASE(sharded_log_suite::shard_count_limits),
+    TESTCASE(sharded_log_suite::new_log_does_not_inherit_shards),
+};
+
+}   // namespace reckless
+#endif
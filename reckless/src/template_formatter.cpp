@@ -241,6 +241,21 @@ char const* format(output_buffer* pbuffer, char const* pformat, std::string cons
     return pformat + 1;
 }
 
+char const* format(output_buffer* pbuffer, char const* pformat, inline_string const& v)
+{
+    if(*pformat != 's')
+        return nullptr;
+    pbuffer->write(v.data(), v.size());
+    return pformat + 1;
+}
+
+char const* format(output_buffer* pbuffer, char const* pformat, inline_c_string const& v)
+{
+    if(*pformat == 'p')
+        return format(pbuffer, pformat, v.pointer());
+    return format(pbuffer, pformat, static_cast<inline_string const&>(v));
+}
+
 char const* format(output_buffer* pbuffer, char const* pformat, void const* p)
 {
     char c = *pformat;
@@ -306,3 +321,134 @@ void template_formatter::format(output_buffer* pbuffer, char const* pformat)
 }
 
 }   // namespace reckless
+
+#ifdef UNIT_TEST
+#include "unit_test.hpp"
+#include <reckless/writer.hpp>
+
+namespace reckless {
+namespace detail {
+
+class compiled_format_suite {
+public:
+    compiled_format_suite() :
+        output_buffer_(&writer_, 1024)
+    {
+    }
+
+    void literals()
+    {
+        TEST(compiled(RECKLESS_FORMAT("")) == "");
+        TEST(compiled(RECKLESS_FORMAT("Hello World!")) == "Hello World!");
+        TEST(compiled(RECKLESS_FORMAT("100%%")) == "100%");
+        TEST(compiled(RECKLESS_FORMAT("%%%%x%%y")) == "%%x%y");
+    }
+
+    void integers()
+    {
+        TEST(same(RECKLESS_FORMAT("a %d b"), "a %d b", 17));
+        TEST(same(RECKLESS_FORMAT("%x/%X"), "%x/%X", 0xbeefu, 0xbeefLL));
+        TEST(same(RECKLESS_FORMAT("[%-8d][%08d][%+d][% d]"),
+            "[%-8d][%08d][%+d][% d]", -42, 42, 42, 42));
+        TEST(same(RECKLESS_FORMAT("%#x %.5d"), "%#x %.5d", 255, 3));
+        TEST(same(RECKLESS_FORMAT("%d %d"), "%d %d", static_cast<short>(-3), true));
+    }
+
+    void floats()
+    {
+        TEST(same(RECKLESS_FORMAT("%f"), "%f", 3.14));
+        TEST(same(RECKLESS_FORMAT("%.2f|%10.3f"), "%.2f|%10.3f", 2.5f, -1.0));
+    }
+
+    void characters_and_strings()
+    {
+        std::string s("text");
+        char const* p = "chars";
+        TEST(same(RECKLESS_FORMAT("%s%s%d"), "%s%s%d", 'a', 'b', 'c'));
+        TEST(same(RECKLESS_FORMAT("<%s> <%s>"), "<%s> <%s>", s, p));
+        TEST(same(RECKLESS_FORMAT("%p %p"), "%p %p", p, static_cast<void const*>(p)));
+
+        inline_string is(s.data(), s.size(), false);
+        inline_c_string ics(p, std::strlen(p), false, p);
+        TEST(same(RECKLESS_FORMAT("%s %s %p"), "%s %s %p", is, ics, ics));
+        TEST(runtime("%p", is) == "%p");
+    }
+
+    void custom()
+    {
+        TEST(same(RECKLESS_FORMAT("{%s}"), "{%s}", custom_type()));
+        // A custom formatter that rejects the specification yields the same
+        // output as the runtime-parsed path.
+        TEST(same(RECKLESS_FORMAT("{%5q} end"), "{%5q} end", custom_type()));
+    }
+
+private:
+    struct custom_type {
+    };
+
+    friend char const* format(output_buffer* pbuffer, char const* pformat,
+            custom_type const&)
+    {
+        if(*pformat != 's')
+            return nullptr;
+        pbuffer->write("custom");
+        return pformat + 1;
+    }
+
+    class string_writer : public writer {
+    public:
+        Result write(void const* pbuffer, std::size_t count) override
+        {
+            auto pc = static_cast<char const*>(pbuffer);
+            buffer_.insert(buffer_.end(), pc, pc + count);
+            return SUCCESS;
+        }
+
+        std::string take()
+        {
+            std::string s;
+            s.swap(buffer_);
+            return s;
+        }
+
+    private:
+        std::string buffer_;
+    };
+
+    template <class Format, typename... Args>
+    std::string compiled(Format fmt, Args&&... args)
+    {
+        template_formatter::format(&output_buffer_, fmt, std::forward<Args>(args)...);
+        output_buffer_.flush();
+        return writer_.take();
+    }
+
+    template <typename... Args>
+    std::string runtime(char const* fmt, Args&&... args)
+    {
+        template_formatter::format(&output_buffer_, fmt, std::forward<Args>(args)...);
+        output_buffer_.flush();
+        return writer_.take();
+    }
+
+    template <class Format, typename... Args>
+    bool same(Format compiled_fmt, char const* runtime_fmt, Args const&... args)
+    {
+        return compiled(compiled_fmt, args...) == runtime(runtime_fmt, args...);
+    }
+
+    string_writer writer_;
+    output_buffer output_buffer_;
+};
+
+unit_test::suite<compiled_format_suite> compiled_format_tests = {
+    TESTCASE(compiled_format_suite::literals),
+    TESTCASE(compiled_format_suite::integers),
+    TESTCASE(compiled_format_suite::floats),
+    TESTCASE(compiled_format_suite::characters_and_strings),
+    TESTCASE(compiled_format_suite::custom),
+};
+
+}   // namespace detail
+}   // namespace reckless
+#endif
@@ -1,34 +1,260 @@
 #include <reckless/detail/thread_input_buffer.hpp>
+#include <reckless/detail/formatter_pool.hpp>
+#include <reckless/detail/numa.hpp>
 #include <reckless/detail/utility.hpp>
+#include <algorithm>    // max
+#include <mutex>
+#include <new>          // nothrow
 #include <cassert>
+#include <cstdlib>      // posix_memalign, free
+#include <ciso646>
 
-reckless::detail::thread_input_buffer::thread_input_buffer(std::size_t size) :
-    input_consumed_flag(false),
+#include <unistd.h>         // ftruncate, close, syscall
+#include <sys/mman.h>       // mmap, munmap, madvise
+#include <sys/syscall.h>    // __NR_memfd_create
+
+namespace {
+using reckless::detail::input_segment;
+
+// Released segments are kept here for any thread to reuse, up to a limit, so
+// that a burst doesn't have to go to the heap allocator for every segment.
+std::size_t const SEGMENT_POOL_MAX_BYTES = 1024*1024;
+std::mutex g_segment_pool_mutex;
+input_segment* g_segment_pool;
+std::size_t g_segment_pool_bytes;
+
+input_segment* acquire_segment(std::size_t capacity)
+{
+    {
+        std::lock_guard<std::mutex> lk(g_segment_pool_mutex);
+        for(input_segment** pp = &g_segment_pool; *pp; pp = &(*pp)->pnext) {
+            input_segment* p = *pp;
+            if(p->capacity == capacity) {
+                *pp = p->pnext;
+                g_segment_pool_bytes -= capacity;
+                return p;
+            }
+        }
+    }
+    char* buf = new (std::nothrow) char[sizeof(input_segment) + capacity];
+    if(not buf)
+        return nullptr;
+    auto p = new (buf) input_segment;
+    p->capacity = capacity;
+    return p;
+}
+
+void free_segment(input_segment* p)
+{
+    {
+        std::lock_guard<std::mutex> lk(g_segment_pool_mutex);
+        if(g_segment_pool_bytes + p->capacity <= SEGMENT_POOL_MAX_BYTES) {
+            p->pnext = g_segment_pool;
+            g_segment_pool = p;
+            g_segment_pool_bytes += p->capacity;
+            return;
+        }
+    }
+    delete [] static_cast<char*>(static_cast<void*>(p));
+}
+
+// Maps a region of the given size (a multiple of the page size) twice in a
+// row, backed by the same memory, and returns its start. Returns nullptr if
+// that can't be done.
+char* map_mirrored_ring(std::size_t size)
+{
+    int fd = static_cast<int>(syscall(__NR_memfd_create, "reckless", 0));
+    if(fd == -1)
+        return nullptr;
+    void* paddress = MAP_FAILED;
+    if(0 == ftruncate(fd, static_cast<off_t>(size))) {
+        // Reserve room for both mappings first, so that nothing else can end
+        // up between them.
+        paddress = mmap(nullptr, 2*size, PROT_NONE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    }
+    if(paddress != MAP_FAILED) {
+        char* p = static_cast<char*>(paddress);
+        if(MAP_FAILED == mmap(p, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_FIXED, fd, 0)
+            or MAP_FAILED == mmap(p + size, size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_FIXED, fd, 0))
+        {
+            munmap(p, 2*size);
+            paddress = MAP_FAILED;
+        }
+    }
+    close(fd);
+    if(paddress == MAP_FAILED)
+        return nullptr;
+    return static_cast<char*>(paddress);
+}
+}
+
+reckless::detail::thread_input_buffer*
+reckless::detail::thread_input_buffer::create(std::size_t size,
+        bool mirrored, int numa_node, memory_provider* pprovider)
+{
+    if(not pprovider)
+        pprovider = default_memory_provider();
+    std::size_t page_size = get_page_size();
+    char* pmirrored_ring = nullptr;
+    if(mirrored) {
+        std::size_t mirrored_size = (size + page_size - 1)/page_size*page_size;
+        pmirrored_ring = map_mirrored_ring(mirrored_size);
+        if(pmirrored_ring) {
+            size = mirrored_size;
+            // Both mappings share the same pages, so placing one is enough.
+            if(numa_node != -1)
+                place_on_numa_node(pmirrored_ring, size, numa_node);
+        }
+    }
+    std::size_t full_size = sizeof(thread_input_buffer);
+    if(not pmirrored_ring)
+        full_size += size - sizeof(formatter_dispatch_function_t*);
+    std::size_t alignment = CACHE_LINE_SIZE;
+    if(numa_node != -1) {
+        // The buffer gets whole pages of its own, so that placing them
+        // doesn't move anything else.
+        full_size = (full_size + page_size - 1)/page_size*page_size;
+        alignment = page_size;
+    }
+    char* buf = static_cast<char*>(pprovider->allocate(full_size, alignment));
+    if(not buf) {
+        if(pmirrored_ring)
+            munmap(pmirrored_ring, 2*size);
+        throw std::bad_alloc();
+    }
+    if(numa_node != -1)
+        place_on_numa_node(buf, full_size, numa_node);
+    return new (buf) thread_input_buffer(size, pmirrored_ring, numa_node,
+            pprovider, full_size);
+}
+
+void reckless::detail::thread_input_buffer::destroy(thread_input_buffer* p)
+{
+    memory_provider* pprovider = p->pprovider_;
+    std::size_t allocated_size = p->allocated_size_;
+    p->~thread_input_buffer();
+    pprovider->deallocate(p, allocated_size);
+}
+
+reckless::detail::thread_input_buffer::thread_input_buffer(std::size_t size,
+        char* pmirrored_ring, int numa_node, memory_provider* pprovider,
+        std::size_t allocated_size) :
+    polled_flag(false),
+    abandoned_flag(false),
+    pnext_retired(nullptr),
+    pool_id(0),
+    numa_node(numa_node),
+    unreported_dropped_messages(0),
+    has_overflow_policy(false),
+    dropped_messages(0),
+    stall_count(0),
+    requested_capacity(0),
+    handle_count(0),
     size_(size),
+    pring_(pmirrored_ring? pmirrored_ring :
+        static_cast<char*>(static_cast<void*>(&buffer_start_))),
+    mirrored_(pmirrored_ring != nullptr),
+    pprovider_(pprovider),
+    allocated_size_(allocated_size),
+    segment_bytes_(0),
+    pinput_end_(buffer_start()),
+    pcached_input_start_(buffer_start()),
+    ppublished_end_(buffer_start()),
+    psegment_(nullptr),
+    pring_exit_(nullptr),
     pinput_start_(buffer_start()),
-    pinput_end_(buffer_start())
+    pconsumer_segment_(nullptr),
+    input_consumed_flag(false)
+{
+}
+
+void reckless::detail::thread_input_buffer::recycle()
 {
+    // As in the destructor, the segment that the owner stopped in is ours
+    // to release. Everything in it has been consumed.
+    if(psegment_)
+        release_segment(psegment_);
+    polled_flag.store(false, std::memory_order_relaxed);
+    abandoned_flag.store(false, std::memory_order_relaxed);
+    pnext_retired = nullptr;
+    has_overflow_policy = false;
+    dropped_messages = 0;
+    unreported_dropped_messages.store(0, std::memory_order_relaxed);
+    stall_count = 0;
+    requested_capacity = 0;
+    handle_count = 0;
+    pinput_end_ = buffer_start();
+    pcached_input_start_ = buffer_start();
+    ppublished_end_.store(buffer_start(), std::memory_order_relaxed);
+    psegment_ = nullptr;
+    pring_exit_ = nullptr;
+    pinput_start_.store(buffer_start(), std::memory_order_relaxed);
+    pconsumer_segment_ = nullptr;
+    input_consumed_flag = false;
+}
+
+void reckless::detail::thread_input_buffer::release_ring_memory()
+{
+    if(mirrored_) {
+        // The ring is shared memory, which is only freed by punching a
+        // hole in it.
+        madvise(pring_, size_, MADV_REMOVE);
+        return;
+    }
+    // Only whole pages can be released, and the ones at the ends of the
+    // ring are shared with the fields above it and with other memory.
+    std::size_t page_size = get_page_size();
+    auto begin = (reinterpret_cast<std::uintptr_t>(pring_) + page_size - 1)
+        / page_size*page_size;
+    auto end = (reinterpret_cast<std::uintptr_t>(pring_) + size_)
+        / page_size*page_size;
+    if(begin < end)
+        madvise(reinterpret_cast<void*>(begin), end - begin, MADV_DONTNEED);
+}
+
+bool reckless::detail::thread_input_buffer::prefault_ring()
+{
+    if(psegment_ != nullptr
+            or pinput_start_.load(std::memory_order_acquire) != pinput_end_)
+        return false;
+    // Reading isn't enough, since that just maps the zero page. Nothing in
+    // the ring is in use, so what we write doesn't matter.
+    std::size_t page_size = get_page_size();
+    char volatile* pring = pring_;
+    for(std::size_t offset=0; offset < size_; offset += page_size)
+        pring[offset] = 0;
+    pring[size_-1] = 0;
+    return true;
 }
 
 reckless::detail::thread_input_buffer::~thread_input_buffer()
 {
-    // FIXME I don't think we are properly waiting until the output
-    // worker has cleared this from touched_input_buffers. Which means
-    // it can call signal_input_consumed on a dangling pointer. We need
-    // to either get rid of touched_input_buffer or make sure we wait
-    // for the right thing here.
-    //
-    // Actually, even if we don't have touched_input_buffers, there is a race
-    // between the call to discard_input_frame() and signal_input_consumed().
-    // If this dtor runs between them, then signal_input_consumed will be
-    // called on a dangling pointer.
- 
+    // Buffers that are still in use are handed over to the output thread,
+    // which destroys them once it has drained them and forgotten about them
+    // (see basic_log.cpp). The waits below are for buffers that are
+    // destroyed while the log is closed, and should be over right away.
+
+    // An output thread that polls the buffer may look at it until it lets
+    // go, which it doesn't do until it has drained it. It clears the flag as
+    // the very last thing, so we can't count on being signaled afterwards.
+    while(polled_flag.load(std::memory_order_acquire))
+        input_consumed_event_.wait(1);
+
     // Wait for the output thread to consume all the contents of the buffer
     // before release it.
     // Both write() and wait_input_consumed should create full memory barriers,
     // so no need for strict memory ordering in this load.
     while(pinput_start_.load(std::memory_order_relaxed) != pinput_end_)
         wait_input_consumed();
+    // The output thread never leaves the segment that we stopped in, since
+    // there is no marker at the end of it. So it is up to us to release it.
+    if(psegment_)
+        release_segment(psegment_);
+    if(mirrored_)
+        munmap(pring_, 2*size_);
 }
 
 char* reckless::detail::thread_input_buffer::discard_input_frame(std::size_t size)
@@ -40,7 +266,10 @@ char* reckless::detail::thread_input_buffer::discard_input_frame(std::size_t siz
     // all it does is *discard* data, not provide any new data (besides,
     // signaling the event is likely to create a full memory barrier anyway).
     auto p = pinput_start_.load(std::memory_order_relaxed);
-    p = advance_frame_pointer(p, size);
+    if(pconsumer_segment_)
+        p += size;      // Segments don't wrap around.
+    else
+        p = advance_frame_pointer(p, size);
     pinput_start_.store(p, std::memory_order_relaxed);
     return p;
 }
@@ -56,6 +285,49 @@ char* reckless::detail::thread_input_buffer::wraparound()
     return buffer_start();
 }
 
+char* reckless::detail::thread_input_buffer::next_segment()
+{
+#ifndef NDEBUG
+    auto pmarker = pinput_start_.load(std::memory_order_relaxed);
+    auto marker = *reinterpret_cast<formatter_dispatch_function_t**>(pmarker);
+    assert(SEGMENT_MARKER == marker);
+#endif
+    input_segment* pcurrent = pconsumer_segment_;
+    input_segment* pnext = pcurrent? pcurrent->pnext : pring_exit_;
+    char* p = pnext? pnext->data() : buffer_start();
+    pconsumer_segment_ = pnext;
+    // Move away from the segment before releasing it, or the producer could
+    // mistake our position for one in a new segment at the same address.
+    pinput_start_.store(p, std::memory_order_relaxed);
+    if(pcurrent)
+        release_segment(pcurrent);
+    return p;
+}
+
+void reckless::detail::thread_input_buffer::release_segment(
+        input_segment* psegment)
+{
+    segment_bytes_.fetch_sub(psegment->capacity, std::memory_order_relaxed);
+    free_segment(psegment);
+}
+
+// Releases the segments that were chained after psegment (or after the ring,
+// if it is nullptr), up to and including the current one. None of them have
+// been committed, so the output thread doesn't know about them.
+void reckless::detail::thread_input_buffer::release_segments_after(
+        input_segment* psegment)
+{
+    input_segment* p = psegment;
+    while(p != psegment_) {
+        input_segment* pnext = p? p->pnext : pring_exit_;
+        if(p and p != psegment)
+            release_segment(p);
+        p = pnext;
+    }
+    if(p)
+        release_segment(p);
+}
+
 // Moves an input-buffer pointer forward by the given distance while
 // maintaining the invariant that:
 //
@@ -65,25 +337,27 @@ char* reckless::detail::thread_input_buffer::wraparound()
 //
 // The distance must never be so great that the pointer moves *past* the end of
 // the buffer. To do so would be an error in our context, since no input frame
-// is allowed to be discontinuous.
+// is allowed to be discontinuous. The exception is a mirrored ring, where a
+// frame that continues past the end is really continuing at the start.
 char* reckless::detail::thread_input_buffer::advance_frame_pointer(char* p, std::size_t distance)
 {
     assert(is_aligned(p));
     assert(is_aligned(distance));
     p += distance;
-    assert(size_ >= static_cast<std::size_t>(p - buffer_start()));
-    auto remaining = size_ - (p - buffer_start());
-    if(remaining == 0)
-        p = buffer_start();
+    assert(mirrored_ or size_ >= static_cast<std::size_t>(p - buffer_start()));
+    if(static_cast<std::size_t>(p - buffer_start()) >= size_)
+        p -= size_;
     return p;
 }
 
-// TODO inline this function? Maybe not considering that fixme.
-void reckless::detail::thread_input_buffer::wait_input_consumed()
+void reckless::detail::thread_input_buffer::wait_input_consumed(
+        spsc_event* pdoorbell)
 {
-    // FIXME we need to think about what to do here, should we signal
-    // g_shared_input_queue_full_event to force the output thread to wake up?
-    // We probably should, or we could sit here for a full second.
+    // An idle output thread may otherwise sleep for as long as the maximum
+    // idle wait before it gets to our input. Signaling it costs nothing
+    // unless it is actually asleep.
+    if(pdoorbell)
+        pdoorbell->signal();
     input_consumed_event_.wait();
 }
 
@@ -92,7 +366,123 @@ void reckless::detail::thread_input_buffer::signal_input_consumed()
     input_consumed_event_.signal();
 }
 
-char* reckless::detail::thread_input_buffer::allocate_input_frame(std::size_t size)
+char* reckless::detail::thread_input_buffer::allocate_input_frame(
+        std::size_t size, std::size_t growth_limit,
+        formatter_pool* pformatter_pool, spsc_event* pdoorbell)
+{
+    bool stalled = false;
+    while(true) {
+        char* pframe = try_allocate_input_frame(size);
+        if(likely(pframe != nullptr))
+            return pframe;
+        pframe = try_allocate_segment_frame(size, growth_limit);
+        if(pframe != nullptr)
+            return pframe;
+        // Not enough room. Wait for the output thread to consume some input,
+        // or lend it a hand if it lets us.
+        if(not stalled) {
+            ++stall_count;
+            stalled = true;
+        }
+        if(not (pformatter_pool and pformatter_pool->help()))
+            wait_input_consumed(pdoorbell);
+    }
+}
+
+char* reckless::detail::thread_input_buffer::try_allocate_input_frame(
+        std::size_t size, std::size_t reserve)
+{
+    auto mask = frame_alignment_mask();
+    size = (size + mask) & ~mask;
+    if(unlikely(psegment_ != nullptr))
+        return try_allocate_in_segment(size, reserve);
+    return try_allocate_ring_frame(size, reserve);
+}
+
+char* reckless::detail::thread_input_buffer::try_allocate_segment_frame(
+        std::size_t size, std::size_t growth_limit)
+{
+    auto mask = frame_alignment_mask();
+    size = (size + mask) & ~mask;
+    // Leave room for the marker after the last frame.
+    std::size_t capacity = std::max(size_, size + mask + 1);
+    std::size_t in_use = segment_bytes_.load(std::memory_order_relaxed);
+    if(in_use + capacity > growth_limit) {
+        // An oversized frame can only go in a segment, so we allow it as
+        // soon as the output thread has caught up.
+        bool oversized = capacity > size_;
+        bool drained = pinput_start_.load(std::memory_order_relaxed)
+            == pinput_end_;
+        if(not (oversized and drained))
+            return nullptr;
+    }
+
+    input_segment* psegment = acquire_segment(capacity);
+    if(not psegment)
+        return nullptr;
+    psegment->pnext = nullptr;
+    segment_bytes_.fetch_add(capacity, std::memory_order_relaxed);
+    write_segment_marker(psegment);
+    char* pframe = pinput_end_;
+    pinput_end_ += size;
+    return pframe;
+}
+
+// Writes a SEGMENT_MARKER at the current position and continues in the given
+// segment, or at the start of the ring if it is nullptr. There is always room
+// for the marker, for the same reason that there is always room for a
+// wraparound marker.
+void reckless::detail::thread_input_buffer::write_segment_marker(
+        input_segment* pnext)
+{
+    if(psegment_)
+        psegment_->pnext = pnext;
+    else
+        pring_exit_ = pnext;
+    *reinterpret_cast<formatter_dispatch_function_t**>(pinput_end_) =
+        SEGMENT_MARKER;
+    psegment_ = pnext;
+    pinput_end_ = pnext? pnext->data() : buffer_start();
+}
+
+char* reckless::detail::thread_input_buffer::try_allocate_in_segment(
+        std::size_t size, std::size_t reserve)
+{
+    char* pinput_end = pinput_end_;
+    if(pinput_start_.load(std::memory_order_relaxed) == pinput_end
+            and size + reserve < size_)
+    {
+        // The output thread has caught up, so the burst is over. Go back to
+        // the (now empty) ring, which lets the output thread release the
+        // segment once it follows the marker. The frame is sure to fit, so
+        // the marker is never left without a frame after it.
+        write_segment_marker(nullptr);
+        return try_allocate_ring_frame(size, reserve);
+    }
+    std::size_t remaining = psegment_->data() + psegment_->capacity
+        - pinput_end;
+    if(likely(size < remaining)) {
+        pinput_end_ = pinput_end + size;
+        return pinput_end;
+    }
+    return nullptr;
+}
+
+char* reckless::detail::thread_input_buffer::try_allocate_ring_frame(
+        std::size_t size, std::size_t reserve)
+{
+    // Most of the time there is room according to where the output thread
+    // was the last time we looked, and we don't have to touch the cache line
+    // where it keeps its position.
+    char* pframe = fit_ring_frame(size, reserve, pcached_input_start_);
+    if(likely(pframe != nullptr))
+        return pframe;
+    pcached_input_start_ = pinput_start_.load(std::memory_order_relaxed);
+    return fit_ring_frame(size, reserve, pcached_input_start_);
+}
+
+char* reckless::detail::thread_input_buffer::fit_ring_frame(
+        std::size_t size, std::size_t reserve, char* pinput_start)
 {
     // Conceptually, we have the invariant that
     //   pinput_start_ <= pinput_end_,
@@ -110,78 +500,210 @@ char* reckless::detail::thread_input_buffer::allocate_input_frame(std::size_t si
     //   
     // (This is easier to understand by drawing it on a paper than by reading
     // the comment text).
-    auto mask = frame_alignment_mask();
-    size = (size + mask) & ~mask;
+    // A frame that is as large as the ring will not fit in the checks below,
+    // and has to go in a segment of its own.
+    auto pinput_end = pinput_end_;
+    // FIXME these asserts should / can be enabled again?
+    assert(static_cast<std::size_t>(pinput_end - buffer_start()) < size_);
+    assert(is_aligned(pinput_end));
 
-    // We can't write a frame that is larger than the entire capacity of the
-    // input buffer. If you hit this assert then you either need to write a
-    // smaller log entry, or you need to make the input buffer larger.
-    assert(size < size_);
- 
-    while(true) {
-        auto pinput_end = pinput_end_;
-        // FIXME these asserts should / can be enabled again?
-        assert(static_cast<std::size_t>(pinput_end - buffer_start()) < size_);
-        assert(is_aligned(pinput_end));
-
-        // Even if we get an "old" value for pinput_start_ here, that's OK
-        // because other threads will never cause the amount of available
-        // buffer space to shrink. So either there is enough buffer space and
-        // we're done, or there isn't and we'll wait for an input-consumption
-        // event which creates a full memory barrier and hence gives us an
-        // updated value for pinput_start_. So memory_order_relaxed should be
-        // fine here.
-        auto pinput_start = pinput_start_.load(std::memory_order_relaxed);
-        std::ptrdiff_t free = pinput_start - pinput_end;
-        if(free > 0) {
-            // Free space is contiguous.
-            // Technically, there is enough room if size == free. But the
-            // problem with using the free space in this situation is that when
-            // we increase pinput_end_ by size, we end up with pinput_start_ ==
-            // pinput_end_. Now, given that state, how do we know if the buffer
-            // is completely filled or empty? So, it's easier to just check for
-            // size < free instead of size <= free, and pretend we're out
-            // of space if size == free. Same situation applies in the else
-            // clause below.
-            if(likely(static_cast<std::ptrdiff_t>(size) < free)) {
-                pinput_end_ = advance_frame_pointer(pinput_end, size);
-                return pinput_end;
-            } else {
-                // Not enough room. Wait for the output thread to consume some
-                // input.
-                wait_input_consumed();
-            }
+    // Even if we get an "old" value for pinput_start here, that's OK
+    // because other threads will never cause the amount of available
+    // buffer space to shrink. So either there is enough buffer space and
+    // we're done, or there isn't and the caller will wait for an
+    // input-consumption event which creates a full memory barrier and hence
+    // gives us an updated value for pinput_start_. So memory_order_relaxed
+    // should be fine for loading it.
+    // If the output thread is still in a segment, then it has yet to follow
+    // the marker that leads back to the start of the ring; we only come back
+    // to the ring once it has consumed everything before that marker.
+    if(unlikely(not is_in_ring(pinput_start)))
+        pinput_start = buffer_start();
+    std::ptrdiff_t free = pinput_start - pinput_end;
+    if(mirrored_) {
+        // Frames may continue past the end of the ring, so all free space is
+        // contiguous. The same reasoning as below applies for requiring
+        // size < free rather than size <= free.
+        std::size_t total_free = free > 0? free : size_ + free;
+        if(size + reserve >= total_free)
+            return nullptr;
+        pinput_end_ = advance_frame_pointer(pinput_end, size);
+        return pinput_end;
+    }
+    if(reserve != 0) {
+        // This is a rough check that ignores the space that may be lost to a
+        // wraparound, which is fine for its purpose of keeping some space
+        // available for more important frames.
+        std::size_t total_free = free > 0? free : size_ + free;
+        if(size + reserve >= total_free)
+            return nullptr;
+    }
+    if(free > 0) {
+        // Free space is contiguous.
+        // Technically, there is enough room if size == free. But the
+        // problem with using the free space in this situation is that when
+        // we increase pinput_end_ by size, we end up with pinput_start_ ==
+        // pinput_end_. Now, given that state, how do we know if the buffer
+        // is completely filled or empty? So, it's easier to just check for
+        // size < free instead of size <= free, and pretend we're out
+        // of space if size == free. Same situation applies in the else
+        // clause below.
+        if(likely(static_cast<std::ptrdiff_t>(size) < free)) {
+            pinput_end_ = advance_frame_pointer(pinput_end, size);
+            return pinput_end;
         } else {
-            // Free space is non-contiguous.
-            // TODO should we use an end pointer instead of a size_?
-            std::size_t free1 = size_ - (pinput_end - buffer_start());
-            if(likely(size < free1)) {
-                // There's enough room in the first segment.
-                pinput_end_ = advance_frame_pointer(pinput_end, size);
-                return pinput_end;
+            return nullptr;
+        }
+    } else {
+        // Free space is non-contiguous.
+        // TODO should we use an end pointer instead of a size_?
+        std::size_t free1 = size_ - (pinput_end - buffer_start());
+        if(likely(size < free1)) {
+            // There's enough room in the first segment.
+            pinput_end_ = advance_frame_pointer(pinput_end, size);
+            return pinput_end;
+        } else {
+            std::size_t free2 = pinput_start - buffer_start();
+            if(likely(size < free2)) {
+                // We don't have enough room for a continuous input frame
+                // in the first segment (at the end of the circular
+                // buffer), but there is enough room in the second segment
+                // (at the beginning of the buffer). To instruct the output
+                // thread to skip ahead to the second segment, we need to
+                // put a marker value at the current position. We're
+                // supposed to be guaranteed enough room for the wraparound
+                // marker because frame alignment is at least the size of
+                // the marker.
+                *reinterpret_cast<formatter_dispatch_function_t**>(pinput_end_) =
+                    WRAPAROUND_MARKER;
+                pinput_end_ = advance_frame_pointer(buffer_start(), size);
+                return buffer_start();
             } else {
-                std::size_t free2 = pinput_start - buffer_start();
-                if(likely(size < free2)) {
-                    // We don't have enough room for a continuous input frame
-                    // in the first segment (at the end of the circular
-                    // buffer), but there is enough room in the second segment
-                    // (at the beginning of the buffer). To instruct the output
-                    // thread to skip ahead to the second segment, we need to
-                    // put a marker value at the current position. We're
-                    // supposed to be guaranteed enough room for the wraparound
-                    // marker because frame alignment is at least the size of
-                    // the marker.
-                    *reinterpret_cast<formatter_dispatch_function_t**>(pinput_end_) =
-                        WRAPAROUND_MARKER;
-                    pinput_end_ = advance_frame_pointer(buffer_start(), size);
-                    return buffer_start();
-                } else {
-                    // Not enough room. Wait for the output thread to consume
-                    // some input.
-                    wait_input_consumed();
-                }
+                return nullptr;
             }
         }
     }
 }
 
+std::size_t reckless::detail::consume_input(output_buffer* poutput,
+        thread_input_buffer* pbuffer, char* pinput_end,
+        std::vector<thread_input_buffer*>* ptouched_input_buffers)
+{
+    char* pinput_start = pbuffer->input_start();
+    if(pinput_start == pinput_end)
+        return 0;
+    std::size_t consumed = 0;
+    do {
+        auto pdispatch = *reinterpret_cast<formatter_dispatch_function_t**>(pinput_start);
+        // There are no wraparound markers in a mirrored ring, and segment
+        // markers only come with bursts, so this is rarely taken.
+        if(unlikely(is_marker(pdispatch))) {
+            if(WRAPAROUND_MARKER == pdispatch)
+                pinput_start = pbuffer->wraparound();
+            else
+                pinput_start = pbuffer->next_segment();
+            pdispatch = *reinterpret_cast<formatter_dispatch_function_t**>(pinput_start);
+        }
+        auto frame_size = (*pdispatch)(poutput, pinput_start);
+        pinput_start = pbuffer->discard_input_frame(frame_size);
+        consumed += frame_size;
+    } while(pinput_start != pinput_end);
+    mark_input_consumed(pbuffer, ptouched_input_buffers);
+    return consumed;
+}
+
+#ifdef UNIT_TEST
+#include "unit_test.hpp"
+
+#include <cstring>      // memset
+
+namespace reckless {
+namespace detail {
+
+class thread_input_buffer_suite {
+public:
+    void fields_are_grouped_by_writer()
+    {
+        thread_input_buffer* p = thread_input_buffer::create(4096);
+        // Producer, consumer, read-mostly fields and the ring never share a
+        // cache line.
+        TEST(not same_cache_line(&p->ppublished_end_, &p->pinput_start_));
+        TEST(not same_cache_line(&p->pring_exit_, &p->pinput_start_));
+        TEST(not same_cache_line(&p->segment_bytes_, &p->pinput_end_));
+        TEST(not same_cache_line(&p->input_consumed_flag, p->pring_));
+        TEST(not same_cache_line(&p->pinput_end_, p->pring_));
+        thread_input_buffer::destroy(p);
+    }
+
+    void wraparound()
+    {
+        thread_input_buffer* p = thread_input_buffer::create(256);
+        char* pring = p->buffer_start();
+        TEST(p->try_allocate_input_frame(64) == pring);
+        TEST(p->try_allocate_input_frame(64) == pring + 64);
+        TEST(p->discard_input_frame(64) == pring + 64);
+
+        // There is room according to the cached consumer position, so the
+        // producer doesn't look at the real one.
+        TEST(p->try_allocate_input_frame(64) == pring + 128);
+        TEST(p->pcached_input_start_ == pring);
+        // Now it has to, and there is still no room.
+        TEST(p->try_allocate_input_frame(64) == nullptr);
+        TEST(p->pcached_input_start_ == pring + 64);
+
+        TEST(p->discard_input_frame(64) == pring + 128);
+        TEST(p->try_allocate_input_frame(48) == pring + 192);
+        // The next frame doesn't fit before the end of the ring and goes to
+        // the start, behind a marker.
+        TEST(p->try_allocate_input_frame(48) == pring);
+        TEST(*reinterpret_cast<formatter_dispatch_function_t**>(pring + 240)
+                == WRAPAROUND_MARKER);
+        TEST(p->input_end() == pring + 48);
+
+        TEST(p->discard_input_frame(64) == pring + 192);
+        TEST(p->discard_input_frame(48) == pring + 240);
+        TEST(p->wraparound() == pring);
+        TEST(p->discard_input_frame(48) == p->input_end());
+        thread_input_buffer::destroy(p);
+    }
+
+    void mirrored_ring()
+    {
+        thread_input_buffer* p = thread_input_buffer::create(4096, true);
+        TEST(p->is_mirrored());
+        char* pring = p->buffer_start();
+        TEST(p->try_allocate_input_frame(3000) == pring);
+        TEST(p->discard_input_frame(3000) == pring + 3000);
+        // A frame that continues past the end of the ring, without a marker,
+        // is found at the start of the ring too.
+        char* pframe = p->try_allocate_input_frame(2000);
+        TEST(pframe == pring + 3000);
+        std::memset(pframe, 'x', 2000);
+        TEST(p->input_end() == pring + 904);
+        TEST(pring[0] == 'x' and pring[903] == 'x');
+        TEST(p->discard_input_frame(2000) == pring + 904);
+        // The whole ring but one frame alignment can be used.
+        TEST(p->try_allocate_input_frame(4088) == pring + 904);
+        TEST(p->try_allocate_input_frame(8) == nullptr);
+        TEST(p->discard_input_frame(4088) == p->input_end());
+        thread_input_buffer::destroy(p);
+    }
+
+private:
+    static bool same_cache_line(void const* a, void const* b)
+    {
+        auto line = thread_input_buffer::CACHE_LINE_SIZE;
+        return reinterpret_cast<std::uintptr_t>(a)/line
+            == reinterpret_cast<std::uintptr_t>(b)/line;
+    }
+};
+
+unit_test::suite<thread_input_buffer_suite> thread_input_buffer_tests = {
+    TESTCASE(thread_input_buffer_suite::fields_are_grouped_by_writer),
+    TESTCASE(thread_input_buffer_suite::wraparound),
+    TESTCASE(thread_input_buffer_suite::mirrored_ring),
+};
+
+}   // namespace detail
+}   // namespace reckless
+#endif
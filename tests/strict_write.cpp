@@ -0,0 +1,143 @@
+// Checks that strict_write never makes a system call. The writing thread
+// installs a seccomp filter that traps every system call it makes (except
+// for returning from the signal handler and exiting the thread) and counts
+// them, and then writes a few million log entries in each commit mode.
+#include <reckless/policy_log.hpp>
+#include <reckless/file_writer.hpp>
+#include <atomic>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cstring>
+#include <cstddef>      // offsetof
+
+#include <signal.h>
+#include <unistd.h>     // syscall
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/seccomp.h>
+
+// Arguments that might allocate memory are rejected at compile time.
+static_assert(reckless::detail::is_strict_argument<int>::value, "");
+static_assert(reckless::detail::is_strict_argument<
+        reckless::inline_string>::value, "");
+static_assert(not reckless::detail::is_strict_argument<
+        std::vector<int>>::value, "");
+
+namespace {
+unsigned const WRITE_COUNT = 2000000;
+
+std::atomic<unsigned> g_syscall_count(0);
+volatile int g_first_syscall = -1;
+
+void sigsys_handler(int, siginfo_t* pinfo, void*)
+{
+    if(g_syscall_count.fetch_add(1, std::memory_order_relaxed) == 0)
+        g_first_syscall = pinfo->si_syscall;
+}
+
+bool trap_system_calls()
+{
+    sock_filter filter[] = {
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, arch)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, AUDIT_ARCH_X86_64, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRAP),
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, nr)),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_rt_sigreturn, 2, 0),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_exit, 1, 0),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_TRAP),
+        BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+    };
+    sock_fprog program = {
+        static_cast<unsigned short>(sizeof(filter)/sizeof(filter[0])),
+        filter
+    };
+    if(0 != prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0))
+        return false;
+    return 0 == prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program);
+}
+
+// Counts the log entries in the file, and adds up the counts in the
+// "messages dropped" notices in between.
+void read_log(char const* path, std::size_t* pkept, std::size_t* preported)
+{
+    std::ifstream in(path);
+    std::string line;
+    *pkept = 0;
+    *preported = 0;
+    while(std::getline(in, line)) {
+        std::size_t count;
+        int end = -1;
+        if(1 == std::sscanf(line.c_str(), "%zu messages dropped%n", &count,
+                    &end) and end == static_cast<int>(line.size()))
+        {
+            *preported += count;
+        } else {
+            ++*pkept;
+        }
+    }
+}
+
+bool run(char const* name, reckless::commit_mode mode)
+{
+    char const* path = "log.txt";
+    std::remove(path);
+    reckless::file_writer writer(path);
+    reckless::policy_log<> log;
+    log.set_commit_mode(mode);
+    log.open(&writer);
+
+    g_syscall_count.store(0, std::memory_order_relaxed);
+    g_first_syscall = -1;
+    bool trapped = false;
+    std::size_t dropped = 0;
+    std::thread thread([&]()
+    {
+        log.warm_up();
+        trapped = trap_system_calls();
+        if(not trapped)
+            return;
+        std::string s("string");
+        for(unsigned i=0; i!=WRITE_COUNT; ++i)
+            log.strict_write("%u %s %s %.1f", i, "c string", s, 0.5*i);
+        dropped = log.dropped_messages();
+        // Returning would make system calls as the thread cleans up. The
+        // kernel still lets join() know that the thread is gone.
+        syscall(SYS_exit, 0);
+    });
+    thread.join();
+    log.close();
+
+    if(not trapped) {
+        std::printf("%s: can't install seccomp filter\n", name);
+        return false;
+    }
+    unsigned syscall_count = g_syscall_count.load(std::memory_order_relaxed);
+    std::size_t kept, reported;
+    read_log(path, &kept, &reported);
+    std::printf("%s: %u system calls (first %d), %zu written, %zu dropped, "
+            "%zu reported\n", name, syscall_count, g_first_syscall, kept,
+            dropped, reported);
+    return syscall_count == 0 and kept == WRITE_COUNT - dropped
+        and reported == dropped;
+}
+}
+
+int main()
+{
+    struct sigaction act;
+    std::memset(&act, 0, sizeof(act));
+    act.sa_sigaction = &sigsys_handler;
+    act.sa_flags = SA_SIGINFO;
+    sigaction(SIGSYS, &act, nullptr);
+
+    bool ok = run("shared_queue", reckless::commit_mode::shared_queue);
+    ok &= run("polled_buffers", reckless::commit_mode::polled_buffers);
+    ok &= run("merged_buffers", reckless::commit_mode::merged_buffers);
+    std::printf("%s\n", ok? "OK" : "FAILED");
+    return ok? 0 : 1;
+}
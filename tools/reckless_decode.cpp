@@ -0,0 +1,95 @@
+// Renders a log written by reckless::binary_log as text.
+//
+// Usage: reckless_decode [-j THREADS] INPUT [OUTPUT]
+//
+// The text goes to standard output unless OUTPUT is given, in which case it
+// is appended to that file.
+#include <reckless/binary_log.hpp>
+#include <reckless/file_writer.hpp>
+
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <cstdlib>      // strtoul
+#include <cstring>      // strcmp
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+class stdout_writer : public reckless::writer {
+public:
+    Result write(void const* pbuffer, std::size_t count)
+    {
+        char const* p = static_cast<char const*>(pbuffer);
+        while(count != 0) {
+            ssize_t written = ::write(STDOUT_FILENO, p, count);
+            if(written == -1)
+                return ERROR_GIVE_UP;
+            p += written;
+            count -= written;
+        }
+        return SUCCESS;
+    }
+};
+
+int usage()
+{
+    std::cerr << "usage: reckless_decode [-j THREADS] INPUT [OUTPUT]" << std::endl;
+    return 2;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned thread_count = 0;
+    int arg = 1;
+    if(arg + 1 < argc and std::strcmp(argv[arg], "-j") == 0) {
+        thread_count = static_cast<unsigned>(std::strtoul(argv[arg + 1], nullptr, 10));
+        arg += 2;
+    }
+    if(arg == argc or argc - arg > 2)
+        return usage();
+    char const* input_path = argv[arg];
+    char const* output_path = arg + 1 < argc? argv[arg + 1] : nullptr;
+
+    int fd = open(input_path, O_RDONLY);
+    struct stat st;
+    if(fd == -1 or fstat(fd, &st) == -1) {
+        std::cerr << "reckless_decode: cannot open " << input_path << std::endl;
+        return 1;
+    }
+    std::size_t size = static_cast<std::size_t>(st.st_size);
+    void* pdata = nullptr;
+    if(size != 0) {
+        pdata = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(pdata == MAP_FAILED) {
+            std::cerr << "reckless_decode: cannot map " << input_path << std::endl;
+            return 1;
+        }
+        madvise(pdata, size, MADV_SEQUENTIAL);
+    }
+    close(fd);
+
+    try {
+        std::unique_ptr<reckless::writer> pwriter;
+        if(output_path)
+            pwriter.reset(new reckless::file_writer(output_path));
+        else
+            pwriter.reset(new stdout_writer());
+        std::size_t decoded = reckless::decode_binary_log(pdata, size,
+                pwriter.get(), thread_count);
+        if(decoded != size) {
+            std::cerr << "reckless_decode: ignoring incomplete record at offset "
+                << decoded << std::endl;
+        }
+    } catch(std::exception const& e) {
+        std::cerr << "reckless_decode: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,94 @@
+// Merges the files written by the shards of a reckless::sharded_log into one
+// text log, ordered by timestamp.
+//
+// Usage: reckless_merge [-o OUTPUT] SHARD...
+//
+// The text goes to standard output unless OUTPUT is given, in which case it
+// is appended to that file.
+#include <reckless/sharded_log.hpp>
+#include <reckless/file_writer.hpp>
+
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include <utility>      // pair
+#include <cstring>      // strcmp
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace {
+
+class stdout_writer : public reckless::writer {
+public:
+    Result write(void const* pbuffer, std::size_t count)
+    {
+        char const* p = static_cast<char const*>(pbuffer);
+        while(count != 0) {
+            ssize_t written = ::write(STDOUT_FILENO, p, count);
+            if(written == -1)
+                return ERROR_GIVE_UP;
+            p += written;
+            count -= written;
+        }
+        return SUCCESS;
+    }
+};
+
+int usage()
+{
+    std::cerr << "usage: reckless_merge [-o OUTPUT] SHARD..." << std::endl;
+    return 2;
+}
+
+}
+
+int main(int argc, char* argv[])
+{
+    char const* output_path = nullptr;
+    int arg = 1;
+    if(arg + 1 < argc and std::strcmp(argv[arg], "-o") == 0) {
+        output_path = argv[arg + 1];
+        arg += 2;
+    }
+    if(arg == argc)
+        return usage();
+
+    std::vector<std::pair<char const*, std::size_t>> shards;
+    for(; arg != argc; ++arg) {
+        int fd = open(argv[arg], O_RDONLY);
+        struct stat st;
+        if(fd == -1 or fstat(fd, &st) == -1) {
+            std::cerr << "reckless_merge: cannot open " << argv[arg] << std::endl;
+            return 1;
+        }
+        std::size_t size = static_cast<std::size_t>(st.st_size);
+        void* pdata = nullptr;
+        if(size != 0) {
+            pdata = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if(pdata == MAP_FAILED) {
+                std::cerr << "reckless_merge: cannot map " << argv[arg] << std::endl;
+                return 1;
+            }
+            madvise(pdata, size, MADV_SEQUENTIAL);
+        }
+        close(fd);
+        shards.emplace_back(static_cast<char const*>(pdata), size);
+    }
+
+    try {
+        std::unique_ptr<reckless::writer> pwriter;
+        if(output_path)
+            pwriter.reset(new reckless::file_writer(output_path));
+        else
+            pwriter.reset(new stdout_writer());
+        reckless::merge_log_shards(shards, pwriter.get());
+    } catch(std::exception const& e) {
+        std::cerr << "reckless_merge: " << e.what() << std::endl;
+        return 1;
+    }
+    return 0;
+}